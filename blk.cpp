@@ -3,6 +3,42 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <charconv>
+#include <cmath>
+#include <cerrno>
+#include <cstdarg>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <new>
+#include <chrono>
+#include <filesystem>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+//min/max macros of windows.h break std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using LiteMath::cross;
 using LiteMath::dot;
@@ -22,93 +58,443 @@ using LiteMath::uint2;
 using LiteMath::uint3;
 using LiteMath::uint4;
 
-int cur_line = 0;
-bool in_comment_assume = false;
-bool in_comment = false;
+#ifdef _WIN32
+static long long blk_sys_write(int fd, const char *data, size_t size)
+{
+  return _write(fd, data, (unsigned)std::min<size_t>(size, 1u << 30));
+}
+static int blk_sys_open_for_write(const char *path)
+{
+  return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+static int blk_sys_close(int fd) { return _close(fd); }
+static int blk_sys_fsync(int fd) { return _commit(fd); }
+static int blk_sys_fileno(FILE *file) { return _fileno(file); }
+static bool blk_sys_replace_file(const char *from, const char *to, bool sync)
+{
+  DWORD flags = MOVEFILE_REPLACE_EXISTING | (sync ? MOVEFILE_WRITE_THROUGH : 0);
+  if (MoveFileExA(from, to, flags))
+    return true;
+  errno = EIO;
+  return false;
+}
+#else
+static long long blk_sys_write(int fd, const char *data, size_t size) { return ::write(fd, data, size); }
+static int blk_sys_open_for_write(const char *path)
+{
+  return ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+static int blk_sys_close(int fd) { return ::close(fd); }
+static int blk_sys_fsync(int fd) { return ::fsync(fd); }
+static int blk_sys_fileno(FILE *file) { return ::fileno(file); }
+static bool blk_sys_replace_file(const char *from, const char *to, bool sync)
+{
+  if (::rename(from, to) != 0)
+    return false;
+  if (sync)
+  {
+    //rename is durable only after the directory entry itself is synced
+    std::string dir = to;
+    size_t slash = dir.find_last_of('/');
+    dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : dir.substr(0, slash));
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dir_fd >= 0)
+    {
+      ::fsync(dir_fd);
+      ::close(dir_fd);
+    }
+  }
+  return true;
+}
+#endif
+
+std::string base_blk_path;
+//parser state, every thread parses its own file
+thread_local bool in_comment_assume = false;
+thread_local bool in_comment = false;
+thread_local std::vector<const Block *> blocks_in_progress; //blocks that are being loaded, they are not complete yet
+
+//progress of the root file, included files are parsed from other strings and are not counted
+struct LoadProgress
+{
+  const char *root = nullptr;
+  size_t total = 0;
+  size_t next_report = 0;
+};
+thread_local LoadProgress load_progress;
+
+//FNV-1a, used for small hash tables
+static inline uint64_t hash_string(std::string_view s)
+{
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (unsigned char c : s)
+    h = (h ^ c) * 0x100000001B3ull;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t hash_key(std::string_view s) { return hash_string(s); }
+static inline uint64_t hash_key(unsigned v) { return (v * 0x9E3779B97F4A7C15ull) >> 20; }
+
+//open addressing table key -> id, it is not changed after build, so it can be read from many threads
+template <typename Key>
+class FlatIdTable
+{
+public:
+  //if a key is repeated, the last id is used
+  void build(const std::vector<std::pair<Key, unsigned>> &items)
+  {
+    size_t capacity = 8;
+    while (capacity < 2 * items.size())
+      capacity *= 2;
+    mask = capacity - 1;
+    keys.assign(capacity, Key());
+    ids.assign(capacity, -1);
+    for (const auto &item : items)
+    {
+      size_t pos = hash_key(item.first) & mask;
+      while (ids[pos] >= 0 && keys[pos] != item.first)
+        pos = (pos + 1) & mask;
+      keys[pos] = item.first;
+      ids[pos] = item.second;
+    }
+  }
+  int find(Key key) const
+  {
+    if (ids.empty())
+      return -1;
+    for (size_t pos = hash_key(key) & mask;; pos = (pos + 1) & mask)
+    {
+      if (ids[pos] < 0)
+        return -1;
+      if (keys[pos] == key)
+        return ids[pos];
+    }
+  }
+
+private:
+  size_t mask = 0;
+  std::vector<Key> keys;
+  std::vector<int> ids;
+};
+
+template <typename Hash>
+static int find_in_perfect_hash(const BlkEnumPerfectHash &table, Hash hash)
+{
+  uint32_t displacement = table.displacement[hash(0) & table.bucket_mask];
+  return table.slots[hash(displacement) & table.slot_mask];
+}
 
 struct EnumInfo
 {
   std::string name;
+  const BlkStaticEnum *static_info = nullptr; //set for enums registered with REGISTER_ENUM_STATIC
+  //for static enums the vectors below are filled only when public API asks for them
   std::vector<std::pair<std::string, unsigned>> raw_info;
-  std::map<std::string, unsigned> id_by_name;
-  std::map<unsigned,    unsigned> id_by_val;
+  FlatIdTable<std::string_view> id_by_name; //keys point to strings in raw_info
+  FlatIdTable<unsigned> id_by_val;
   std::vector<const char *> names;
   std::vector<unsigned> values;
+  std::once_flag public_tables_once;
+
+  const char *value_name(unsigned id) const 
+  { 
+    return static_info ? static_info->values[id].name : names[id]; 
+  }
+  unsigned value(unsigned id) const 
+  { 
+    return static_info ? static_info->values[id].value : values[id]; 
+  }
+  int find_name(std::string_view val_name) const
+  {
+    if (!static_info)
+      return id_by_name.find(val_name);
+    int id = find_in_perfect_hash(static_info->by_name, [val_name](uint64_t seed) {
+      return blk_enum_hash(val_name.data(), val_name.size(), seed);
+    });
+    return (id >= 0 && val_name == static_info->values[id].name) ? id : -1;
+  }
+  int find_value(unsigned val) const
+  {
+    if (!static_info)
+      return id_by_val.find(val);
+    int id = find_in_perfect_hash(static_info->by_value, [val](uint64_t seed) { return blk_enum_hash(val, seed); });
+    return (id >= 0 && static_info->values[id].value == val) ? id : -1;
+  }
 };
 
-int MAX_ENUMS = 1024;
-std::vector<EnumInfo>& get_enum_info() {
-    static std::vector<EnumInfo> g_enum_info;
-    return g_enum_info;
-}
-std::map<std::string, unsigned>& get_enum_info_by_name() {
-    static std::map<std::string, unsigned> g_enum_info_by_name;
-    return g_enum_info_by_name;
+//static enums that are not added to registry yet, constant initialized so it can be used at static init
+static std::atomic<BlkStaticEnumLoader *> pending_static_enums{nullptr};
+
+//Registered enums are never moved or changed, so lookups do not take any locks.
+//Registration is serialized and publishes an enum only when it is completely built.
+//Storage is intentionally never freed, enums can be used by other static objects on exit
+class EnumRegistry
+{
+public:
+  EnumRegistry()
+  {
+    for (auto &segment : segments)
+      segment.store(nullptr);
+    name_table.store(new NameTable(64));
+  }
+
+  const EnumInfo &info(unsigned type_id) const
+  {
+    unsigned segment, offset;
+    locate(type_id, segment, offset);
+    return segments[segment].load(std::memory_order_acquire)[offset];
+  }
+
+  int find(std::string_view name)
+  {
+    if (pending_static_enums.load(std::memory_order_acquire))
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      add_pending_static_enums();
+    }
+    int type_id = find_published(name);
+    if (type_id < 0 && has_static_enums.load(std::memory_order_acquire))
+    {
+      //other thread could take pending static enums and still be adding them
+      std::lock_guard<std::mutex> lock(mutex);
+      type_id = find_published(name);
+    }
+    return type_id;
+  }
+
+  bool add(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values);
+
+  //tables returned by public API, for static enums they are created on the first request
+  const EnumInfo &public_info(unsigned type_id);
+
+private:
+  int find_published(std::string_view name) const
+  {
+    const NameTable *table = name_table.load(std::memory_order_acquire);
+    for (size_t pos = hash_string(name) & table->mask;; pos = (pos + 1) & table->mask)
+    {
+      int id = table->ids[pos].load(std::memory_order_acquire);
+      if (id < 0)
+        return -1;
+      if (info(id).name == name)
+        return id;
+    }
+  }
+
+  EnumInfo *create(const std::string &name);
+  void publish(const std::string &name);
+  void add_pending_static_enums();
+
+  //segment k holds FIRST_SEGMENT_SIZE << k enums, so the registry grows without moving them
+  static constexpr unsigned FIRST_SEGMENT_SIZE = 32;
+  static constexpr unsigned SEGMENTS = 26;
+
+  struct NameTable
+  {
+    NameTable(size_t capacity) : mask(capacity - 1), ids(new std::atomic<int>[capacity])
+    {
+      for (size_t i = 0; i < capacity; i++)
+        ids[i].store(-1, std::memory_order_relaxed);
+    }
+    size_t mask;
+    std::unique_ptr<std::atomic<int>[]> ids;
+  };
+
+  static void locate(unsigned type_id, unsigned &segment, unsigned &offset)
+  {
+    unsigned n = type_id / FIRST_SEGMENT_SIZE + 1;
+    segment = 0;
+    while (n >>= 1)
+      segment++;
+    offset = type_id - FIRST_SEGMENT_SIZE * ((1u << segment) - 1);
+  }
+
+  static void insert_name(NameTable &table, const std::string &name, int id)
+  {
+    size_t pos = hash_string(name) & table.mask;
+    while (table.ids[pos].load(std::memory_order_relaxed) >= 0)
+      pos = (pos + 1) & table.mask;
+    table.ids[pos].store(id, std::memory_order_release);
+  }
+
+  std::atomic<EnumInfo *> segments[SEGMENTS];
+  std::atomic<NameTable *> name_table;
+  std::vector<NameTable *> old_name_tables; //readers can still use them
+  unsigned count = 0;
+  std::atomic<bool> has_static_enums{false};
+  std::mutex mutex;
+};
+
+BlkStaticEnumLoader::BlkStaticEnumLoader(const BlkStaticEnum &info) : info(&info)
+{
+  next = pending_static_enums.load(std::memory_order_relaxed);
+  while (!pending_static_enums.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+    ;
 }
 
-void register_enum_info(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values)
+//returns slot for the new enum, it is not visible until publish is called. Should be called under mutex
+EnumInfo *EnumRegistry::create(const std::string &name)
 {
-  if (get_enum_info().capacity() == 0)
-    get_enum_info().reserve(MAX_ENUMS);
-  if (get_enum_info().size() >= MAX_ENUMS)
+  if (find_published(name) >= 0)
+  {
+    fprintf(stderr, "[register_enum_info::ERROR] enum %s already registered\n", name.c_str());
+    return nullptr;
+  }
+  unsigned segment, offset;
+  locate(count, segment, offset);
+  if (segment >= SEGMENTS)
   {
     fprintf(stderr, "[register_enum_info::ERROR] too many enums\n");
-    return;
+    return nullptr;
   }
-  auto it = get_enum_info_by_name().find(name);
-  if (it != get_enum_info_by_name().end())
-    fprintf(stderr, "[register_enum_info::ERROR] enum %s already registered\n", name.c_str());
-  else
+  if (!segments[segment].load(std::memory_order_relaxed))
+    segments[segment].store(new EnumInfo[FIRST_SEGMENT_SIZE << segment], std::memory_order_release);
+  EnumInfo *info = segments[segment].load(std::memory_order_relaxed) + offset;
+  info->name = name;
+  return info;
+}
+
+void EnumRegistry::publish(const std::string &name)
+{
+  //name table is kept at most half full, a bigger copy replaces it when needed
+  NameTable *table = name_table.load(std::memory_order_relaxed);
+  if (2 * (count + 1) > table->mask + 1)
   {
-    get_enum_info().emplace_back();
-    get_enum_info_by_name()[name] = get_enum_info().size() - 1;
-    EnumInfo &info = get_enum_info().back();
-    info.name = name;
-    info.raw_info = values;
-    for (unsigned i = 0; i < values.size(); i++)
-    {
-      info.names.push_back(info.raw_info[i].first.c_str());
-      info.values.push_back(info.raw_info[i].second);
-      bool is_valid_name = true;
-      for (unsigned j = 0; j < values[i].first.size(); j++)
-      {
-        bool lower = values[i].first[j] >= 'a' && values[i].first[j] <= 'z';
-        bool upper = values[i].first[j] >= 'A' && values[i].first[j] <= 'Z';
-        bool digit = values[i].first[j] >= '0' && values[i].first[j] <= '9';
-        bool underscore = values[i].first[j] == '_';
-        if (!lower && !upper && (!digit || j == 0) && !underscore)
-        {
-          fprintf(stderr, "[register_enum_info::ERROR] enum %s name %s has invalid character %c\n", 
-                  name.c_str(), values[i].first.c_str(), values[i].first[j]);
-          is_valid_name = false;
-          break;
-        }
-      }
-      if (!is_valid_name)
-        continue;
-      if (info.id_by_name.find(values[i].first) != info.id_by_name.end())
-        fprintf(stderr, "[register_enum_info::ERROR] enum %s has repeated name %s\n", name.c_str(), values[i].first.c_str());
-      info.id_by_name[values[i].first] = i;
+    NameTable *bigger = new NameTable(2 * (table->mask + 1));
+    for (unsigned id = 0; id < count; id++)
+      insert_name(*bigger, this->info(id).name, id);
+    old_name_tables.push_back(table);
+    name_table.store(bigger, std::memory_order_release);
+    table = bigger;
+  }
+  insert_name(*table, name, count);
+  count++;
+}
+
+//static enums are already validated and hashed, registry only references their tables
+void EnumRegistry::add_pending_static_enums()
+{
+  BlkStaticEnumLoader *loader = pending_static_enums.exchange(nullptr, std::memory_order_acquire);
+  if (loader)
+    has_static_enums.store(true, std::memory_order_release);
+  for (; loader; loader = loader->next)
+  {
+    EnumInfo *info = create(loader->info->name);
+    if (!info)
+      continue;
+    info->static_info = loader->info;
+    publish(info->name);
+  }
+}
+
+const EnumInfo &EnumRegistry::public_info(unsigned type_id)
+{
+  EnumInfo &info = const_cast<EnumInfo &>(this->info(type_id));
+  std::call_once(info.public_tables_once, [&info]() {
+    if (!info.static_info)
+      return;
+    for (unsigned i = 0; i < info.static_info->count; i++)
+    {
+      info.raw_info.emplace_back(info.static_info->values[i].name, info.static_info->values[i].value);
+      info.names.push_back(info.static_info->values[i].name);
+      info.values.push_back(info.static_info->values[i].value);
+    }
+  });
+  return info;
+}
 
-      if (info.id_by_val.find(values[i].second) != info.id_by_val.end())
-        fprintf(stderr, "[register_enum_info::ERROR] enum %s has repeated value %u\n", name.c_str(), values[i].second);
-      info.id_by_val[values[i].second] = i;
+bool EnumRegistry::add(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  add_pending_static_enums();
+  EnumInfo *info_ptr = create(name);
+  if (!info_ptr)
+    return false;
+  EnumInfo &info = *info_ptr;
+  info.raw_info = values;
+  std::vector<std::pair<std::string_view, unsigned>> by_name;
+  std::vector<std::pair<unsigned, unsigned>> by_val;
+  //repeats are found with hash sets, big enums are registered in linear time
+  std::unordered_set<std::string_view> seen_names;
+  std::unordered_set<unsigned> seen_values;
+  seen_names.reserve(values.size());
+  seen_values.reserve(values.size());
+  for (unsigned i = 0; i < values.size(); i++)
+  {
+    info.names.push_back(info.raw_info[i].first.c_str());
+    info.values.push_back(info.raw_info[i].second);
+    bool is_valid_name = true;
+    for (unsigned j = 0; j < values[i].first.size(); j++)
+    {
+      bool lower = values[i].first[j] >= 'a' && values[i].first[j] <= 'z';
+      bool upper = values[i].first[j] >= 'A' && values[i].first[j] <= 'Z';
+      bool digit = values[i].first[j] >= '0' && values[i].first[j] <= '9';
+      bool underscore = values[i].first[j] == '_';
+      if (!lower && !upper && (!digit || j == 0) && !underscore)
+      {
+        fprintf(stderr, "[register_enum_info::ERROR] enum %s name %s has invalid character %c\n", 
+                name.c_str(), values[i].first.c_str(), values[i].first[j]);
+        is_valid_name = false;
+        break;
+      }
     }
+    if (!is_valid_name)
+      continue;
+    if (!seen_names.insert(info.raw_info[i].first).second)
+      fprintf(stderr, "[register_enum_info::ERROR] enum %s has repeated name %s\n", name.c_str(), values[i].first.c_str());
+    by_name.emplace_back(info.raw_info[i].first, i);
+
+    if (!seen_values.insert(values[i].second).second)
+      fprintf(stderr, "[register_enum_info::ERROR] enum %s has repeated value %u\n", name.c_str(), values[i].second);
+    by_val.emplace_back(values[i].second, i);
   }
+  info.id_by_name.build(by_name);
+  info.id_by_val.build(by_val);
+  publish(name);
+  return true;
+}
+
+static EnumRegistry &enum_registry()
+{
+  static EnumRegistry *registry = new EnumRegistry();
+  return *registry;
+}
+
+static const EnumInfo &enum_info(unsigned type_id)
+{
+  return enum_registry().info(type_id);
+}
+
+//returns -1 if enum is not registered
+static int find_enum_type(std::string_view name)
+{
+  return enum_registry().find(name);
+}
+
+//last enum lookups made by text parser, reset for every parsed string
+struct EnumParseCache
+{
+  std::string type_name;
+  int type_id = -2; //-2 if nothing was looked up yet
+  std::string val_name;
+  int val_id = -1;
+};
+thread_local EnumParseCache enum_parse_cache;
+
+void register_enum_info(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values)
+{
+  enum_registry().add(name, values);
 }
 
 const std::vector<std::pair<std::string, unsigned>> *get_enum_info(const std::string &name)
 {
-  auto it = get_enum_info_by_name().find(name);
-  if (it != get_enum_info_by_name().end())
-    return &(get_enum_info()[it->second].raw_info);
-  else
-    return nullptr;
+  int type_id = find_enum_type(name);
+  return type_id >= 0 ? &(enum_registry().public_info(type_id).raw_info) : nullptr;
 }
 
 std::vector<const char *> *get_enum_names(unsigned type_id)
 {
-  return &(get_enum_info()[type_id].names);
+  return const_cast<std::vector<const char *> *>(&(enum_registry().public_info(type_id).names));
 }
 
 BlkEnumLoader::BlkEnumLoader(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values)
@@ -116,11 +502,39 @@ BlkEnumLoader::BlkEnumLoader(const std::string &name, const std::vector<std::pai
   register_enum_info(name, values);
 }
 
-bool is_empty(const char c)
+//problems of the text being parsed, only offsets are known here, lines are counted when parsing ends
+thread_local std::vector<BlkDiagnostic> parse_diagnostics;
+
+static void add_parse_diagnostic(BlkDiagnostic::Severity severity, int pos, const char *format, va_list args)
+{
+  char message[1024];
+  vsnprintf(message, sizeof(message), format, args);
+  BlkDiagnostic d;
+  d.severity = severity;
+  d.offset = pos;
+  d.message = message;
+  parse_diagnostics.push_back(std::move(d));
+}
+
+static void parse_error(int pos, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  add_parse_diagnostic(BlkDiagnostic::Severity::ERROR, pos, format, args);
+  va_end(args);
+}
+
+static void parse_warning(int pos, const char *format, ...)
 {
-  if (c == '\n')
-    cur_line++;
+  va_list args;
+  va_start(args, format);
+  add_parse_diagnostic(BlkDiagnostic::Severity::WARNING, pos, format, args);
+  va_end(args);
+}
 
+bool is_empty(const char *data, int cur_pos)
+{
+  const char c = data[cur_pos];
   if (in_comment)
   {
     if (c == '\n')
@@ -147,7 +561,7 @@ bool is_empty(const char c)
     }
     else
     {
-      fprintf(stderr, "line %d hanging / found", cur_line);
+      parse_warning(cur_pos - 1, "hanging / found");
       in_comment_assume = false;
     }
   }
@@ -165,7 +579,7 @@ std::string next_token(const char *data, int &pos)
     res = "";
   else
   {
-    while (is_empty(data[pos]))
+    while (data[pos] != 0 && is_empty(data, pos))
       pos++;
     if (data[pos] == 0)
       res = "";
@@ -180,7 +594,7 @@ std::string next_token(const char *data, int &pos)
       {
         const char *start = data + pos;
         int sz = 0;
-        while (!is_div(data[pos]) && !is_empty(data[pos]) && data[pos] != 0)
+        while (!is_div(data[pos]) && !is_empty(data, pos) && data[pos] != 0)
         {
           pos++;
           sz++;
@@ -256,7 +670,7 @@ std::string read_string(const char *data, int &cur_pos)
         if (!found)
         {
           s.push_back(data[cur_pos]);
-          fprintf(stderr, "line %d unknown escape sequence", cur_line);
+          parse_warning(cur_pos, "unknown escape sequence");
         }
         state = State::NORMAL;
       }
@@ -306,7 +720,7 @@ std::string read_string(const char *data, int &cur_pos)
       }
       else
       {
-        fprintf(stderr, "line %d broken hex escape sequence", cur_line);
+        parse_warning(cur_pos, "broken hex escape sequence");
         s.push_back('\\');
         s.push_back('x');
         state = State::NORMAL;
@@ -343,46 +757,285 @@ std::string read_string(const char *data, int &cur_pos)
 }
 
 // saves string with escape sequences and hex for unprintable characters
-std::string save_string(const std::string &s)
+void save_string(BlockWriter &w, const std::string &s)
 {
   const char *hex_chars = "0123456789ABCDEF";
-  std::string res;
-  res.reserve(s.size() * 2);
+  int plain_start = 0;
   for (int i = 0; i < s.size(); i++)
   {
-    bool found = false;
-    for (int j = 0; j < CHARS_COUNT; j++)
+    const char *esc = (const char *)memchr(esc_codes, s[i], CHARS_COUNT);
+    if (!esc && (unsigned char)s[i] >= 32)
+      continue;
+    w.write(s.data() + plain_start, i - plain_start);
+    plain_start = i + 1;
+    w.put('\\');
+    if (esc)
+      w.put(esc_chars[esc - esc_codes]);
+    else
+    {
+      w.put('x');
+      w.put(hex_chars[s[i] / 16]);
+      w.put(hex_chars[s[i] % 16]);
+    }
+  }
+  w.write(s.data() + plain_start, s.size() - plain_start);
+}
+
+static std::string canonical_blk_path(const std::string &path)
+{
+  std::error_code ec;
+  std::filesystem::path p = std::filesystem::weakly_canonical(path, ec);
+  return ec ? path : p.string();
+}
+//type of value by its tag, EMPTY for unknown tags
+static Block::ValueType value_type_by_tag(const std::string &tag)
+{
+  const char *t = tag.c_str();
+  switch (tag.size())
+  {
+  case 1:
+    switch (t[0])
+    {
+    case 'b': return Block::ValueType::BOOL;
+    case 'i': return Block::ValueType::INT;
+    case 'u': return Block::ValueType::UINT64;
+    case 'r': return Block::ValueType::DOUBLE;
+    case 's': return Block::ValueType::STRING;
+    }
+    break;
+  case 2:
+    if (t[1] >= '2' && t[1] <= '4')
+    {
+      if (t[0] == 'p')
+        return Block::ValueType(Block::ValueType::VEC2 + t[1] - '2');
+      if (t[0] == 'i')
+        return Block::ValueType(Block::ValueType::IVEC2 + t[1] - '2');
+      if (t[0] == 'm' && t[1] == '4')
+        return Block::ValueType::MAT4;
+    }
+    break;
+  case 3:
+    if (tag == "u64")
+      return Block::ValueType::UINT64;
+    if (tag == "arr")
+      return Block::ValueType::ARRAY;
+    break;
+  }
+  if (tag.size() > 2 && t[0] == 'e' && t[1] == '_')
+    return Block::ValueType::ENUM;
+  return Block::ValueType::EMPTY;
+}
+
+static double parse_double(const std::string &s) { return std::stod(s); }
+static float parse_float(const std::string &s) { return std::stof(s); }
+static int parse_int(const std::string &s) { return std::stoi(s); }
+
+//reads N comma separated components of vector or matrix, stops at the first missing comma
+template<typename T, int N>
+static bool read_components(const char *data, int &cur_pos, T (&res)[N], T (*parse)(const std::string &),
+                            Block::Value &v, const char *error)
+{
+  for (int i = 0; i < N; i++)
+  {
+    if (i > 0 && next_token(data, cur_pos) != ",")
+    {
+      parse_error(cur_pos, "%s", error);
+      v.type = Block::ValueType::EMPTY;
+      return false;
+    }
+    res[i] = parse(next_token(data, cur_pos));
+  }
+  return true;
+}
+
+//blocks and arrays are only opened here, their content is read by BlkParser
+enum class ReadValueResult
+{
+  FAILED,
+  DONE,
+  BLOCK,
+  ARRAY
+};
+
+//value after "<type> =", blocks are not read here
+static ReadValueResult read_typed_value(const char *data, int &cur_pos, const std::string &type, Block::Value &v)
+{
+  switch (value_type_by_tag(type))
+  {
+  case Block::ValueType::BOOL:
+  {
+    std::string val = next_token(data, cur_pos);
+    v.type = Block::ValueType::BOOL;
+    v.b = val == "true" || val == "True" || val == "TRUE";
+    break;
+  }
+  case Block::ValueType::INT:
+    v.type = Block::ValueType::INT;
+    v.i = std::stol(next_token(data, cur_pos));
+    break;
+  case Block::ValueType::UINT64:
+    v.type = Block::ValueType::UINT64;
+    v.u = std::stoul(next_token(data, cur_pos));
+    break;
+  case Block::ValueType::DOUBLE:
+    v.type = Block::ValueType::DOUBLE;
+    v.d = std::stod(next_token(data, cur_pos));
+    break;
+  case Block::ValueType::VEC2:
+  {
+    double c[2];
+    if (!read_components(data, cur_pos, c, parse_double, v, "wrong description of vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::VEC2;
+    v.v2 = float2(c[0], c[1]);
+    break;
+  }
+  case Block::ValueType::VEC3:
+  {
+    double c[3];
+    if (!read_components(data, cur_pos, c, parse_double, v, "wrong description of vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::VEC3;
+    v.v3 = float3(c[0], c[1], c[2]);
+    break;
+  }
+  case Block::ValueType::VEC4:
+  {
+    double c[4];
+    if (!read_components(data, cur_pos, c, parse_double, v, "wrong description of vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::VEC4;
+    v.v4 = float4(c[0], c[1], c[2], c[3]);
+    break;
+  }
+  case Block::ValueType::IVEC2:
+  {
+    int c[2];
+    if (!read_components(data, cur_pos, c, parse_int, v, "wrong description of integer vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::IVEC2;
+    v.iv2 = int2(c[0], c[1]);
+    break;
+  }
+  case Block::ValueType::IVEC3:
+  {
+    int c[3];
+    if (!read_components(data, cur_pos, c, parse_int, v, "wrong description of integer vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::IVEC3;
+    v.iv3 = int3(c[0], c[1], c[2]);
+    break;
+  }
+  case Block::ValueType::IVEC4:
+  {
+    int c[4];
+    if (!read_components(data, cur_pos, c, parse_int, v, "wrong description of integer vector"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::IVEC4;
+    v.iv4 = int4(c[0], c[1], c[2], c[3]);
+    break;
+  }
+  case Block::ValueType::MAT4:
+  {
+    float m[16];
+    if (!read_components(data, cur_pos, m, parse_float, v, "wrong description of matrix"))
+      return ReadValueResult::FAILED;
+    v.type = Block::ValueType::MAT4;
+    v.m4 = float4x4(m[0], m[4], m[8], m[12],
+                    m[1], m[5], m[9], m[13],
+                    m[2], m[6], m[10], m[14],
+                    m[3], m[7], m[11], m[15]);
+    break;
+  }
+  case Block::ValueType::ENUM:
+  {
+    v.type = Block::ValueType::ENUM;
+
+    std::string_view type_name = std::string_view(type).substr(2);
+    std::string name = next_token(data, cur_pos);
+
+    //values of the same enum usually go one after another, so remember the last lookups
+    EnumParseCache &cache = enum_parse_cache;
+    if (cache.type_id == -2 || cache.type_name != type_name)
     {
-      if (s[i] == esc_codes[j])
+      cache.type_name = type_name;
+      cache.type_id = find_enum_type(type_name);
+      cache.val_name.clear();
+    }
+    int val_id = -1;
+    if (cache.type_id < 0)
+      parse_warning(cur_pos, "enum %s is not registered", cache.type_name.c_str());
+    else if (!cache.val_name.empty() && cache.val_name == name)
+      val_id = cache.val_id;
+    else
+    {
+      val_id = enum_info(cache.type_id).find_name(name);
+      if (val_id >= 0)
       {
-        res.push_back('\\');
-        res.push_back(esc_chars[j]);
-        found = true;
-        break;
+        cache.val_name = name;
+        cache.val_id = val_id;
       }
+      else
+        parse_warning(cur_pos, "enum %s has no value %s", cache.type_name.c_str(), name.c_str());
+    }
+
+    if (val_id < 0)
+    {
+      v.ev.type_id = 0;
+      v.ev.val_id  = 0; //it is an error, but we can ignore it and hope the user code will deal with it
     }
-    if (!found && s[i] < 32)
+    else
     {
-      res.push_back('\\');
-      res.push_back('x');
-      res.push_back(hex_chars[s[i] / 16]);
-      res.push_back(hex_chars[s[i] % 16]);
+      v.ev.type_id = cache.type_id;
+      v.ev.val_id  = val_id;
     }
-    else if (!found)
-      res.push_back(s[i]);
+    break;
   }
-  return res;
+  case Block::ValueType::STRING:
+  {
+    std::string par = next_token(data, cur_pos);
+    if (par == "\"")
+    {
+      std::string s = read_string(data, cur_pos);
+      if (data[cur_pos] == 0)
+      {
+        v.type = Block::ValueType::EMPTY;
+        parse_error(cur_pos, "expected \" at the end of a string");
+        return ReadValueResult::FAILED;
+      }
+      else if (data[cur_pos] == '\"')
+      {
+        cur_pos++;
+        v.type = Block::ValueType::STRING;
+        v.s = new std::string(s);
+      }
+    }
+    break;
+  }
+  case Block::ValueType::ARRAY:
+    v.type = Block::ValueType::ARRAY;
+    v.a = new Block::DataArray();
+    //{ <value>, <value>, ... <value>}
+    if (next_token(data, cur_pos) != "{")
+    {
+      parse_error(cur_pos, "expected { at the start of array");
+      return ReadValueResult::FAILED;
+    }
+    return ReadValueResult::ARRAY;
+  default:
+    break;
+  }
+
+  return ReadValueResult::DONE;
 }
 
-bool load_block(const char *data, int &cur_pos, Block &b, const Block &global_parent);
-bool read_array(const char *data, int &cur_pos, Block::DataArray &a);
-bool read_value(const char *data, int &cur_pos, Block::Value &v, const Block &parent, const Block &global_parent)
+ReadValueResult read_value(const char *data, int &cur_pos, Block::Value &v, const Block &global_parent,
+                           const Block **block_to_extend)
 {
   std::string token = next_token(data, cur_pos);
   //:<type> = <description> or { <block> }
   if (token == "{" || token == "extends")
   {
-    const Block *block_to_extend = nullptr;
     // extends <parent_block_name> { <block> }
     if (token == "extends")
     {
@@ -390,28 +1043,19 @@ bool read_value(const char *data, int &cur_pos, Block::Value &v, const Block &pa
       std::string next_tok = next_token(data, cur_pos);
       if (next_tok != "{")
       {
-        fprintf(stderr, "line %d expected { after extends <parent_block_name>", cur_line);
+        parse_error(cur_pos, "expected { after extends <parent_block_name>");
         v.type = Block::ValueType::EMPTY;
-        return false;
+        return ReadValueResult::FAILED;
       }
-      block_to_extend = global_parent.get_block_rec(name);
-      if (!block_to_extend)
+      *block_to_extend = global_parent.get_block_rec(name);
+      if (!*block_to_extend)
       {
-        printf("Warning: block %s is set to be parent for extension, but was not found\n", name.c_str());
+        parse_warning(cur_pos, "block %s is set to be parent for extension, but was not found", name.c_str());
       }
     }
     v.bl = new Block();
     v.type = Block::ValueType::BLOCK;
-    bool loaded = load_block(data, cur_pos, *(v.bl), global_parent);
-    if (loaded && block_to_extend)
-    {
-      Block *det_blk = v.bl;
-      v.bl = new Block();
-      v.bl->copy(block_to_extend);
-      v.bl->add_detalization(*det_blk);
-      delete det_blk;
-    }
-    return loaded;
+    return ReadValueResult::BLOCK;
   }
   else if (token == ":")
   { // simple value or array
@@ -419,1473 +1063,5588 @@ bool read_value(const char *data, int &cur_pos, Block::Value &v, const Block &pa
     if (type == "tag")
     {
       v.type = Block::ValueType::EMPTY;
-      return true;
+      return ReadValueResult::DONE;
     }
     std::string eq = next_token(data, cur_pos);
     if (eq != "=")
     {
-      fprintf(stderr, "line %d expected = after value type", cur_line);
+      parse_error(cur_pos, "expected = after value type");
       v.type = Block::ValueType::EMPTY;
-      return false;
-    }
-    if (type == "b")
-    {
-      std::string val = next_token(data, cur_pos);
-      v.type = Block::ValueType::BOOL;
-      v.b = val == "true" || val == "True" || val == "TRUE";
-    }
-    else if (type == "i")
-    {
-      std::string val = next_token(data, cur_pos);
-      v.type = Block::ValueType::INT;
-      v.i = std::stol(val);
+      return ReadValueResult::FAILED;
     }
-    else if (type == "u" || type == "u64")
+    return read_typed_value(data, cur_pos, type, v);
+  }
+  else
+  {
+    parse_error(cur_pos, "expected : or { after value/block name, but %s got", token.c_str());
+    v.type = Block::ValueType::EMPTY;
+    return ReadValueResult::FAILED;
+  }
+}
+enum class ReadArrayResult
+{
+  FAILED,
+  NEXT,
+  END
+};
+
+//reads one value of array and separator after it
+// <value> := "string" or <double>
+// all values should have the same type
+static ReadArrayResult read_array_value(const char *data, int &cur_pos, Block::DataArray &a, Block::ValueType &array_type)
+{
+  Block::Value val;
+  std::string tok = next_token(data, cur_pos);
+  if (tok == "}")
+  {
+    a.type = Block::ValueType::DOUBLE;
+    return ReadArrayResult::END;
+  }
+  if (tok.empty())
+    parse_warning(cur_pos, "empty token in array");
+  else if (tok == "\"")
+  {
+    std::string s = read_string(data, cur_pos);
+    if (data[cur_pos] == 0)
     {
-      std::string val = next_token(data, cur_pos);
-      v.type = Block::ValueType::UINT64;
-      v.u = std::stoul(val);
+      val.type = Block::ValueType::EMPTY;
+      parse_error(cur_pos, "expected \" at the end of a string in string array");
+      return ReadArrayResult::FAILED;
     }
-    else if (type == "r")
+    else if (data[cur_pos] == '\"')
     {
-      std::string val = next_token(data, cur_pos);
-      v.type = Block::ValueType::DOUBLE;
-      v.d = std::stod(val);
+      cur_pos++;
+      val.type = Block::ValueType::STRING;
+      val.s = new std::string(s);
     }
-    else if (type == "p2")
-    {
-      v.type = Block::ValueType::VEC2;
-      std::string val;
-      bool ok = true;
-      v.v2 = float2(0, 0);
-
-      val = next_token(data, cur_pos);
-      v.v2.x = std::stod(val);
+  }
+  else
+  {
+    val.type = Block::ValueType::DOUBLE;
+    val.d = std::stod(tok);
+  }
+  if (a.values.empty())
+    array_type = val.type;
+  else if (array_type != val.type)
+    parse_warning(cur_pos, "array has values of diffrent types");
+  a.values.push_back(val);
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
+  tok = next_token(data, cur_pos);
+  if (tok == "}")
+  {
+    a.type = array_type;
+    return ReadArrayResult::END;
+  }
+  if (tok != ",")
+  {
+    parse_error(cur_pos, "expected } at the end of array");
+    return ReadArrayResult::FAILED;
+  }
+  return ReadArrayResult::NEXT;
+}
 
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v2.y = std::stod(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
-    }
-    else if (type == "p3")
-    {
-      v.type = Block::ValueType::VEC3;
-      std::string val;
-      bool ok = true;
-      v.v3 = float3(0, 0, 0);
+//Frames of blocks and the array being read replace the call stack of recursive parser, so parsing
+//can stop after any value. Parser globals are swapped in only for the duration of step
+struct BlkParser::State
+{
+  struct Frame
+  {
+    Block *block;
+    Block::Value *value; //value of the parent that holds this block, nullptr for root
+    const Block *block_to_extend;
+  };
 
-      val = next_token(data, cur_pos);
-      v.v3.x = std::stod(val);
+  std::string owned_text;
+  const char *data = nullptr;
+  size_t size = 0;
+  Block *root = nullptr;
+  BlkLoadOptions options;
+  Status status = Status::IN_PROGRESS;
+  bool started = false;
+  int cur_pos = 0;
+  std::vector<Frame> frames;
+  Block::DataArray *array = nullptr; //array that is being read
+  Block::ValueType array_type = Block::ValueType::DOUBLE;
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v3.y = std::stod(val);
-      }
+  std::string file; //only for diagnostics
+  std::vector<BlkDiagnostic> diagnostics;
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v3.z = std::stod(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
-    }
-    else if (type == "p4")
-    {
-      v.type = Block::ValueType::VEC4;
-      std::string val;
-      bool ok = true;
-      v.v4 = float4(0, 0, 0, 0);
+  //parser globals of this parse while it is not running
+  bool comment = false;
+  bool comment_assume = false;
+  std::vector<const Block *> in_progress;
+  EnumParseCache enum_cache;
+  LoadProgress progress;
 
-      val = next_token(data, cur_pos);
-      v.v4.x = std::stod(val);
+  void swap_globals()
+  {
+    std::swap(diagnostics, parse_diagnostics);
+    std::swap(comment, in_comment);
+    std::swap(comment_assume, in_comment_assume);
+    std::swap(in_progress, blocks_in_progress);
+    std::swap(enum_cache, enum_parse_cache);
+    std::swap(progress, load_progress);
+  }
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v4.y = std::stod(val);
-      }
+  void start(bool report_progress);
+  void parse_block_entry();
+  void close_block(bool loaded);
+  void finish_value(bool ok);
+  void finish(bool loaded);
+  void report_diagnostics();
+};
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v4.z = std::stod(val);
-      }
+//parser running on this thread, included files are parsed by nested parsers
+static thread_local BlkParser::State *active_parser = nullptr;
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.v4.w = std::stod(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
-    }
-    else if (type == "i2")
-    {
-      v.type = Block::ValueType::IVEC2;
-      std::string val;
-      bool ok = true;
-      v.iv2 = int2(0, 0);
+void BlkParser::State::start(bool report_progress)
+{
+  started = true;
+  *root = Block();
+  if (size == 0)
+  {
+    status = Status::FAILED;
+    return;
+  }
+  std::string token = next_token(data, cur_pos);
+  if (token != "{")
+  {
+    parse_error(cur_pos, "expected { at the start of text");
+    status = Status::FAILED;
+    return;
+  }
+  if (report_progress)
+    load_progress = {data, size, 0};
+  blocks_in_progress.push_back(root);
+  frames.push_back({root, nullptr, nullptr});
+}
 
-      val = next_token(data, cur_pos);
-      v.iv2.x = std::stoi(val);
+void BlkParser::State::finish(bool loaded)
+{
+  status = loaded ? Status::DONE : Status::FAILED;
+  if (load_progress.root)
+  {
+    load_progress = LoadProgress();
+    if (loaded)
+      options.progress(size, size);
+  }
+}
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
+//block is loaded or failed, extends is applied to it the same way as in recursive parser
+void BlkParser::State::close_block(bool loaded)
+{
+  Frame frame = frames.back();
+  frames.pop_back();
+  blocks_in_progress.pop_back();
+  if (frames.empty())
+  {
+    finish(loaded);
+    return;
+  }
+  Block::Value &v = *frame.value;
+  //lookup in the stack of open blocks is done only when it is needed, deep documents make it expensive
+  bool lazy_extend = loaded && frame.block_to_extend && options.lazy_extends &&
+                     std::find(blocks_in_progress.begin(), blocks_in_progress.end(), frame.block_to_extend) ==
+                         blocks_in_progress.end();
+  if (lazy_extend)
+  {
+    v.bl->extend_lazy(frame.block_to_extend);
+  }
+  else if (loaded && frame.block_to_extend)
+  {
+    Block *det_blk = v.bl;
+    v.bl = new Block();
+    v.bl->copy(frame.block_to_extend);
+    v.bl->add_detalization(*det_blk);
+    delete det_blk;
+  }
+  finish_value(loaded);
+}
 
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.iv2.y = std::stoi(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of integer vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
-    }
-    else if (type == "i3")
-    {
-      v.type = Block::ValueType::IVEC3;
-      std::string val;
-      bool ok = true;
-      v.iv3 = int3(0, 0, 0);
+//failed value stops loading of its block, but the block itself is considered loaded
+void BlkParser::State::finish_value(bool ok)
+{
+  if (!ok)
+    close_block(true);
+}
 
-      val = next_token(data, cur_pos);
-      v.iv3.x = std::stoi(val);
+//diagnostics go to options.diagnostics or to stderr. Loads running at once can share the vector
+static void emit_diagnostics(const std::vector<BlkDiagnostic> &diagnostics, const BlkLoadOptions &options)
+{
+  if (options.diagnostics)
+  {
+    static std::mutex diagnostics_mutex;
+    std::lock_guard<std::mutex> lock(diagnostics_mutex);
+    options.diagnostics->insert(options.diagnostics->end(), diagnostics.begin(), diagnostics.end());
+    return;
+  }
+  std::string text;
+  for (const BlkDiagnostic &d : diagnostics)
+    text += d.to_string() + "\n";
+  fwrite(text.data(), 1, text.size(), stderr);
+}
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.iv3.y = std::stoi(val);
-      }
+//Parser keeps loading after most errors, so load(options) can succeed with errors. Here its diagnostics
+//are checked and passed on, and the result is false if there are errors
+template<typename Load>
+static bool load_without_errors(const BlkLoadOptions &options, Load load)
+{
+  std::vector<BlkDiagnostic> diagnostics;
+  BlkLoadOptions checked_options = options;
+  checked_options.diagnostics = &diagnostics;
+  bool loaded = load(checked_options);
+  emit_diagnostics(diagnostics, options);
+  for (const BlkDiagnostic &d : diagnostics)
+    loaded = loaded && d.severity != BlkDiagnostic::Severity::ERROR;
+  return loaded;
+}
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.iv3.z = std::stoi(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of integer vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
-    }
-    else if (type == "i4")
+//lines and columns are counted in one pass over the text, diagnostics go mostly in the order of offsets
+void BlkParser::State::report_diagnostics()
+{
+  size_t pos = 0, line_start = 0;
+  int line = 1;
+  for (BlkDiagnostic &d : diagnostics)
+  {
+    if (d.offset < pos)
+      pos = line_start = 0, line = 1;
+    for (; pos < d.offset && pos < size; pos++)
     {
-      v.type = Block::ValueType::IVEC4;
-      std::string val;
-      bool ok = true;
-      v.iv4 = int4(0, 0, 0, 0);
-
-      val = next_token(data, cur_pos);
-      v.iv4.x = std::stoi(val);
-
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.iv4.y = std::stoi(val);
-      }
-
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
+      if (data[pos] == '\n')
       {
-        val = next_token(data, cur_pos);
-        v.iv4.z = std::stoi(val);
+        line++;
+        line_start = pos + 1;
       }
+    }
+    d.line = line;
+    d.column = d.offset - line_start + 1;
+    d.file = file;
+  }
+  emit_diagnostics(diagnostics, options);
+}
 
-      val = next_token(data, cur_pos);
-      ok = ok && (val == ",");
-      if (ok)
-      {
-        val = next_token(data, cur_pos);
-        v.iv4.w = std::stoi(val);
-      }
-      if (!ok)
-      {
-        fprintf(stderr, "line %d wrong description of integer vector", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
-      }
+//one entry of the current block: value, #include or its end
+void BlkParser::State::parse_block_entry()
+{
+  Block &b = *frames.back().block;
+  if (load_progress.root && (size_t)cur_pos >= load_progress.next_report)
+  {
+    options.progress(cur_pos, load_progress.total);
+    load_progress.next_report = cur_pos + BlkLoadOptions::PROGRESS_STEP;
+  }
+  std::string token = next_token(data, cur_pos);
+  if (token == "}")
+  {
+    // block closed correctly
+    close_block(true);
+  }
+  else if (token == "")
+  {
+    // end of file
+    parse_error(cur_pos, "block loader reached end of file, } expected");
+    close_block(false);
+  }
+  else if (token == "#include")
+  {
+    //#include "<path_to_block>"
+    token = next_token(data, cur_pos);
+    if (token != "\"")
+    {
+      parse_error(cur_pos, "expected \" after #include");
+      close_block(false);
+      return;
     }
-    else if (type == "m4")
+    std::string path = read_string(data, cur_pos);
+    if (data[cur_pos] == '\"')
     {
-      v.type = Block::ValueType::MAT4;
-      v.m4 = float4x4();
-      std::string val;
-      float mat[16];
-      bool ok = true;
-      int cnt = 0;
+      cur_pos++;
+    }
+    else
+    {
+      parse_error(cur_pos, "expected \" at the end of a string in include path");
+      close_block(false);
+      return;
+    }
+    if (!base_blk_path.empty() && std::filesystem::path(path).is_relative())
+      path = (std::filesystem::path(base_blk_path) / path).string();
+    if (options.include_graph)
+      options.include_graph->add_include(canonical_blk_path(path));
 
-      while (cnt < 16 && ok)
+    if (options.include_cache)
+    {
+      std::shared_ptr<const Block> b_to_include = options.include_cache->get(path, options);
+      if (b_to_include)
       {
-        val = next_token(data, cur_pos);
-
-        mat[cnt] = std::stof(val);
-        if (cnt < 15)
+        for (int i = 0; i < b_to_include->size(); i++)
         {
-          val = next_token(data, cur_pos);
-          ok = ok && (val == ",");
+          b.names.push_back(b_to_include->names[i]);
+          b.values.emplace_back();
+          b.values.back().copy(b_to_include->values[i]);
         }
-        cnt++;
-      }
-      if (ok)
-      {
-        v.m4 = float4x4(mat[0], mat[4], mat[8], mat[12],
-                        mat[1], mat[5], mat[9], mat[13],
-                        mat[2], mat[6], mat[10], mat[14],
-                        mat[3], mat[7], mat[11], mat[15]);
       }
       else
       {
-        fprintf(stderr, "line %d wrong description of matrix", cur_line);
-        v.type = Block::ValueType::EMPTY;
-        return false;
+        parse_error(cur_pos, "failed to load block %s required by #include command", path.c_str());
       }
+      return;
     }
-    else if (type.substr(0, 2) == "e_")
-    {
-      v.type = Block::ValueType::ENUM;
 
-      std::string type_name = type.substr(2);
-      std::string name = next_token(data, cur_pos);
-
-      auto info_it = get_enum_info_by_name().find(type_name);
-      if (info_it == get_enum_info_by_name().end())
-      {
-        fprintf(stderr, "line %d enum %s is not registered\n", cur_line, type_name.c_str());
-        v.ev.type_id = 0;
-        v.ev.val_id  = 0; //it is an error, but we can ignore it and hope the user code will deal with it
-      }
-
-      auto val_it = get_enum_info()[info_it->second].id_by_name.find(name);
-      if (val_it == get_enum_info()[info_it->second].id_by_name.end())
-      {
-        fprintf(stderr, "line %d enum %s has no value %s\n", cur_line, type_name.c_str(), name.c_str());
-        v.ev.type_id = 0;
-        v.ev.val_id  = 0; //it is an error, but we can ignore it and hope the user code will deal with it
-      }
-      else
-      {
-        v.ev.type_id = info_it->second;
-        v.ev.val_id  = val_it->second;
-      }
-    }
-    else if (type == "s")
+    Block b_to_include;
+    bool loaded_b_to_include = load_without_errors(options, [&](const BlkLoadOptions &include_options) {
+      return load_block_from_file(path, b_to_include, include_options);
+    });
+    if (loaded_b_to_include)
     {
-      std::string par = next_token(data, cur_pos);
-      if (par == "\"")
+      for (int i=0;i<b_to_include.size();i++)
       {
-        std::string s = read_string(data, cur_pos);
-        if (data[cur_pos] == 0)
-        {
-          v.type = Block::ValueType::EMPTY;
-          fprintf(stderr, "line %d expected \" at the end of a string", cur_line);
-          return false;
-        }
-        else if (data[cur_pos] == '\"')
-        {
-          cur_pos++;
-          v.type = Block::ValueType::STRING;
-          v.s = new std::string(s);
-        }
+        b.names.push_back(b_to_include.names[i]);
+        b.values.push_back(b_to_include.values[i]);
+        b_to_include.values[i].type = Block::ValueType::EMPTY;
       }
     }
-    else if (type == "arr")
+    else
     {
-      v.type = Block::ValueType::ARRAY;
-      v.a = new Block::DataArray();
-      return read_array(data, cur_pos, *(v.a));
+      parse_error(cur_pos, "failed to load block %s required by #include command", path.c_str());
     }
-
-    return true;
   }
   else
   {
-    fprintf(stderr, "line %d expected : or { after value/block name, but %s got", cur_line, token.c_str());
-    v.type = Block::ValueType::EMPTY;
-    return false;
+    // next value
+    b.names.push_back(token);
+    b.values.emplace_back();
+    Block::Value &v = b.values.back();
+    const Block *block_to_extend = nullptr;
+    ReadValueResult res = read_value(data, cur_pos, v, *root, &block_to_extend);
+    if (res == ReadValueResult::BLOCK && options.max_depth && frames.size() >= options.max_depth)
+    {
+      parse_error(cur_pos, "blocks are nested deeper than %u", options.max_depth);
+      status = Status::FAILED;
+    }
+    else if (res == ReadValueResult::BLOCK)
+    {
+      blocks_in_progress.push_back(v.bl);
+      frames.push_back({v.bl, &v, block_to_extend});
+    }
+    else if (res == ReadValueResult::ARRAY)
+    {
+      array = v.a;
+      array_type = Block::ValueType::DOUBLE;
+    }
+    else
+      finish_value(res == ReadValueResult::DONE);
   }
 }
-bool read_array(const char *data, int &cur_pos, Block::DataArray &a)
+
+BlkParser::BlkParser(std::string text, Block &b, const BlkLoadOptions &options) : state(new State())
+{
+  state->owned_text = std::move(text);
+  state->data = state->owned_text.c_str();
+  state->size = state->owned_text.size();
+  state->root = &b;
+  state->options = options;
+}
+
+BlkParser::BlkParser(const char *text, size_t size, Block &b, const BlkLoadOptions &options) : state(new State())
 {
-  std::string token = next_token(data, cur_pos);
-  //{ <value>, <value>, ... <value>}
-  // <value> := "string" or <double>
-  // all values should have the same type
-  if (token == "{")
+  state->data = text;
+  state->size = size;
+  state->root = &b;
+  state->options = options;
+}
+
+BlkParser::~BlkParser() = default;
+
+BlkParser::Status BlkParser::step(unsigned budget_us, size_t budget_bytes)
+{
+  State &s = *state;
+  if (s.status != Status::IN_PROGRESS)
+    return s.status;
+
   {
-    bool ok = true;
-    Block::ValueType array_type = Block::ValueType::DOUBLE;
-    while (ok)
+    //globals are swapped back even if parsing throws
+    struct GlobalsGuard
+    {
+      State &s;
+      BlkParser::State *outer;
+      GlobalsGuard(State &s) : s(s), outer(active_parser) { s.swap_globals(); active_parser = &s; }
+      ~GlobalsGuard() { s.swap_globals(); active_parser = outer; }
+    } guard(s);
+
+    if (!s.started)
+      s.start(s.options.progress && !guard.outer);
+
+    using clock = std::chrono::steady_clock;
+    clock::time_point deadline = clock::now() + std::chrono::microseconds(budget_us);
+    size_t bytes_limit = budget_bytes ? s.cur_pos + budget_bytes : 0;
+    for (unsigned iteration = 0; s.status == Status::IN_PROGRESS; iteration++)
     {
-      Block::Value val;
-      std::string tok = next_token(data, cur_pos);
-      if (tok == "}")
+      if (bytes_limit && (size_t)s.cur_pos >= bytes_limit)
+        break;
+      if (budget_us && iteration % 16 == 15 && clock::now() >= deadline)
+        break;
+      if (s.options.cancel && s.options.cancel->load(std::memory_order_relaxed))
       {
-        a.type = Block::ValueType::DOUBLE;
-        return true;
+        s.status = Status::FAILED;
+        break;
       }
-      if (tok.empty())
-        fprintf(stderr, "line %d empty token in array", cur_line);
-      else if (tok == "\"")
+      if (s.array)
       {
-        std::string s = read_string(data, cur_pos);
-        if (data[cur_pos] == 0)
-        {
-          val.type = Block::ValueType::EMPTY;
-          fprintf(stderr, "line %d expected \" at the end of a string in string array", cur_line);
-          return false;
-        }
-        else if (data[cur_pos] == '\"')
+        ReadArrayResult res = read_array_value(s.data, s.cur_pos, *s.array, s.array_type);
+        if (res != ReadArrayResult::NEXT)
         {
-          cur_pos++;
-          val.type = Block::ValueType::STRING;
-          val.s = new std::string(s);
+          s.array = nullptr;
+          s.finish_value(res == ReadArrayResult::END);
         }
       }
       else
-      {
-        val.type = Block::ValueType::DOUBLE;
-        val.d = std::stod(tok);
-      }
-      if (a.values.empty())
-        array_type = val.type;
-      else if (array_type != val.type)
-        fprintf(stderr, "line %d array has values of diffrent types", cur_line);
-      a.values.push_back(val);
-
-      tok = next_token(data, cur_pos);
-      ok = ok && (tok == ",");
-      if (tok == "}")
-      {
-        a.type = array_type;
-        return true;
-      }
+        s.parse_block_entry();
     }
-    fprintf(stderr, "line %d expected } at the end of array", cur_line);
-    return false;
   }
-  else
+
+  //lines and columns are counted only once, when parsing ends
+  if (s.status != Status::IN_PROGRESS)
+    s.report_diagnostics();
+  return s.status;
+}
+
+BlkParser::Status BlkParser::status() const
+{
+  return state->status;
+}
+
+void BlkParser::set_file_name(const std::string &file)
+{
+  state->file = file;
+}
+
+const std::vector<BlkDiagnostic> &BlkParser::diagnostics() const
+{
+  return state->diagnostics;
+}
+
+size_t BlkParser::parsed_bytes() const
+{
+  return state->cur_pos;
+}
+
+size_t BlkParser::total_bytes() const
+{
+  return state->size;
+}
+
+//file name is used only in diagnostics
+static bool load_block_from_text(const std::string &str, Block &b, const BlkLoadOptions &options,
+                                 const std::string &file)
+{
+  BlkParser parser(str.c_str(), str.size(), b, options);
+  parser.set_file_name(file);
+  return parser.step(0) == BlkParser::Status::DONE;
+}
+
+bool load_block_from_string(const std::string &str, Block &b, const BlkLoadOptions &options)
+{
+  return load_block_from_text(str, b, options, "");
+}
+
+std::string BlkDiagnostic::to_string() const
+{
+  std::string res = file.empty() ? "" : file + ":";
+  res += std::to_string(line) + ":" + std::to_string(column) + ": ";
+  res += severity == Severity::ERROR ? "error: " : "warning: ";
+  return res + message;
+}
+
+bool load_block_from_file(std::string path, Block &b, const BlkLoadOptions &options)
+{
+  b = Block();
+  std::fstream f(path);
+  std::stringstream iss;
+  if (f.fail())
   {
-    fprintf(stderr, "line %d expected { at the start of array", cur_line);
+    fprintf(stderr, "unable to load file %s", path.c_str());
     return false;
   }
+  iss << f.rdbuf();
+  std::string entireFile = iss.str();
+  if (options.include_graph)
+    options.include_graph->begin_file(canonical_blk_path(path));
+  bool loaded = load_block_from_text(entireFile, b, options, path);
+  if (options.include_graph)
+    options.include_graph->end_file();
+  return loaded;
+}
+
+int Block::size() const
+{
+  if (lazy)
+    return lazy->base_ids.size() + lazy->own_ids.size();
+  return names.size();
+}
+
+const Block::Value &Block::value_at(int id) const
+{
+  if (!lazy)
+    return values[id];
+  int base_size = lazy->base_ids.size();
+  if (id >= base_size)
+    return values[lazy->own_ids[id - base_size]];
+  if (lazy->base_ids[id] >= 0)
+    return values[lazy->base_ids[id]];
+  if (!lazy->shadows.empty() && lazy->shadows[id].type == Block::ValueType::BLOCK)
+    return lazy->shadows[id];
+  return lazy->base->value_at(id);
+}
+
+int Block::get_id(const std::string &name) const
+{
+  return get_next_id(name, 0);
 }
-bool load_block(const char *data, int &cur_pos, Block &b, const Block &global_parent)
+int Block::get_next_id(const std::string &name, int pos) const
 {
-  bool correct = true;
-  while (correct)
+  if (name_index && pos == 0)
   {
-    std::string token = next_token(data, cur_pos);
-    if (token == "}")
+    auto it = name_index->find(name);
+    return it == name_index->end() ? -1 : it->second;
+  }
+  if (!sorted_ids.empty())
+  {
+    //first entry with this name and id >= pos
+    auto it = std::lower_bound(sorted_ids.begin(), sorted_ids.end(), pos, [&](int id, int p) {
+      int cmp = names[id].compare(name);
+      return cmp < 0 || (cmp == 0 && id < p);
+    });
+    return it != sorted_ids.end() && names[*it] == name ? *it : -1;
+  }
+  if (lazy)
+  {
+    int base_size = lazy->base_ids.size();
+    if (pos < base_size)
     {
-      // block closed correctly
-      return correct;
+      int id = lazy->base->get_next_id(name, pos);
+      if (id >= 0 && id < base_size)
+        return id;
     }
-    else if (token == "")
+    for (int i = std::max(pos - base_size, 0); i < lazy->own_ids.size(); i++)
     {
-      // end of file
-      fprintf(stderr, "line %d block loader reached end of file, } expected", cur_line);
+      if (names[lazy->own_ids[i]] == name)
+        return base_size + i;
+    }
+    return -1;
+  }
+  for (int i = pos; i < names.size(); i++)
+  {
+    if (names[i] == name)
+      return i;
+  }
+  return -1;
+}
+Block::ValueType Block::get_type(int id) const
+{
+  return (id >= 0 && id < size()) ? value_at(id).type : Block::ValueType::EMPTY;
+}
+Block::ValueType Block::get_type(const std::string &name) const
+{
+  return get_type(get_id(name));
+}
+
+int Block::get_bool(int id, bool base_val) const
+{
+  return get<bool>(id, base_val);
+}
+int Block::get_int(int id, int base_val) const
+{
+  return get<int>(id, base_val);
+}
+uint64_t Block::get_uint64(int id, uint64_t base_val) const
+{
+  return get<uint64_t>(id, base_val);
+}
+double Block::get_double(int id, double base_val) const
+{
+  return get<double>(id, base_val);
+}
+float2 Block::get_vec2(int id, float2 base_val) const
+{
+  return get<float2>(id, base_val);
+}
+float3 Block::get_vec3(int id, float3 base_val) const
+{
+  return get<float3>(id, base_val);
+}
+float4 Block::get_vec4(int id, float4 base_val) const
+{
+  return get<float4>(id, base_val);
+}
+int2 Block::get_ivec2(int id, int2 base_val) const
+{
+  return get<int2>(id, base_val);
+}
+int3 Block::get_ivec3(int id, int3 base_val) const
+{
+  return get<int3>(id, base_val);
+}
+int4 Block::get_ivec4(int id, int4 base_val) const
+{
+  return get<int4>(id, base_val);
+}
+float4x4 Block::get_mat4(int id, float4x4 base_val) const
+{
+  return get<float4x4>(id, base_val);
+}
+unsigned Block::get_enum(int id, unsigned base_val) const
+{
+  return (id >= 0 && id < size() && value_at(id).type == Block::ValueType::ENUM) ? enum_info(value_at(id).ev.type_id).value(value_at(id).ev.val_id) : base_val;
+}
+std::string Block::get_string(int id, std::string base_val) const
+{
+  return get<std::string>(id, base_val);
+}
+Block *Block::get_block(int id, Block *base_val) const
+{
+  if (id < 0 || id >= size() || value_at(id).type != Block::ValueType::BLOCK)
+    return base_val;
+  //sub-blocks of base are never returned, lazy blocks have shadows for them
+  return value_at(id).bl;
+}
+
+int Block::get_bool(const std::string name, bool base_val) const
+{
+  return get<bool>(name, base_val);
+}
+int Block::get_int(const std::string name, int base_val) const
+{
+  return get<int>(name, base_val);
+}
+uint64_t Block::get_uint64(const std::string name, uint64_t base_val) const
+{
+  return get<uint64_t>(name, base_val);
+}
+double Block::get_double(const std::string name, double base_val) const
+{
+  return get<double>(name, base_val);
+}
+float2 Block::get_vec2(const std::string name, float2 base_val) const
+{
+  return get<float2>(name, base_val);
+}
+float3 Block::get_vec3(const std::string name, float3 base_val) const
+{
+  return get<float3>(name, base_val);
+}
+float4 Block::get_vec4(const std::string name, float4 base_val) const
+{
+  return get<float4>(name, base_val);
+}
+int2 Block::get_ivec2(const std::string name, int2 base_val) const
+{
+  return get<int2>(name, base_val);
+}
+int3 Block::get_ivec3(const std::string name, int3 base_val) const
+{
+  return get<int3>(name, base_val);
+}
+int4 Block::get_ivec4(const std::string name, int4 base_val) const
+{
+  return get<int4>(name, base_val);
+}
+float4x4 Block::get_mat4(const std::string name, float4x4 base_val) const
+{
+  return get<float4x4>(name, base_val);
+}
+unsigned Block::get_enum(const std::string name, unsigned base_val) const
+{
+  return get_enum(get_id(name), base_val);
+}
+std::string Block::get_string(const std::string name, std::string base_val) const
+{
+  return get<std::string>(name, base_val);
+}
+Block *Block::get_block(std::string name, Block *base_val) const
+{
+  return get_block(get_id(name), base_val);
+}
+Block *Block::get_block_rec(std::string name, Block *base_val) const
+{
+  auto it = name.find_first_of('.');
+  if (it == std::string::npos)
+    return get_block(name, base_val);
+  Block *child = get_block(name.substr(0, it));
+  if (child)
+    return child->get_block_rec(name.substr(it + 1), base_val);
+  else
+    return base_val;
+}
+
+//writes number directly into the output, without temporary strings
+//floating point values are written in the shortest form that is read back to exactly the same value
+template <typename T>
+void append_float(BlockWriter &w, T val, const BlkSaveOptions &options)
+{
+  char *start = w.reserve(64);
+  char *p = start;
+  std::to_chars_result res;
+  if (options.hex_floats && std::isfinite(val))
+  {
+    //to_chars does not write 0x prefix, but strtod requires it
+    if (std::signbit(val))
+    {
+      *(p++) = '-';
+      val = -val;
+    }
+    *(p++) = '0';
+    *(p++) = 'x';
+    res = std::to_chars(p, start + 64, val, std::chars_format::hex);
+  }
+  else
+    res = std::to_chars(p, start + 64, val);
+  w.commit(res.ptr);
+}
+template <typename T>
+void append_int(BlockWriter &w, T val)
+{
+  char *start = w.reserve(24);
+  w.commit(std::to_chars(start, start + 24, val).ptr);
+}
+
+//simple pool for internal parallel work, the thread waiting for results helps to execute tasks
+class BlkThreadPool
+{
+public:
+  BlkThreadPool(unsigned threads)
+  {
+    for (unsigned i = 0; i < threads; i++)
+      workers.emplace_back([this]() { work(); });
+  }
+  ~BlkThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+  }
+
+  template <typename F>
+  auto submit(F &&f) -> std::future<decltype(f())>
+  {
+    auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+    auto res = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace_back([task]() { (*task)(); });
+    }
+    cv.notify_one();
+    return res;
+  }
+
+  template <typename T>
+  T wait(std::future<T> &f)
+  {
+    while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      if (!run_one())
+        f.wait_for(std::chrono::milliseconds(1));
+    }
+    return f.get();
+  }
+
+private:
+  bool run_one()
+  {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (tasks.empty())
+        return false;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+    return true;
+  }
+  void work()
+  {
+    while (true)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop = false;
+};
+
+//sub-blocks serialized in advance by parallel save
+struct ParallelSaveTasks
+{
+  BlkThreadPool *pool;
+  std::unordered_map<const Block *, std::future<std::string>> results;
+};
+
+//type tags for the text format, minified output uses the shortest of the synonyms
+static const char *value_type_tags[] = {"tag", "b", "i", "u64", "r", "p2", "p3", "p4", "i2", "i3", "i4", "m4", "e_", "s", "", "arr"};
+static const char *short_value_type_tags[] = {"tag", "b", "i", "u", "r", "p2", "p3", "p4", "i2", "i3", "i4", "m4", "e_", "s", "", "arr"};
+
+//values ending with a word or a number should be separated from the next name by whitespace
+static bool value_needs_separator(const Block::Value &v)
+{
+  return v.type != Block::ValueType::BLOCK && v.type != Block::ValueType::ARRAY && v.type != Block::ValueType::STRING;
+}
+
+void save_value(BlockWriter &w, const Block::Value &v, const BlkSaveOptions &options, ParallelSaveTasks *tasks);
+
+//writes sub-block serialized in advance by parallel save, returns false if there is no such task
+static bool write_save_task(BlockWriter &w, const Block &b, ParallelSaveTasks *tasks)
+{
+  if (!tasks)
+    return false;
+  auto it = tasks->results.find(&b);
+  if (it == tasks->results.end())
+    return false;
+  w.write(tasks->pool->wait(it->second));
+  return true;
+}
+
+//nested blocks are kept in explicit stack, so depth of the document is not limited by the call stack
+void save_block(BlockWriter &w, const Block &b, const BlkSaveOptions &options, ParallelSaveTasks *tasks = nullptr)
+{
+  struct Frame
+  {
+    const Block *block;
+    int next;
+  };
+  if (write_save_task(w, b, tasks))
+    return;
+  std::vector<Frame> stack;
+  stack.push_back({&b, 0});
+  w.write(options.minified ? "{" : "{\n");
+  while (!stack.empty())
+  {
+    Frame &frame = stack.back();
+    const Block &cur = *frame.block;
+    if (frame.next > 0)
+    {
+      //separator after the previous value, it is written here to be after nested blocks too
+      int prev = frame.next - 1;
+      if (!options.minified)
+        w.put('\n');
+      else if (prev < cur.size() - 1 && value_needs_separator(cur.values[prev]))
+        w.put(' ');
+    }
+    if (frame.next == cur.size())
+    {
+      w.put('}');
+      stack.pop_back();
+      continue;
+    }
+    const Block::Value &v = cur.values[frame.next];
+    frame.next++;
+    w.write(cur.names[frame.next - 1]);
+    if (v.type == Block::ValueType::BLOCK && v.bl)
+    {
+      if (!options.minified)
+        w.put(' ');
+      if (!write_save_task(w, *(v.bl), tasks))
+      {
+        w.write(options.minified ? "{" : "{\n");
+        stack.push_back({v.bl, 0});
+      }
+    }
+    else
+      save_value(w, v, options, tasks);
+  }
+}
+void save_arr(BlockWriter &w, const Block::DataArray &a, const BlkSaveOptions &options)
+{
+  const char *sep = options.minified ? "," : ", ";
+  w.write(options.minified ? "{" : "{ ");
+  if (a.type == Block::ValueType::DOUBLE)
+  {
+    for (int i = 0; i < a.values.size(); i++)
+    {
+      append_float(w, a.values[i].d, options);
+      if (i < a.values.size() - 1)
+        w.write(sep);
+    }
+  }
+  else if (a.type == Block::ValueType::STRING)
+  {
+    for (int i = 0; i < a.values.size(); i++)
+    {
+      w.put('\"');
+      if (a.values[i].s)
+        save_string(w, *(a.values[i].s));
+      w.put('\"');
+      if (i < a.values.size() - 1)
+        w.write(sep);
+    }
+  }
+  w.write(options.minified ? "}" : " }");
+}
+//components of vector, separated by sep
+template<typename T, int N>
+static void save_components(BlockWriter &w, const T (&c)[N], const char *sep, const BlkSaveOptions &options)
+{
+  for (int i = 0; i < N; i++)
+  {
+    if (i > 0)
+      w.write(sep);
+    if constexpr (std::is_integral_v<T>)
+      append_int(w, c[i]);
+    else
+      append_float(w, c[i], options);
+  }
+}
+
+void save_value(BlockWriter &w, const Block::Value &v, const BlkSaveOptions &options, ParallelSaveTasks *tasks)
+{
+  if (v.type == Block::ValueType::BLOCK)
+  {
+    if (v.bl)
+    {
+      if (!options.minified)
+        w.put(' ');
+      save_block(w, *(v.bl), options, tasks);
+    }
+    return;
+  }
+  if ((v.type == Block::ValueType::STRING && !v.s) || (v.type == Block::ValueType::ARRAY && !v.a))
+    return;
+
+  w.put(':');
+  w.write(options.minified ? short_value_type_tags[v.type] : value_type_tags[v.type]);
+  if (v.type == Block::ValueType::EMPTY)
+    return;
+  if (v.type == Block::ValueType::ENUM)
+    w.write(enum_info(v.ev.type_id).name);
+  w.write(options.minified ? "=" : " = ");
+
+  const char *sep = options.minified ? "," : ", ";
+  switch (v.type)
+  {
+  case Block::ValueType::BOOL:
+    w.write(v.b ? "true" : "false");
+    break;
+  case Block::ValueType::INT:
+    append_int(w, v.i);
+    break;
+  case Block::ValueType::UINT64:
+    append_int(w, v.u);
+    break;
+  case Block::ValueType::DOUBLE:
+    append_float(w, v.d, options);
+    break;
+  case Block::ValueType::VEC2:
+    save_components(w, {v.v2.x, v.v2.y}, sep, options);
+    break;
+  case Block::ValueType::VEC3:
+    save_components(w, {v.v3.x, v.v3.y, v.v3.z}, sep, options);
+    break;
+  case Block::ValueType::VEC4:
+    save_components(w, {v.v4.x, v.v4.y, v.v4.z, v.v4.w}, sep, options);
+    break;
+  case Block::ValueType::IVEC2:
+    save_components(w, {v.iv2.x, v.iv2.y}, sep, options);
+    break;
+  case Block::ValueType::IVEC3:
+    save_components(w, {v.iv3.x, v.iv3.y, v.iv3.z}, sep, options);
+    break;
+  case Block::ValueType::IVEC4:
+    save_components(w, {v.iv4.x, v.iv4.y, v.iv4.z, v.iv4.w}, sep, options);
+    break;
+  case Block::ValueType::MAT4:
+    for (int i = 0; i < 4; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        append_float(w, v.m4(i, j), options);
+        if (i < 3 || j < 3)
+          w.write(sep);
+        if (j == 3 && !options.minified)
+          w.write("  ");
+      }
+    }
+    break;
+  case Block::ValueType::ENUM:
+    w.write(enum_info(v.ev.type_id).value_name(v.ev.val_id));
+    break;
+  case Block::ValueType::STRING:
+    w.put('\"');
+    save_string(w, *(v.s));
+    w.put('\"');
+    break;
+  case Block::ValueType::ARRAY:
+    save_arr(w, *(v.a), options);
+    break;
+  default:
+    break;
+  }
+}
+
+BlockWriter::BlockWriter(int _fd, size_t chunk_size) : sink(Sink::DESCRIPTOR), fd(_fd)
+{
+  own_buffer.resize(std::max(chunk_size, MAX_RESERVE));
+  buf = own_buffer.data();
+  capacity = own_buffer.size();
+}
+BlockWriter::BlockWriter(FILE *_file, size_t chunk_size) : sink(Sink::STREAM), file(_file)
+{
+  own_buffer.resize(std::max(chunk_size, MAX_RESERVE));
+  buf = own_buffer.data();
+  capacity = own_buffer.size();
+}
+BlockWriter::BlockWriter(WriteCallback _callback, size_t chunk_size) : sink(Sink::FUNCTION), callback(_callback)
+{
+  own_buffer.resize(std::max(chunk_size, MAX_RESERVE));
+  buf = own_buffer.data();
+  capacity = own_buffer.size();
+}
+BlockWriter::BlockWriter(char *buffer, size_t _capacity) : sink(buffer ? Sink::MEMORY : Sink::COUNTER)
+{
+  if (buffer)
+  {
+    buf = buffer;
+    capacity = _capacity;
+  }
+  else
+  {
+    own_buffer.resize(4096);
+    buf = own_buffer.data();
+    capacity = own_buffer.size();
+  }
+}
+BlockWriter::~BlockWriter()
+{
+  flush();
+}
+
+bool BlockWriter::write_to_sink(const char *data, size_t size)
+{
+  if (error_code != 0)
+    return false;
+  if (sink == Sink::DESCRIPTOR)
+  {
+    while (size > 0)
+    {
+      long long res = blk_sys_write(fd, data, size);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+      {
+        error_code = res < 0 ? errno : EIO;
+        return false;
+      }
+      data += res;
+      size -= res;
+    }
+  }
+  else if (sink == Sink::STREAM)
+  {
+    if (fwrite(data, 1, size, file) != size)
+    {
+      error_code = errno ? errno : EIO;
+      return false;
+    }
+  }
+  else if (sink == Sink::FUNCTION)
+  {
+    if (!callback(data, size))
+    {
+      error_code = EIO;
+      return false;
+    }
+  }
+  return true;
+}
+
+void BlockWriter::flush_buffer()
+{
+  //the data is dropped after an error, the buffer is only reused
+  if (sink != Sink::MEMORY)
+    write_to_sink(buf, pos);
+  flushed += pos;
+  pos = 0;
+  if (sink == Sink::MEMORY && error_code == 0)
+  {
+    //caller buffer is full, the rest goes to a scratch buffer and is only counted
+    error_code = ENOSPC;
+    own_buffer.resize(4096);
+    buf = own_buffer.data();
+    capacity = own_buffer.size();
+  }
+}
+
+void BlockWriter::write_slow(const char *data, size_t size)
+{
+  if (sink == Sink::MEMORY && error_code == 0)
+  {
+    //fill the caller buffer up to the end before reporting the error
+    size_t part = capacity - pos;
+    memcpy(buf + pos, data, part);
+    pos += part;
+    data += part;
+    size -= part;
+  }
+  flush_buffer();
+  if (size < capacity)
+  {
+    memcpy(buf, data, size);
+    pos = size;
+  }
+  else
+  {
+    if (sink != Sink::MEMORY)
+      write_to_sink(data, size);
+    flushed += size;
+  }
+}
+
+char *BlockWriter::reserve_slow(size_t)
+{
+  //caller buffer can have less free bytes than reserved, though enough for the data itself
+  if (sink == Sink::MEMORY && error_code == 0)
+  {
+    in_scratch = true;
+    return scratch;
+  }
+  flush_buffer();
+  return buf + pos;
+}
+
+void BlockWriter::commit_scratch(char *end)
+{
+  in_scratch = false;
+  write(scratch, end - scratch);
+}
+
+bool BlockWriter::flush()
+{
+  if (pos > 0 && sink != Sink::MEMORY)
+    flush_buffer();
+  if (sink == Sink::STREAM && error_code == 0 && fflush(file) != 0)
+    error_code = errno ? errno : EIO;
+  return error_code == 0;
+}
+
+bool BlockWriter::sync()
+{
+  if (!flush())
+    return false;
+  int sync_fd = sink == Sink::DESCRIPTOR ? fd : (sink == Sink::STREAM ? blk_sys_fileno(file) : -1);
+  if (sync_fd >= 0 && blk_sys_fsync(sync_fd) != 0)
+    error_code = errno;
+  return error_code == 0;
+}
+
+//rough cost of serialization of every sub-block: number of values and array elements in it
+static size_t calc_save_weights(const Block &b, std::unordered_map<const Block *, size_t> &weights)
+{
+  //blocks in pre-order, so children are processed before parents when going backwards
+  std::vector<const Block *> order = {&b};
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    for (const Block::Value &v : order[i]->values)
+      if (v.type == Block::ValueType::BLOCK && v.bl)
+        order.push_back(v.bl);
+  }
+  for (size_t i = order.size(); i-- > 0;)
+  {
+    size_t weight = order[i]->size();
+    for (const Block::Value &v : order[i]->values)
+    {
+      if (v.type == Block::ValueType::BLOCK && v.bl)
+        weight += weights[v.bl];
+      else if (v.type == Block::ValueType::ARRAY && v.a)
+        weight += v.a->values.size();
+    }
+    weights[order[i]] = weight;
+  }
+  return weights[&b];
+}
+
+//splits the tree into tasks: big sub-blocks are either serialized by a task as a whole or,
+//if they are too big for one task, split further
+static void plan_save_tasks(const Block &b, const std::unordered_map<const Block *, size_t> &weights,
+                            size_t task_weight, const BlkSaveOptions &options, ParallelSaveTasks &tasks)
+{
+  std::vector<const Block *> to_split = {&b};
+  while (!to_split.empty())
+  {
+    const Block *cur = to_split.back();
+    to_split.pop_back();
+    for (const Block::Value &v : cur->values)
+    {
+      if (v.type != Block::ValueType::BLOCK || !v.bl)
+        continue;
+      const Block *child = v.bl;
+      size_t weight = weights.at(child);
+      if (weight < options.parallel_threshold)
+        continue;
+      bool has_blocks = false;
+      for (const Block::Value &cv : child->values)
+        has_blocks = has_blocks || (cv.type == Block::ValueType::BLOCK && cv.bl);
+      if (weight > 2 * task_weight && has_blocks)
+        to_split.push_back(child);
+      else
+      {
+        tasks.results[child] = tasks.pool->submit([child, &options]() {
+          std::string str;
+          BlockWriter w([&str](const char *data, size_t size) { str.append(data, size); return true; });
+          save_block(w, *child, options);
+          w.flush();
+          return str;
+        });
+      }
+    }
+  }
+}
+
+//output is byte-identical to the sequential save, sub-blocks are serialized into separate
+//strings by the pool and written in order by the calling thread
+static void save_block_parallel(BlockWriter &w, const Block &b, const BlkSaveOptions &options)
+{
+  unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  std::unordered_map<const Block *, size_t> weights;
+  size_t total_weight = calc_save_weights(b, weights);
+  if (threads <= 1 || total_weight < 2 * options.parallel_threshold)
+  {
+    save_block(w, b, options);
+    return;
+  }
+
+  BlkThreadPool pool(threads - 1);
+  ParallelSaveTasks tasks;
+  tasks.pool = &pool;
+  size_t task_weight = std::max<size_t>(options.parallel_threshold, total_weight / (4 * threads));
+  plan_save_tasks(b, weights, task_weight, options, tasks);
+  save_block(w, b, options, &tasks);
+}
+
+//save of the whole document, parallel if it is enabled in options
+static void save_block_root(BlockWriter &w, const Block &b, const BlkSaveOptions &options)
+{
+  if (options.threads != 1)
+    save_block_parallel(w, b, options);
+  else
+    save_block(w, b, options);
+}
+
+//serializers work with names and values directly, so lazy blocks should be flattened first
+static bool has_lazy_blocks(const Block &b)
+{
+  std::vector<const Block *> stack = {&b};
+  while (!stack.empty())
+  {
+    const Block *cur = stack.back();
+    stack.pop_back();
+    if (cur->lazy)
+      return true;
+    for (const Block::Value &v : cur->values)
+      if (v.type == Block::ValueType::BLOCK && v.bl)
+        stack.push_back(v.bl);
+  }
+  return false;
+}
+
+//calls save with b or, if it has lazy blocks, with their flattened copy, so saving does not change b
+template <typename Save>
+static auto save_flat(const Block &b, Save save)
+{
+  if (!has_lazy_blocks(b))
+    return save(b);
+  Block flat;
+  flat.copy(&b);
+  return save(flat);
+}
+
+bool BlockWriter::write_block(const Block &b, const BlkSaveOptions &options)
+{
+  save_flat(b, [&](const Block &flat) { save_block_root(*this, flat, options); });
+  return flush();
+}
+
+size_t measure_block(Block &b, const BlkSaveOptions &options)
+{
+  BlockWriter w((char *)nullptr, 0);
+  save_flat(b, [&](const Block &flat) { save_block(w, flat, options); });
+  return w.bytes_written();
+}
+
+bool save_block_to_buffer(char *buffer, size_t capacity, size_t &size, Block &b, const BlkSaveOptions &options)
+{
+  BlockWriter w(buffer, capacity);
+  save_flat(b, [&](const Block &flat) { save_block(w, flat, options); });
+  size = w.bytes_written();
+  return w.flush();
+}
+
+void save_block_to_string(std::string &str, Block &b, const BlkSaveOptions &options)
+{
+  //text is written in one pass and the string grows as it is appended to. Measuring the size first
+  //would format every value twice, which costs more than reallocations
+  BlockWriter w([&str](const char *data, size_t size) { str.append(data, size); return true; });
+  w.write_block(b, options);
+}
+
+//opens path (or <path>.tmp for atomic saves), lets write_data fill it and closes/syncs/renames it
+static bool save_to_file(const std::string &path, const BlkSaveOptions &options,
+                         const std::function<void(BlockWriter &)> &write_data)
+{
+  std::string write_path = options.atomic ? path + ".tmp" : path;
+  int fd = blk_sys_open_for_write(write_path.c_str());
+  if (fd < 0)
+  {
+    fprintf(stderr, "unable to open file %s for writing: %s\n", write_path.c_str(), strerror(errno));
+    return false;
+  }
+
+  int error = 0;
+  {
+    BlockWriter w(fd);
+    write_data(w);
+    if (!w.flush() || (options.sync && !w.sync()))
+      error = w.error();
+  }
+  if (blk_sys_close(fd) != 0 && error == 0)
+    error = errno;
+  if (error == 0 && options.atomic && !blk_sys_replace_file(write_path.c_str(), path.c_str(), options.sync))
+    error = errno;
+
+  if (error != 0)
+  {
+    fprintf(stderr, "unable to save block to file %s: %s\n", path.c_str(), strerror(error));
+    if (options.atomic)
+      std::remove(write_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool save_block_to_file(std::string path, Block &b, const BlkSaveOptions &options)
+{
+  return save_to_file(path, options, [&](BlockWriter &w) { w.write_block(b, options); });
+}
+
+//reads the whole file as is, data can be std::vector<char> or std::string
+template <typename Container>
+static bool read_file(const std::string &path, Container &data)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+  {
+    fprintf(stderr, "unable to load file %s", path.c_str());
+    return false;
+  }
+  if (fseek(f, 0, SEEK_END) == 0)
+  {
+    long size = ftell(f);
+    if (size > 0)
+      data.reserve(data.size() + size);
+    fseek(f, 0, SEEK_SET);
+  }
+  char buffer[64 * 1024];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    data.insert(data.end(), buffer, buffer + read);
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "unable to load file %s", path.c_str());
+  return ok;
+}
+
+//64-bit hash of bytes, used to detect changes of file content
+static uint64_t hash_bytes(const char *data, size_t size, uint64_t seed = 0)
+{
+  const uint64_t m = 0x9E3779B97F4A7C15ull;
+  uint64_t h = seed ^ (size * m);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t k;
+    memcpy(&k, data + i, 8);
+    h = (h ^ (k * m)) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 31;
+  }
+  uint64_t tail = 0;
+  if (i < size)
+    memcpy(&tail, data + i, size - i);
+  h = (h ^ (tail * m)) * 0x94D049BB133111EBull;
+  return h ^ (h >> 29);
+}
+
+BlkIncludeCache::BlkIncludeCache(size_t _max_entries, size_t _max_bytes, bool _check_content)
+    : max_entries(_max_entries), max_bytes(_max_bytes), check_content(_check_content)
+{
+}
+
+std::shared_ptr<const Block> BlkIncludeCache::get(const std::string &path, const BlkLoadOptions &options)
+{
+  std::error_code ec;
+  std::filesystem::path canonical = std::filesystem::canonical(path, ec);
+  if (ec)
+  {
+    fprintf(stderr, "unable to load file %s", path.c_str());
+    return nullptr;
+  }
+  Entry entry;
+  entry.path = canonical.string();
+  entry.mtime = std::filesystem::last_write_time(canonical, ec).time_since_epoch().count();
+  entry.size = std::filesystem::file_size(canonical, ec);
+
+  std::vector<char> data;
+  if (check_content)
+  {
+    if (!read_file(entry.path, data))
+      return nullptr;
+    entry.content_hash = hash_bytes(data.data(), data.size());
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(entry.path);
+    if (it != entries.end())
+    {
+      const Entry &cached = *(it->second);
+      bool same = check_content ? (cached.size == entry.size && cached.content_hash == entry.content_hash)
+                                : (cached.size == entry.size && cached.mtime == entry.mtime);
+      if (same)
+      {
+        counters.hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return cached.block;
+      }
+      counters.bytes -= cached.size;
+      lru.erase(it->second);
+      entries.erase(it);
+    }
+    counters.misses++;
+  }
+
+  //parsing is done without lock, so the same file can be parsed by several threads at once
+  if (!check_content && !read_file(entry.path, data))
+    return nullptr;
+  std::shared_ptr<Block> block = std::make_shared<Block>();
+  if (options.include_graph)
+    options.include_graph->begin_file(entry.path);
+  //file with errors is not cached, every file that includes it fails until it is fixed
+  bool loaded = load_without_errors(options, [&](const BlkLoadOptions &file_options) {
+    return load_block_from_text(std::string(data.begin(), data.end()), *block, file_options, entry.path);
+  });
+  if (options.include_graph)
+    options.include_graph->end_file();
+  if (!loaded)
+  {
+    fprintf(stderr, "failed to parse file %s\n", entry.path.c_str());
+    return nullptr;
+  }
+  entry.block = block;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = entries.find(entry.path);
+  if (it != entries.end())
+  {
+    counters.bytes -= it->second->size;
+    lru.erase(it->second);
+    entries.erase(it);
+  }
+  lru.push_front(entry);
+  entries[entry.path] = lru.begin();
+  counters.bytes += entry.size;
+  evict();
+  return block;
+}
+
+void BlkIncludeCache::evict()
+{
+  while (!lru.empty() && (entries.size() > max_entries || counters.bytes > max_bytes))
+  {
+    counters.bytes -= lru.back().size;
+    counters.evictions++;
+    entries.erase(lru.back().path);
+    lru.pop_back();
+  }
+}
+
+void BlkIncludeCache::invalidate(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = entries.find(canonical_blk_path(path));
+  if (it == entries.end())
+    return;
+  counters.bytes -= it->second->size;
+  lru.erase(it->second);
+  entries.erase(it);
+}
+
+void BlkIncludeCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.clear();
+  entries.clear();
+  counters.bytes = 0;
+}
+
+BlkIncludeCache::Stats BlkIncludeCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats res = counters;
+  res.entries = entries.size();
+  return res;
+}
+
+static bool load_one_of_blocks(const std::string &path, Block &b, const BlkLoadOptions &options)
+{
+  std::string data;
+  if (!read_file(path, data))
+    return false;
+  if (options.include_graph)
+    options.include_graph->begin_file(canonical_blk_path(path));
+  bool loaded = false;
+  //parser converts some values with std::sto* that throw on bad input, a broken file should only fail
+  //itself and not the whole batch or async load
+  try
+  {
+    loaded = load_block_from_text(data, b, options, path);
+  }
+  catch (const std::exception &e)
+  {
+    BlkDiagnostic d;
+    d.file = path;
+    d.message = std::string("failed to parse value: ") + e.what();
+    emit_diagnostics({d}, options);
+    b.clear();
+  }
+  if (options.include_graph)
+    options.include_graph->end_file();
+  if (!loaded)
+    fprintf(stderr, "failed to parse file %s\n", path.c_str());
+  return loaded;
+}
+
+std::vector<bool> load_blocks_from_files(const std::vector<std::string> &paths, std::vector<Block> &out,
+                                         const BlkLoadOptions &options)
+{
+  out.clear();
+  out.resize(paths.size());
+  std::vector<char> loaded(paths.size(), 0); //std::vector<bool> can't be written from different threads
+
+  unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<size_t>(threads, paths.size());
+  //include graph tracks the file being parsed, so it can be filled only by one thread
+  if (options.include_graph)
+    threads = 1;
+
+  //diagnostics of every file are collected separately and added in the order of paths at the end
+  std::vector<std::vector<BlkDiagnostic>> file_diagnostics(options.diagnostics ? paths.size() : 0);
+  //files are taken one by one, so a few big files do not stall the whole batch
+  std::atomic<size_t> next_file(0);
+  auto work = [&]() {
+    BlkLoadOptions file_options = options;
+    for (size_t i = next_file++; i < paths.size(); i = next_file++)
+    {
+      if (options.diagnostics)
+        file_options.diagnostics = &file_diagnostics[i];
+      loaded[i] = load_one_of_blocks(paths[i], out[i], file_options);
+    }
+  };
+  if (threads <= 1)
+    work();
+  else
+  {
+    BlkThreadPool pool(threads - 1);
+    std::vector<std::future<void>> workers;
+    for (unsigned i = 0; i < threads - 1; i++)
+      workers.push_back(pool.submit(work));
+    work();
+    for (std::future<void> &f : workers)
+      pool.wait(f);
+  }
+  for (const std::vector<BlkDiagnostic> &d : file_diagnostics)
+    options.diagnostics->insert(options.diagnostics->end(), d.begin(), d.end());
+  return std::vector<bool>(loaded.begin(), loaded.end());
+}
+
+struct BlkAsyncLoad::State
+{
+  BlkLoadOptions options;
+  std::atomic<bool> cancelled{false};
+  std::atomic<Status> status{Status::PENDING};
+  std::promise<std::shared_ptr<Block>> promise;
+  std::shared_future<std::shared_ptr<Block>> future;
+  std::mutex mutex;
+  std::vector<std::function<void()>> callbacks;
+  bool finished = false;
+};
+
+BlkAsyncLoad::Status BlkAsyncLoad::status() const
+{
+  return state->status.load(std::memory_order_acquire);
+}
+
+void BlkAsyncLoad::cancel()
+{
+  state->cancelled.store(true, std::memory_order_relaxed);
+}
+
+void BlkAsyncLoad::wait() const
+{
+  state->future.wait();
+}
+
+bool BlkAsyncLoad::wait_for(unsigned timeout_ms) const
+{
+  return state->future.wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::ready;
+}
+
+std::shared_ptr<Block> BlkAsyncLoad::get() const
+{
+  return state->future.get();
+}
+
+std::shared_future<std::shared_ptr<Block>> BlkAsyncLoad::get_future() const
+{
+  return state->future;
+}
+
+bool BlkAsyncLoad::on_finish(std::function<void()> callback)
+{
+  std::lock_guard<std::mutex> lock(state->mutex);
+  if (state->finished)
+    return false;
+  state->callbacks.push_back(std::move(callback));
+  return true;
+}
+
+void BlkAsyncLoad::then(std::function<void()> callback)
+{
+  if (!on_finish(callback))
+    callback();
+}
+
+static void run_async_load(const std::shared_ptr<BlkAsyncLoad::State> &state, const std::string &path)
+{
+  std::shared_ptr<Block> block;
+  BlkAsyncLoad::Status status = BlkAsyncLoad::Status::CANCELLED;
+  if (!state->cancelled.load(std::memory_order_relaxed))
+  {
+    bool loaded = false;
+    //the promise must be set and the callbacks must run whatever happens, so nothing may leave the task
+    try
+    {
+      block = std::make_shared<Block>();
+      loaded = load_one_of_blocks(path, *block, state->options);
+    }
+    catch (const std::exception &e)
+    {
+      fprintf(stderr, "[load_block_async::ERROR] failed to load %s: %s\n", path.c_str(), e.what());
+    }
+    catch (...)
+    {
+      fprintf(stderr, "[load_block_async::ERROR] failed to load %s\n", path.c_str());
+    }
+    if (state->cancelled.load(std::memory_order_relaxed))
+      loaded = false;
+    else
+      status = loaded ? BlkAsyncLoad::Status::LOADED : BlkAsyncLoad::Status::FAILED;
+    if (!loaded)
+      block.reset();
+  }
+  state->status.store(status, std::memory_order_release);
+  state->promise.set_value(block);
+
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->finished = true;
+    callbacks.swap(state->callbacks);
+  }
+  for (auto &callback : callbacks)
+    callback();
+}
+
+BlkAsyncLoad load_block_async(const std::string &path, const BlkLoadOptions &options, BlkExecutor executor)
+{
+  auto state = std::make_shared<BlkAsyncLoad::State>();
+  state->options = options;
+  state->options.cancel = &state->cancelled;
+  state->future = state->promise.get_future().share();
+  auto task = [state, path]() { run_async_load(state, path); };
+  if (executor)
+    executor(task);
+  else
+  {
+    static BlkThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    pool.submit(task);
+  }
+  return BlkAsyncLoad(state);
+}
+
+void BlkIncludeGraph::begin_file(const std::string &path)
+{
+  //file is parsed again, its old dependencies are no longer valid
+  File &file = files[path];
+  for (const std::string &inc : file.includes)
+  {
+    std::vector<std::string> &by = files[inc].included_by;
+    by.erase(std::remove(by.begin(), by.end(), path), by.end());
+  }
+  file.includes.clear();
+  loading_stack.push_back(path);
+}
+
+void BlkIncludeGraph::add_include(const std::string &path)
+{
+  if (loading_stack.empty())
+    return;
+  const std::string &parent = loading_stack.back();
+  std::vector<std::string> &includes = files[parent].includes;
+  if (std::find(includes.begin(), includes.end(), path) != includes.end())
+    return;
+  includes.push_back(path);
+  files[path].included_by.push_back(parent);
+}
+
+void BlkIncludeGraph::end_file()
+{
+  if (!loading_stack.empty())
+    loading_stack.pop_back();
+}
+
+std::vector<std::string> BlkIncludeGraph::get_affected_files(const std::string &path) const
+{
+  std::vector<std::string> res;
+  if (!has_file(path))
+    return res;
+  res.push_back(path);
+  for (size_t i = 0; i < res.size(); i++)
+  {
+    for (const std::string &by : files.at(res[i]).included_by)
+    {
+      if (std::find(res.begin(), res.end(), by) == res.end())
+        res.push_back(by);
+    }
+  }
+  return res;
+}
+
+void BlkIncludeGraph::clear()
+{
+  files.clear();
+  loading_stack.clear();
+}
+
+//moves new content to the loaded tree, keeping blocks whose structure has not changed
+static void patch_block(Block &dst, Block &src)
+{
+  dst.make_mutable();
+  bool same_layout = dst.names == src.names;
+  for (int i = 0; same_layout && i < src.size(); i++)
+    same_layout = dst.values[i].type == src.values[i].type;
+  if (!same_layout)
+  {
+    dst = std::move(src);
+    return;
+  }
+  for (int i = 0; i < src.size(); i++)
+  {
+    if (src.values[i].type == Block::ValueType::BLOCK && dst.values[i].bl && src.values[i].bl)
+      patch_block(*dst.values[i].bl, *src.values[i].bl);
+    else
+      dst.values[i] = src.values[i];
+  }
+}
+
+BlkHotReloader::BlkHotReloader()
+{
+#ifdef __linux__
+  notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+BlkHotReloader::~BlkHotReloader()
+{
+#ifdef __linux__
+  if (notify_fd >= 0)
+    close(notify_fd);
+#endif
+}
+
+bool BlkHotReloader::load(const std::string &path)
+{
+  root_path = canonical_blk_path(path);
+  include_cache.clear();
+  include_graph.clear();
+  BlkLoadOptions options;
+  options.include_cache = &include_cache;
+  options.include_graph = &include_graph;
+  Block b;
+  if (!load_without_errors(options, [&](const BlkLoadOptions &o) { return load_block_from_file(root_path, b, o); }))
+    return false;
+  root_block = std::move(b);
+  watch_files();
+  return true;
+}
+
+bool BlkHotReloader::reload(const std::vector<std::string> &changed_files)
+{
+  bool affected = false;
+  for (const std::string &path : changed_files)
+  {
+    for (const std::string &file : include_graph.get_affected_files(canonical_blk_path(path)))
+    {
+      include_cache.invalidate(file);
+      affected = true;
+    }
+  }
+  if (!affected)
+    return false;
+
+  BlkLoadOptions options;
+  options.include_cache = &include_cache;
+  options.include_graph = &include_graph;
+  //tree is not patched with a broken file, it is reloaded again when the file is fixed
+  Block b;
+  if (!load_without_errors(options, [&](const BlkLoadOptions &o) { return load_block_from_file(root_path, b, o); }))
+    return false;
+  patch_block(root_block, b);
+  watch_files();
+  return true;
+}
+
+bool BlkHotReloader::update(int timeout_ms)
+{
+  std::vector<std::string> changed;
+#ifdef __linux__
+  if (notify_fd >= 0)
+  {
+    pollfd pfd = {notify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      return false;
+    alignas(inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(notify_fd, buf, sizeof(buf))) > 0)
+    {
+      for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+      {
+        inotify_event *event = (inotify_event *)p;
+        auto dir = watched_dirs.find(event->wd);
+        if (dir == watched_dirs.end() || event->len == 0)
+          continue;
+        std::string path = (std::filesystem::path(dir->second) / event->name).string();
+        if (include_graph.has_file(path) && std::find(changed.begin(), changed.end(), path) == changed.end())
+          changed.push_back(path);
+      }
+    }
+    return reload(changed);
+  }
+#endif
+  changed = changed_files_by_mtime();
+  if (changed.empty() && timeout_ms > 0)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    changed = changed_files_by_mtime();
+  }
+  return reload(changed);
+}
+
+std::vector<std::string> BlkHotReloader::changed_files_by_mtime()
+{
+  std::vector<std::string> changed;
+  for (auto &it : include_graph.get_files())
+  {
+    std::error_code ec;
+    int64_t mtime = std::filesystem::last_write_time(it.first, ec).time_since_epoch().count();
+    auto old = mtimes.find(it.first);
+    if (old != mtimes.end() && old->second != mtime)
+      changed.push_back(it.first);
+  }
+  return changed;
+}
+
+void BlkHotReloader::watch_files()
+{
+  for (auto &it : include_graph.get_files())
+  {
+    std::error_code ec;
+    mtimes[it.first] = std::filesystem::last_write_time(it.first, ec).time_since_epoch().count();
+#ifdef __linux__
+    if (notify_fd < 0)
+      continue;
+    //directories are watched as editors often replace files instead of writing them
+    std::string dir = std::filesystem::path(it.first).parent_path().string();
+    int wd = inotify_add_watch(notify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd >= 0)
+      watched_dirs[wd] = dir;
+#endif
+  }
+}
+
+// Binary BLK format, all numbers are little-endian:
+//   header        "BLKB" magic, u32 version
+//   string table  varint count, then varint length and bytes of every string
+//   root block
+// block           u64 size in bytes of the rest of the block, varint entries count, entries
+// entry           varint name index, u8 value type, value
+// value by type:
+//   EMPTY         nothing
+//   BOOL          u8
+//   INT           zigzag varint
+//   UINT64        varint
+//   DOUBLE        f64
+//   VEC2..VEC4    2..4 x f32
+//   IVEC2..IVEC4  2..4 x i32
+//   MAT4          16 x f32, same order as in text format
+//   ENUM          varint enum type name index, varint value name index
+//   STRING        varint string index
+//   BLOCK         block
+//   ARRAY         u64 size in bytes of the rest of the array, u8 element type, varint count, 
+//                 elements as f64 or varint string index
+// Names, strings and enum names are stored once in the string table. Sizes of blocks and arrays
+// allow a reader to skip them without looking inside.
+static constexpr char BINARY_MAGIC[4] = {'B', 'L', 'K', 'B'};
+static constexpr uint32_t BINARY_VERSION = 1;
+
+struct BinaryBlockWriter
+{
+  std::vector<char> body;
+  std::vector<const std::string *> strings;
+  std::unordered_map<std::string, uint32_t> string_ids;
+
+  uint32_t string_id(const std::string &s)
+  {
+    auto it = string_ids.find(s);
+    if (it != string_ids.end())
+      return it->second;
+    uint32_t id = strings.size();
+    strings.push_back(&(string_ids.emplace(s, id).first->first));
+    return id;
+  }
+
+  void put_u8(uint8_t v) { body.push_back((char)v); }
+  void put_fixed(std::vector<char> &out, uint64_t v, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+      out.push_back((char)((v >> (8 * i)) & 0xFF));
+  }
+  void put_varint(std::vector<char> &out, uint64_t v)
+  {
+    while (v >= 0x80)
+    {
+      out.push_back((char)(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+  void put_varint(uint64_t v) { put_varint(body, v); }
+  void put_zigzag(int64_t v) { put_varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+  void put_f32(float v)
+  {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_fixed(body, bits, 4);
+  }
+  void put_f64(double v)
+  {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_fixed(body, bits, 8);
+  }
+  void put_i32(int v) { put_fixed(body, (uint32_t)v, 4); }
+  size_t begin_size_prefix()
+  {
+    size_t pos = body.size();
+    put_fixed(body, 0, 8);
+    return pos;
+  }
+  void end_size_prefix(size_t pos)
+  {
+    uint64_t size = body.size() - pos - 8;
+    for (int i = 0; i < 8; i++)
+      body[pos + i] = (char)((size >> (8 * i)) & 0xFF);
+  }
+
+  //blocks being written, nested blocks are written without recursion
+  struct Frame
+  {
+    const Block *block;
+    int next;
+    size_t size_pos;
+  };
+  std::vector<Frame> frames;
+
+  void begin_block(const Block &b)
+  {
+    frames.push_back({&b, 0, begin_size_prefix()});
+    put_varint(b.size());
+  }
+
+  void write_block(const Block &b)
+  {
+    begin_block(b);
+    while (!frames.empty())
+    {
+      Frame &frame = frames.back();
+      if (frame.next == frame.block->size())
+      {
+        end_size_prefix(frame.size_pos);
+        frames.pop_back();
+        continue;
+      }
+      //write_value can add a frame, so the value is taken before it
+      const Block &block = *frame.block;
+      int i = frame.next++;
+      put_varint(string_id(block.names[i]));
+      write_value(block.values[i]);
+    }
+  }
+
+  void write_value(const Block::Value &v)
+  {
+    put_u8(v.type);
+    switch (v.type)
+    {
+    case Block::ValueType::EMPTY:
+      break;
+    case Block::ValueType::BOOL:
+      put_u8(v.b ? 1 : 0);
+      break;
+    case Block::ValueType::INT:
+      put_zigzag(v.i);
+      break;
+    case Block::ValueType::UINT64:
+      put_varint(v.u);
+      break;
+    case Block::ValueType::DOUBLE:
+      put_f64(v.d);
+      break;
+    case Block::ValueType::VEC2:
+      put_f32(v.v2.x);
+      put_f32(v.v2.y);
+      break;
+    case Block::ValueType::VEC3:
+      put_f32(v.v3.x);
+      put_f32(v.v3.y);
+      put_f32(v.v3.z);
+      break;
+    case Block::ValueType::VEC4:
+      put_f32(v.v4.x);
+      put_f32(v.v4.y);
+      put_f32(v.v4.z);
+      put_f32(v.v4.w);
+      break;
+    case Block::ValueType::IVEC2:
+      put_i32(v.iv2.x);
+      put_i32(v.iv2.y);
+      break;
+    case Block::ValueType::IVEC3:
+      put_i32(v.iv3.x);
+      put_i32(v.iv3.y);
+      put_i32(v.iv3.z);
+      break;
+    case Block::ValueType::IVEC4:
+      put_i32(v.iv4.x);
+      put_i32(v.iv4.y);
+      put_i32(v.iv4.z);
+      put_i32(v.iv4.w);
+      break;
+    case Block::ValueType::MAT4:
+      for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+          put_f32(v.m4(i, j));
+      break;
+    case Block::ValueType::ENUM:
+      put_varint(string_id(enum_info(v.ev.type_id).name));
+      put_varint(string_id(enum_info(v.ev.type_id).value_name(v.ev.val_id)));
+      break;
+    case Block::ValueType::STRING:
+      put_varint(string_id(v.s ? *(v.s) : std::string()));
+      break;
+    case Block::ValueType::BLOCK:
+      if (v.bl)
+        begin_block(*(v.bl));
+      else
+      {
+        size_t size_pos = begin_size_prefix();
+        put_varint(0);
+        end_size_prefix(size_pos);
+      }
+      break;
+    case Block::ValueType::ARRAY:
+    {
+      size_t size_pos = begin_size_prefix();
+      Block::ValueType type = v.a ? v.a->type : Block::ValueType::DOUBLE;
+      size_t count = v.a ? v.a->values.size() : 0;
+      put_u8(type);
+      put_varint(count);
+      for (size_t i = 0; i < count; i++)
+      {
+        const Block::Value &av = v.a->values[i];
+        if (type == Block::ValueType::STRING)
+          put_varint(string_id(av.s ? *(av.s) : std::string()));
+        else
+          put_f64(av.d);
+      }
+      end_size_prefix(size_pos);
+    }
+    break;
+    }
+  }
+};
+
+static void write_binary(std::vector<char> &data, const Block &b)
+{
+  BinaryBlockWriter writer;
+  writer.write_block(b);
+
+  size_t strings_size = 0;
+  for (const std::string *s : writer.strings)
+    strings_size += s->size() + 10;
+  data.clear();
+  data.reserve(sizeof(BINARY_MAGIC) + 4 + 10 + strings_size + writer.body.size());
+  data.insert(data.end(), BINARY_MAGIC, BINARY_MAGIC + sizeof(BINARY_MAGIC));
+  writer.put_fixed(data, BINARY_VERSION, 4);
+  writer.put_varint(data, writer.strings.size());
+  for (const std::string *s : writer.strings)
+  {
+    writer.put_varint(data, s->size());
+    data.insert(data.end(), s->begin(), s->end());
+  }
+  data.insert(data.end(), writer.body.begin(), writer.body.end());
+}
+
+void save_block_to_binary(std::vector<char> &data, Block &b)
+{
+  save_flat(b, [&](const Block &flat) { write_binary(data, flat); });
+}
+
+bool save_block_to_binary_file(std::string path, Block &b, const BlkSaveOptions &options)
+{
+  std::vector<char> data;
+  save_block_to_binary(data, b);
+  return save_to_file(path, options, [&](BlockWriter &w) { w.write(data.data(), data.size()); });
+}
+
+struct BinaryBlockReader
+{
+  const unsigned char *cur;
+  const unsigned char *end;
+  std::vector<std::string> strings;
+  std::vector<int> enum_type_ids; //registered enum type for every string, -1 - not an enum, -2 - not checked yet
+  bool ok = true;
+
+  bool fail(const char *what)
+  {
+    if (ok)
+      fprintf(stderr, "[load_block_from_binary::ERROR] %s\n", what);
+    ok = false;
+    return false;
+  }
+  bool has(uint64_t bytes) { return ok && (uint64_t)(end - cur) >= bytes ? true : fail("unexpected end of data"); }
+  uint64_t get_fixed(int bytes)
+  {
+    if (!has(bytes))
+      return 0;
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+      v |= (uint64_t)cur[i] << (8 * i);
+    cur += bytes;
+    return v;
+  }
+  uint8_t get_u8() { return get_fixed(1); }
+  uint64_t get_varint()
+  {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (!has(1))
+        return 0;
+      uint8_t byte = *(cur++);
+      v |= (uint64_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        return v;
+    }
+    fail("broken varint");
+    return 0;
+  }
+  int64_t get_zigzag()
+  {
+    uint64_t v = get_varint();
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+  float get_f32()
+  {
+    uint32_t bits = get_fixed(4);
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+  double get_f64()
+  {
+    uint64_t bits = get_fixed(8);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+  int get_i32() { return (int32_t)(uint32_t)get_fixed(4); }
+  const std::string &get_string()
+  {
+    static const std::string empty;
+    uint64_t id = get_varint();
+    if (id >= strings.size())
+    {
+      fail("string index out of range");
+      return empty;
+    }
+    return strings[id];
+  }
+
+  //blocks being read, nested blocks are read without recursion because data can be nested arbitrarily deep
+  struct Frame
+  {
+    Block *block;
+    const unsigned char *end;
+    uint64_t entries_left;
+  };
+  std::vector<Frame> frames;
+
+  void begin_block(Block &b)
+  {
+    uint64_t size = get_fixed(8);
+    if (!has(size))
+      return;
+    const unsigned char *block_end = cur + size;
+    uint64_t count = get_varint();
+    if (count > size)
+    {
+      fail("broken block size");
+      return;
+    }
+    b.names.reserve(b.names.size() + count);
+    b.values.reserve(b.values.size() + count);
+    frames.push_back({&b, block_end, count});
+  }
+
+  bool read_block(Block &b)
+  {
+    begin_block(b);
+    while (ok && !frames.empty())
+    {
+      Frame &frame = frames.back();
+      if (frame.entries_left == 0)
+      {
+        if (cur != frame.end)
+          return fail("block size does not match its content");
+        frames.pop_back();
+        continue;
+      }
+      frame.entries_left--;
+      //read_value can add a frame, so the block is taken before it
+      Block &block = *frame.block;
+      block.names.push_back(get_string());
+      block.values.emplace_back();
+      read_value(block.values.back());
+    }
+    return ok;
+  }
+
+  void read_value(Block::Value &v)
+  {
+    uint8_t type = get_u8();
+    if (type > Block::ValueType::ARRAY)
+    {
+      fail("unknown value type");
+      return;
+    }
+    switch (type)
+    {
+    case Block::ValueType::EMPTY:
+      break;
+    case Block::ValueType::BOOL:
+      v.b = get_u8() != 0;
+      break;
+    case Block::ValueType::INT:
+      v.i = get_zigzag();
+      break;
+    case Block::ValueType::UINT64:
+      v.u = get_varint();
+      break;
+    case Block::ValueType::DOUBLE:
+      v.d = get_f64();
+      break;
+    case Block::ValueType::VEC2:
+      v.v2.x = get_f32();
+      v.v2.y = get_f32();
+      break;
+    case Block::ValueType::VEC3:
+      v.v3.x = get_f32();
+      v.v3.y = get_f32();
+      v.v3.z = get_f32();
+      break;
+    case Block::ValueType::VEC4:
+      v.v4.x = get_f32();
+      v.v4.y = get_f32();
+      v.v4.z = get_f32();
+      v.v4.w = get_f32();
+      break;
+    case Block::ValueType::IVEC2:
+      v.iv2.x = get_i32();
+      v.iv2.y = get_i32();
+      break;
+    case Block::ValueType::IVEC3:
+      v.iv3.x = get_i32();
+      v.iv3.y = get_i32();
+      v.iv3.z = get_i32();
+      break;
+    case Block::ValueType::IVEC4:
+      v.iv4.x = get_i32();
+      v.iv4.y = get_i32();
+      v.iv4.z = get_i32();
+      v.iv4.w = get_i32();
+      break;
+    case Block::ValueType::MAT4:
+      for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+          v.m4(i, j) = get_f32();
+      break;
+    case Block::ValueType::ENUM:
+      read_enum(v.ev);
+      break;
+    case Block::ValueType::STRING:
+      v.s = new std::string(get_string());
+      break;
+    case Block::ValueType::BLOCK:
+      v.bl = new Block();
+      break;
+    case Block::ValueType::ARRAY:
+      v.a = new Block::DataArray();
+      break;
+    }
+    //set type only after pointer is allocated so that an error in the middle leaves a valid value
+    v.type = (Block::ValueType)type;
+    if (type == Block::ValueType::BLOCK)
+      begin_block(*(v.bl));
+    else if (type == Block::ValueType::ARRAY)
+      read_array(*(v.a));
+  }
+
+  void read_enum(Block::EnumValue &ev)
+  {
+    uint64_t type_name_id = get_varint();
+    const std::string &val_name = get_string();
+    ev.type_id = 0;
+    ev.val_id = 0; //it is an error, but we can ignore it and hope the user code will deal with it
+    if (!ok || type_name_id >= strings.size())
+    {
+      fail("string index out of range");
+      return;
+    }
+    if (enum_type_ids[type_name_id] == -2)
+    {
+      enum_type_ids[type_name_id] = find_enum_type(strings[type_name_id]);
+      if (enum_type_ids[type_name_id] == -1)
+        fprintf(stderr, "[load_block_from_binary::ERROR] enum %s is not registered\n", strings[type_name_id].c_str());
+    }
+    if (enum_type_ids[type_name_id] < 0)
+      return;
+    const EnumInfo &info = enum_info(enum_type_ids[type_name_id]);
+    int val_id = info.find_name(val_name);
+    if (val_id < 0)
+    {
+      fprintf(stderr, "[load_block_from_binary::ERROR] enum %s has no value %s\n", info.name.c_str(), val_name.c_str());
+      return;
+    }
+    ev.type_id = enum_type_ids[type_name_id];
+    ev.val_id = val_id;
+  }
+
+  void read_array(Block::DataArray &a)
+  {
+    uint64_t size = get_fixed(8);
+    if (!has(size))
+      return;
+    const unsigned char *array_end = cur + size;
+    uint8_t type = get_u8();
+    uint64_t count = get_varint();
+    if (!ok || count > size || (type != Block::ValueType::DOUBLE && type != Block::ValueType::STRING && count > 0))
+    {
+      fail("broken array");
+      return;
+    }
+    a.type = (Block::ValueType)type;
+    a.values.resize(count);
+    for (uint64_t i = 0; i < count && ok; i++)
+    {
+      if (type == Block::ValueType::STRING)
+      {
+        a.values[i].s = new std::string(get_string());
+        a.values[i].type = Block::ValueType::STRING;
+      }
+      else
+      {
+        a.values[i].d = get_f64();
+        a.values[i].type = Block::ValueType::DOUBLE;
+      }
+    }
+    if (ok && cur != array_end)
+      fail("array size does not match its content");
+  }
+};
+
+bool load_block_from_binary(const char *data, size_t size, Block &b)
+{
+  b = Block();
+  if (size < 8 || memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0)
+  {
+    fprintf(stderr, "[load_block_from_binary::ERROR] data is not a binary block\n");
+    return false;
+  }
+
+  BinaryBlockReader reader;
+  reader.cur = (const unsigned char *)data + sizeof(BINARY_MAGIC);
+  reader.end = (const unsigned char *)data + size;
+  uint32_t version = reader.get_fixed(4);
+  if (version != BINARY_VERSION)
+  {
+    fprintf(stderr, "[load_block_from_binary::ERROR] unsupported version %u\n", version);
+    return false;
+  }
+  uint64_t strings_count = reader.get_varint();
+  if (strings_count > size)
+    return reader.fail("broken string table");
+  reader.strings.resize(strings_count);
+  for (uint64_t i = 0; i < strings_count && reader.ok; i++)
+  {
+    uint64_t len = reader.get_varint();
+    if (reader.has(len))
+    {
+      reader.strings[i].assign((const char *)reader.cur, len);
+      reader.cur += len;
+    }
+  }
+  reader.enum_type_ids.resize(strings_count, -2);
+  return reader.ok && reader.read_block(b);
+}
+
+bool load_block_from_binary(const std::vector<char> &data, Block &b)
+{
+  return load_block_from_binary(data.data(), data.size(), b);
+}
+
+bool load_block_from_binary_file(std::string path, Block &b)
+{
+  b = Block();
+  std::vector<char> data;
+  if (!read_file(path, data))
+    return false;
+  return load_block_from_binary(data, b);
+}
+
+// Blk view format. Everything is little-endian and aligned, the data is used in place by BlockView:
+//   header        "BLKV" magic, u32 version, u64 total size, u64 root block offset, u64 0
+//   strings       records of u32 length, bytes and '\0', aligned to 4 bytes
+//   nodes         8-byte aligned records:
+//     block       u32 count, u32 0, count x entry {u32 name string, u32 value type, u64 payload}
+//     array       u32 element type, u32 count, f64 values or u32 string offsets
+// payload is the value itself for 8-byte types (BOOL, INT, UINT64, DOUBLE, VEC2, IVEC2),
+// and an offset of the node with the value for bigger ones (VEC3..IVEC4, MAT4 - 4 byte components,
+// ENUM - u32 value, u32 type name, u32 value name, u32 0) and for STRING, BLOCK and ARRAY.
+// All offsets are from the start of the data. Strings go right after the header, so 32-bit
+// offsets are enough for them, nodes use 64-bit offsets.
+static constexpr char VIEW_MAGIC[4] = {'B', 'L', 'K', 'V'};
+static constexpr uint32_t VIEW_VERSION = 1;
+static constexpr size_t VIEW_HEADER_SIZE = 32;
+static constexpr size_t VIEW_ENTRY_SIZE = 16;
+
+template <typename T>
+static inline T view_load(const char *p)
+{
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+static bool is_little_endian_host()
+{
+  uint16_t v = 1;
+  char first;
+  memcpy(&first, &v, 1);
+  return first == 1;
+}
+
+struct ViewBlockWriter
+{
+  std::vector<char> strings;
+  std::vector<char> nodes;
+  std::unordered_map<std::string, uint32_t> string_offsets;
+  uint64_t nodes_offset = 0;
+  bool strings_fit = true; //offsets and sizes of strings are 32-bit
+
+  template <typename T>
+  void store(std::vector<char> &out, size_t pos, T v) { memcpy(out.data() + pos, &v, sizeof(T)); }
+
+  static size_t align(size_t v, size_t a) { return (v + a - 1) / a * a; }
+
+  uint32_t string_offset(const std::string &s)
+  {
+    auto it = string_offsets.find(s);
+    if (it != string_offsets.end())
+      return it->second;
+    size_t pos = strings.size();
+    if (VIEW_HEADER_SIZE + pos > UINT32_MAX || s.size() > UINT32_MAX)
+    {
+      strings_fit = false;
+      return 0;
+    }
+    uint32_t offset = VIEW_HEADER_SIZE + pos;
+    strings.resize(align(pos + 4 + s.size() + 1, 4), 0);
+    store<uint32_t>(strings, pos, s.size());
+    memcpy(strings.data() + pos + 4, s.data(), s.size());
+    string_offsets.emplace(s, offset);
+    return offset;
+  }
+
+  //blocks being written with the next value to write, nested blocks are walked without recursion
+  struct Frame
+  {
+    const Block *block;
+    size_t pos;
+    int next;
+  };
+  std::vector<Frame> frames;
+
+  //strings are placed before nodes, so they are added first to know where nodes start
+  void collect_strings(const Block &root)
+  {
+    frames.push_back({&root, 0, 0});
+    while (!frames.empty())
+    {
+      Frame &frame = frames.back();
+      const Block &b = *frame.block;
+      if (frame.next == b.size())
+      {
+        string_offset(std::string());
+        frames.pop_back();
+        continue;
+      }
+      int i = frame.next++;
+      string_offset(b.names[i]);
+      const Block::Value &v = b.values[i];
+      if (v.type == Block::ValueType::STRING)
+        string_offset(v.s ? *(v.s) : std::string());
+      else if (v.type == Block::ValueType::ENUM)
+      {
+        string_offset(enum_info(v.ev.type_id).name);
+        string_offset(enum_info(v.ev.type_id).value_name(v.ev.val_id));
+      }
+      else if (v.type == Block::ValueType::BLOCK && v.bl)
+        frames.push_back({v.bl, 0, 0});
+      else if (v.type == Block::ValueType::ARRAY && v.a && v.a->type == Block::ValueType::STRING)
+      {
+        for (const Block::Value &av : v.a->values)
+          string_offset(av.s ? *(av.s) : std::string());
+      }
+    }
+  }
+
+  //allocates zeroed 8-byte aligned node, returns its position in nodes
+  size_t alloc_node(size_t size)
+  {
+    size_t pos = nodes.size();
+    nodes.resize(align(pos + size, 8), 0);
+    return pos;
+  }
+
+  template <typename T>
+  uint64_t write_components(const T *components, int count)
+  {
+    size_t pos = alloc_node(count * sizeof(T));
+    memcpy(nodes.data() + pos, components, count * sizeof(T));
+    return nodes_offset + pos;
+  }
+
+  //allocates node of block, its entries are filled by write_block
+  uint64_t begin_block(const Block &b)
+  {
+    size_t pos = alloc_node(8 + VIEW_ENTRY_SIZE * b.size());
+    store<uint32_t>(nodes, pos, b.size());
+    frames.push_back({&b, pos, 0});
+    return nodes_offset + pos;
+  }
+
+  uint64_t write_block(const Block &root)
+  {
+    uint64_t root_offset = begin_block(root);
+    while (!frames.empty())
+    {
+      Frame &frame = frames.back();
+      if (frame.next == frame.block->size())
+      {
+        frames.pop_back();
+        continue;
+      }
+      const Block &b = *frame.block;
+      size_t pos = frame.pos;
+      int i = frame.next++;
+      //payload is calculated before entry position is taken as writing the value can resize nodes
+      uint64_t payload = write_value(b.values[i]);
+      size_t entry = pos + 8 + VIEW_ENTRY_SIZE * i;
+      store<uint32_t>(nodes, entry, string_offset(b.names[i]));
+      store<uint32_t>(nodes, entry + 4, b.values[i].type);
+      store<uint64_t>(nodes, entry + 8, payload);
+    }
+    return root_offset;
+  }
+
+  uint64_t write_value(const Block::Value &v)
+  {
+    uint64_t payload = 0;
+    switch (v.type)
+    {
+    case Block::ValueType::EMPTY:
+      break;
+    case Block::ValueType::BOOL:
+      payload = v.b ? 1 : 0;
+      break;
+    case Block::ValueType::INT:
+      payload = (uint64_t)(int64_t)v.i;
+      break;
+    case Block::ValueType::UINT64:
+      payload = v.u;
+      break;
+    case Block::ValueType::DOUBLE:
+      memcpy(&payload, &v.d, sizeof(double));
+      break;
+    case Block::ValueType::VEC2:
+      memcpy(&payload, &v.v2.x, 2 * sizeof(float));
+      break;
+    case Block::ValueType::IVEC2:
+      memcpy(&payload, &v.iv2.x, 2 * sizeof(int));
+      break;
+    case Block::ValueType::VEC3:
+      payload = write_components(&v.v3.x, 3);
+      break;
+    case Block::ValueType::VEC4:
+      payload = write_components(&v.v4.x, 4);
+      break;
+    case Block::ValueType::IVEC3:
+      payload = write_components(&v.iv3.x, 3);
+      break;
+    case Block::ValueType::IVEC4:
+      payload = write_components(&v.iv4.x, 4);
+      break;
+    case Block::ValueType::MAT4:
+    {
+      float m[16];
+      for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+          m[4 * i + j] = v.m4(i, j);
+      payload = write_components(m, 16);
+    }
+    break;
+    case Block::ValueType::ENUM:
+    {
+      const EnumInfo &info = enum_info(v.ev.type_id);
+      uint32_t record[4] = {info.value(v.ev.val_id), string_offset(info.name),
+                            string_offset(info.value_name(v.ev.val_id)), 0};
+      payload = write_components(record, 4);
+    }
+    break;
+    case Block::ValueType::STRING:
+      payload = string_offset(v.s ? *(v.s) : std::string());
+      break;
+    case Block::ValueType::BLOCK:
+      payload = v.bl ? begin_block(*(v.bl)) : nodes_offset + alloc_node(8);
+      break;
+    case Block::ValueType::ARRAY:
+    {
+      Block::ValueType type = v.a ? v.a->type : Block::ValueType::DOUBLE;
+      uint32_t count = v.a ? v.a->values.size() : 0;
+      size_t pos;
+      if (type == Block::ValueType::STRING)
+      {
+        pos = alloc_node(8 + 4 * count);
+        for (uint32_t i = 0; i < count; i++)
+          store<uint32_t>(nodes, pos + 8 + 4 * i, string_offset(v.a->values[i].s ? *(v.a->values[i].s) : std::string()));
+      }
+      else
+      {
+        type = Block::ValueType::DOUBLE;
+        pos = alloc_node(8 + 8 * count);
+        for (uint32_t i = 0; i < count; i++)
+          store<double>(nodes, pos + 8 + 8 * i, v.a->values[i].d);
+      }
+      store<uint32_t>(nodes, pos, type);
+      store<uint32_t>(nodes, pos + 4, count);
+      payload = nodes_offset + pos;
+    }
+    break;
+    }
+    return payload;
+  }
+};
+
+static bool write_view(std::vector<char> &data, const Block &b)
+{
+  ViewBlockWriter writer;
+  writer.collect_strings(b);
+  if (!writer.strings_fit)
+  {
+    fprintf(stderr, "[save_block_to_view::ERROR] strings of the block do not fit into 4GB\n");
+    data.clear();
+    return false;
+  }
+  writer.nodes_offset = ViewBlockWriter::align(VIEW_HEADER_SIZE + writer.strings.size(), 8);
+  uint64_t root_offset = writer.write_block(b);
+
+  uint64_t total_size = writer.nodes_offset + writer.nodes.size();
+  data.assign(total_size, 0);
+  memcpy(data.data(), VIEW_MAGIC, sizeof(VIEW_MAGIC));
+  writer.store<uint32_t>(data, 4, VIEW_VERSION);
+  writer.store<uint64_t>(data, 8, total_size);
+  writer.store<uint64_t>(data, 16, root_offset);
+  memcpy(data.data() + VIEW_HEADER_SIZE, writer.strings.data(), writer.strings.size());
+  memcpy(data.data() + writer.nodes_offset, writer.nodes.data(), writer.nodes.size());
+  return true;
+}
+
+bool save_block_to_view(std::vector<char> &data, Block &b)
+{
+  return save_flat(b, [&](const Block &flat) { return write_view(data, flat); });
+}
+
+bool save_block_to_view_file(std::string path, Block &b, const BlkSaveOptions &options)
+{
+  std::vector<char> data;
+  if (!save_block_to_view(data, b))
+    return false;
+  return save_to_file(path, options, [&](BlockWriter &w) { w.write(data.data(), data.size()); });
+}
+
+struct ViewVerifier
+{
+  const char *data;
+  uint64_t size;
+
+  bool string_ok(uint64_t offset)
+  {
+    if (offset % 4 != 0 || offset < VIEW_HEADER_SIZE || offset + 4 > size)
+      return false;
+    uint32_t len = view_load<uint32_t>(data + offset);
+    return offset + 4 + (uint64_t)len + 1 <= size;
+  }
+  bool node_ok(uint64_t offset, uint64_t node_size)
+  {
+    return offset % 8 == 0 && offset >= VIEW_HEADER_SIZE && offset <= size && node_size <= size - offset;
+  }
+
+  bool block_ok(uint64_t offset, int depth)
+  {
+    if (depth > 1024 || !node_ok(offset, 8))
+      return false;
+    uint32_t count = view_load<uint32_t>(data + offset);
+    if (!node_ok(offset, 8 + VIEW_ENTRY_SIZE * (uint64_t)count))
+      return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const char *e = data + offset + 8 + VIEW_ENTRY_SIZE * i;
+      uint32_t type = view_load<uint32_t>(e + 4);
+      uint64_t payload = view_load<uint64_t>(e + 8);
+      if (!string_ok(view_load<uint32_t>(e)) || type > Block::ValueType::ARRAY)
+        return false;
+      bool ok = true;
+      if (type == Block::ValueType::VEC3 || type == Block::ValueType::VEC4 ||
+          type == Block::ValueType::IVEC3 || type == Block::ValueType::IVEC4)
+        ok = node_ok(payload, 16);
+      else if (type == Block::ValueType::MAT4)
+        ok = node_ok(payload, 64);
+      else if (type == Block::ValueType::ENUM)
+        ok = node_ok(payload, 16) && string_ok(view_load<uint32_t>(data + payload + 4)) &&
+             string_ok(view_load<uint32_t>(data + payload + 8));
+      else if (type == Block::ValueType::STRING)
+        ok = string_ok(payload);
+      else if (type == Block::ValueType::BLOCK)
+        ok = block_ok(payload, depth + 1);
+      else if (type == Block::ValueType::ARRAY)
+        ok = array_ok(payload);
+      if (!ok)
+        return false;
+    }
+    return true;
+  }
+
+  bool array_ok(uint64_t offset)
+  {
+    if (!node_ok(offset, 8))
+      return false;
+    uint32_t type = view_load<uint32_t>(data + offset);
+    uint32_t count = view_load<uint32_t>(data + offset + 4);
+    if (type == Block::ValueType::DOUBLE)
+      return node_ok(offset, 8 + 8 * (uint64_t)count);
+    if (type != Block::ValueType::STRING || !node_ok(offset, 8 + 4 * (uint64_t)count))
+      return false;
+    for (uint32_t i = 0; i < count; i++)
+      if (!string_ok(view_load<uint32_t>(data + offset + 8 + 4 * i)))
+        return false;
+    return true;
+  }
+};
+
+BlockView get_block_view(const char *data, size_t size, bool verify)
+{
+  if (!is_little_endian_host())
+  {
+    fprintf(stderr, "[get_block_view::ERROR] blk view format is supported only on little-endian hosts\n");
+    return BlockView();
+  }
+  if (!data || size < VIEW_HEADER_SIZE + 8 || memcmp(data, VIEW_MAGIC, sizeof(VIEW_MAGIC)) != 0 || (uintptr_t)data % 8 != 0)
+  {
+    fprintf(stderr, "[get_block_view::ERROR] data is not an aligned blk view\n");
+    return BlockView();
+  }
+  uint32_t version = view_load<uint32_t>(data + 4);
+  uint64_t total_size = view_load<uint64_t>(data + 8);
+  uint64_t root_offset = view_load<uint64_t>(data + 16);
+  if (version != VIEW_VERSION || total_size > size || root_offset % 8 != 0 || root_offset < VIEW_HEADER_SIZE ||
+      root_offset + 8 > total_size)
+  {
+    fprintf(stderr, "[get_block_view::ERROR] broken blk view header\n");
+    return BlockView();
+  }
+  if (verify && !ViewVerifier{data, total_size}.block_ok(root_offset, 0))
+  {
+    fprintf(stderr, "[get_block_view::ERROR] blk view data is broken\n");
+    return BlockView();
+  }
+  return BlockView(data, data + root_offset);
+}
+
+const char *BlockView::entry(int id) const
+{
+  return (node && id >= 0 && id < size()) ? node + 8 + VIEW_ENTRY_SIZE * id : nullptr;
+}
+int BlockView::size() const
+{
+  return node ? view_load<uint32_t>(node) : 0;
+}
+int BlockView::get_id(std::string_view name) const
+{
+  return get_next_id(name, 0);
+}
+int BlockView::get_next_id(std::string_view name, int pos) const
+{
+  int count = size();
+  for (int i = std::max(pos, 0); i < count; i++)
+  {
+    const char *str = base + view_load<uint32_t>(node + 8 + VIEW_ENTRY_SIZE * i);
+    if (view_load<uint32_t>(str) == name.size() && memcmp(str + 4, name.data(), name.size()) == 0)
+      return i;
+  }
+  return -1;
+}
+std::string_view BlockView::get_name(int id) const
+{
+  const char *e = entry(id);
+  if (!e)
+    return std::string_view();
+  const char *str = base + view_load<uint32_t>(e);
+  return std::string_view(str + 4, view_load<uint32_t>(str));
+}
+Block::ValueType BlockView::get_type(int id) const
+{
+  const char *e = entry(id);
+  return e ? (Block::ValueType)view_load<uint32_t>(e + 4) : Block::ValueType::EMPTY;
+}
+Block::ValueType BlockView::get_type(std::string_view name) const
+{
+  return get_type(get_id(name));
+}
+bool BlockView::has_tag(std::string_view name) const
+{
+  int id = get_id(name);
+  return id >= 0 && get_type(id) == Block::ValueType::EMPTY;
+}
+
+//payload of the entry if it has the given type, nullptr otherwise
+static inline const char *view_payload(const char *e, Block::ValueType type)
+{
+  return (e && view_load<uint32_t>(e + 4) == type) ? e + 8 : nullptr;
+}
+
+bool BlockView::get_bool(int id, bool base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::BOOL);
+  return p ? view_load<uint64_t>(p) != 0 : base_val;
+}
+int BlockView::get_int(int id, int base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::INT);
+  return p ? view_load<int64_t>(p) : base_val;
+}
+uint64_t BlockView::get_uint64(int id, uint64_t base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::UINT64);
+  return p ? view_load<uint64_t>(p) : base_val;
+}
+double BlockView::get_double(int id, double base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::DOUBLE);
+  return p ? view_load<double>(p) : base_val;
+}
+float2 BlockView::get_vec2(int id, float2 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::VEC2);
+  return p ? float2(view_load<float>(p), view_load<float>(p + 4)) : base_val;
+}
+float3 BlockView::get_vec3(int id, float3 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::VEC3);
+  if (!p)
+    return base_val;
+  const char *c = base + view_load<uint64_t>(p);
+  return float3(view_load<float>(c), view_load<float>(c + 4), view_load<float>(c + 8));
+}
+float4 BlockView::get_vec4(int id, float4 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::VEC4);
+  if (!p)
+    return base_val;
+  const char *c = base + view_load<uint64_t>(p);
+  return float4(view_load<float>(c), view_load<float>(c + 4), view_load<float>(c + 8), view_load<float>(c + 12));
+}
+int2 BlockView::get_ivec2(int id, int2 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::IVEC2);
+  return p ? int2(view_load<int>(p), view_load<int>(p + 4)) : base_val;
+}
+int3 BlockView::get_ivec3(int id, int3 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::IVEC3);
+  if (!p)
+    return base_val;
+  const char *c = base + view_load<uint64_t>(p);
+  return int3(view_load<int>(c), view_load<int>(c + 4), view_load<int>(c + 8));
+}
+int4 BlockView::get_ivec4(int id, int4 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::IVEC4);
+  if (!p)
+    return base_val;
+  const char *c = base + view_load<uint64_t>(p);
+  return int4(view_load<int>(c), view_load<int>(c + 4), view_load<int>(c + 8), view_load<int>(c + 12));
+}
+float4x4 BlockView::get_mat4(int id, float4x4 base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::MAT4);
+  if (!p)
+    return base_val;
+  const char *c = base + view_load<uint64_t>(p);
+  float4x4 m;
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++)
+      m(i, j) = view_load<float>(c + 4 * (4 * i + j));
+  return m;
+}
+unsigned BlockView::get_enum(int id, unsigned base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::ENUM);
+  return p ? view_load<uint32_t>(base + view_load<uint64_t>(p)) : base_val;
+}
+static inline std::string_view view_string(const char *base, uint64_t offset)
+{
+  return std::string_view(base + offset + 4, view_load<uint32_t>(base + offset));
+}
+std::string_view BlockView::get_enum_name(int id) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::ENUM);
+  return p ? view_string(base, view_load<uint32_t>(base + view_load<uint64_t>(p) + 8)) : std::string_view();
+}
+std::string_view BlockView::get_string(int id, std::string_view base_val) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::STRING);
+  return p ? view_string(base, view_load<uint64_t>(p)) : base_val;
+}
+BlockView BlockView::get_block(int id) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::BLOCK);
+  return p ? BlockView(base, base + view_load<uint64_t>(p)) : BlockView();
+}
+BlockView::Span<double> BlockView::get_arr(int id) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::ARRAY);
+  Span<double> span;
+  if (!p)
+    return span;
+  const char *a = base + view_load<uint64_t>(p);
+  if (view_load<uint32_t>(a) == Block::ValueType::DOUBLE)
+  {
+    span.ptr = reinterpret_cast<const double *>(a + 8);
+    span.count = view_load<uint32_t>(a + 4);
+  }
+  return span;
+}
+size_t BlockView::get_arr_size(int id) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::ARRAY);
+  return p ? view_load<uint32_t>(base + view_load<uint64_t>(p) + 4) : 0;
+}
+std::string_view BlockView::get_arr_string(int id, size_t index) const
+{
+  const char *p = view_payload(entry(id), Block::ValueType::ARRAY);
+  if (!p)
+    return std::string_view();
+  const char *a = base + view_load<uint64_t>(p);
+  if (view_load<uint32_t>(a) != Block::ValueType::STRING || index >= view_load<uint32_t>(a + 4))
+    return std::string_view();
+  return view_string(base, view_load<uint32_t>(a + 8 + 4 * index));
+}
+bool BlockView::get_bool(std::string_view name, bool base_val) const
+{
+  return get_bool(get_id(name), base_val);
+}
+int BlockView::get_int(std::string_view name, int base_val) const
+{
+  return get_int(get_id(name), base_val);
+}
+uint64_t BlockView::get_uint64(std::string_view name, uint64_t base_val) const
+{
+  return get_uint64(get_id(name), base_val);
+}
+double BlockView::get_double(std::string_view name, double base_val) const
+{
+  return get_double(get_id(name), base_val);
+}
+float2 BlockView::get_vec2(std::string_view name, float2 base_val) const
+{
+  return get_vec2(get_id(name), base_val);
+}
+float3 BlockView::get_vec3(std::string_view name, float3 base_val) const
+{
+  return get_vec3(get_id(name), base_val);
+}
+float4 BlockView::get_vec4(std::string_view name, float4 base_val) const
+{
+  return get_vec4(get_id(name), base_val);
+}
+int2 BlockView::get_ivec2(std::string_view name, int2 base_val) const
+{
+  return get_ivec2(get_id(name), base_val);
+}
+int3 BlockView::get_ivec3(std::string_view name, int3 base_val) const
+{
+  return get_ivec3(get_id(name), base_val);
+}
+int4 BlockView::get_ivec4(std::string_view name, int4 base_val) const
+{
+  return get_ivec4(get_id(name), base_val);
+}
+float4x4 BlockView::get_mat4(std::string_view name, float4x4 base_val) const
+{
+  return get_mat4(get_id(name), base_val);
+}
+unsigned BlockView::get_enum(std::string_view name, unsigned base_val) const
+{
+  return get_enum(get_id(name), base_val);
+}
+std::string_view BlockView::get_string(std::string_view name, std::string_view base_val) const
+{
+  return get_string(get_id(name), base_val);
+}
+BlockView BlockView::get_block(std::string_view name) const
+{
+  return get_block(get_id(name));
+}
+BlockView::Span<double> BlockView::get_arr(std::string_view name) const
+{
+  return get_arr(get_id(name));
+}
+
+//Tape layout, root block starts at word 0. Entry is a header word and payload:
+//  header: value type (8 bits), name length (24 bits), name offset in strings (32 bits)
+//  BOOL, INT, UINT64, DOUBLE, VEC2, IVEC2, ENUM (type id and value id): one word
+//  VEC3, VEC4, IVEC3, IVEC4: two words, MAT4: eight words with rows one after another
+//  STRING: string reference, length (32 bits) and offset (32 bits)
+//  ARRAY: element type (8 bits) and count (56 bits), then doubles or string references
+//  BLOCK: position of its table, then entries of the block. Table is the number of entries and their positions
+static constexpr uint64_t TAPE_COUNT_MASK = (1ull << 56) - 1;
+static constexpr size_t TAPE_MAX_NAME = (1 << 24) - 1;
+
+static inline uint64_t tape_pack(float a, float b)
+{
+  uint32_t x, y;
+  memcpy(&x, &a, 4);
+  memcpy(&y, &b, 4);
+  return x | (uint64_t)y << 32;
+}
+static inline uint64_t tape_pack(int a, int b)
+{
+  return (uint32_t)a | (uint64_t)(uint32_t)b << 32;
+}
+static inline float tape_float(uint64_t w, int half)
+{
+  uint32_t x = half ? w >> 32 : (uint32_t)w;
+  float f;
+  memcpy(&f, &x, 4);
+  return f;
+}
+static inline int tape_int(uint64_t w, int half)
+{
+  return (int)(uint32_t)(half ? w >> 32 : w);
+}
+static inline uint64_t tape_double(double d)
+{
+  uint64_t w;
+  memcpy(&w, &d, 8);
+  return w;
+}
+static inline Block::ValueType tape_type(uint64_t w)
+{
+  return Block::ValueType(w >> 56);
+}
+
+void BlockTape::clear()
+{
+  words.clear();
+  strings.clear();
+  entries.clear();
+}
+
+bool BlockTape::add_string(std::string_view s, uint64_t &ref)
+{
+  if (strings.size() + s.size() > UINT32_MAX)
+  {
+    fprintf(stderr, "[BlockTape::ERROR] strings of the document do not fit into 4GB\n");
+    return false;
+  }
+  ref = (uint64_t)s.size() << 32 | strings.size();
+  strings.append(s);
+  return true;
+}
+
+bool BlockTape::add_entry(Block::ValueType type, std::string_view name)
+{
+  uint64_t ref;
+  if (name.size() > TAPE_MAX_NAME)
+  {
+    fprintf(stderr, "[BlockTape::ERROR] name of %zu bytes is too long\n", name.size());
+    return false;
+  }
+  if (!add_string(name, ref))
+    return false;
+  entries.push_back(words.size());
+  words.push_back((uint64_t)type << 56 | ref);
+  return true;
+}
+
+//payload of any value except block
+bool BlockTape::add_value(const Block::Value &v)
+{
+  switch (v.type)
+  {
+  case Block::ValueType::BOOL:
+    words.push_back(v.b);
+    break;
+  case Block::ValueType::INT:
+    words.push_back((uint64_t)(int64_t)v.i);
+    break;
+  case Block::ValueType::UINT64:
+    words.push_back(v.u);
+    break;
+  case Block::ValueType::DOUBLE:
+    words.push_back(tape_double(v.d));
+    break;
+  case Block::ValueType::VEC2:
+    words.push_back(tape_pack(v.v2.x, v.v2.y));
+    break;
+  case Block::ValueType::VEC3:
+    words.push_back(tape_pack(v.v3.x, v.v3.y));
+    words.push_back(tape_pack(v.v3.z, 0.0f));
+    break;
+  case Block::ValueType::VEC4:
+    words.push_back(tape_pack(v.v4.x, v.v4.y));
+    words.push_back(tape_pack(v.v4.z, v.v4.w));
+    break;
+  case Block::ValueType::IVEC2:
+    words.push_back(tape_pack(v.iv2.x, v.iv2.y));
+    break;
+  case Block::ValueType::IVEC3:
+    words.push_back(tape_pack(v.iv3.x, v.iv3.y));
+    words.push_back(tape_pack(v.iv3.z, 0));
+    break;
+  case Block::ValueType::IVEC4:
+    words.push_back(tape_pack(v.iv4.x, v.iv4.y));
+    words.push_back(tape_pack(v.iv4.z, v.iv4.w));
+    break;
+  case Block::ValueType::MAT4:
+    for (int i = 0; i < 4; i++)
+    {
+      words.push_back(tape_pack(v.m4(i, 0), v.m4(i, 1)));
+      words.push_back(tape_pack(v.m4(i, 2), v.m4(i, 3)));
+    }
+    break;
+  case Block::ValueType::ENUM:
+    words.push_back((uint64_t)v.ev.type_id << 32 | v.ev.val_id);
+    break;
+  case Block::ValueType::STRING:
+  {
+    uint64_t ref;
+    if (!add_string(v.s ? std::string_view(*v.s) : std::string_view(), ref))
+      return false;
+    words.push_back(ref);
+    break;
+  }
+  case Block::ValueType::ARRAY:
+  {
+    Block::ValueType elem_type = v.a ? v.a->type : Block::ValueType::DOUBLE;
+    size_t count = v.a ? v.a->values.size() : 0;
+    words.push_back((uint64_t)elem_type << 56 | count);
+    for (size_t i = 0; i < count; i++)
+    {
+      const Block::Value &av = v.a->values[i];
+      uint64_t w = 0;
+      //values of other type than the array are written as zeros
+      if (elem_type == Block::ValueType::STRING && av.type == Block::ValueType::STRING && av.s && !add_string(*av.s, w))
+        return false;
+      if (elem_type != Block::ValueType::STRING && av.type == Block::ValueType::DOUBLE)
+        w = tape_double(av.d);
+      words.push_back(w);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  return true;
+}
+
+void BlockTape::close_block(size_t block_word, size_t entries_start)
+{
+  words[block_word] = words.size();
+  words.push_back(entries.size() - entries_start);
+  words.insert(words.end(), entries.begin() + entries_start, entries.end());
+  entries.resize(entries_start);
+}
+
+bool BlockTape::from_block(const Block &b)
+{
+  clear();
+  struct Frame
+  {
+    const Block *block;
+    int next;
+    size_t block_word;
+    size_t entries_start;
+  };
+  std::vector<Frame> stack = {{&b, 0, 0, 0}};
+  words.push_back(0);
+  while (!stack.empty())
+  {
+    Frame &f = stack.back();
+    if (f.next == f.block->size())
+    {
+      close_block(f.block_word, f.entries_start);
+      stack.pop_back();
+      continue;
+    }
+    int id = f.next++;
+    const Block::Value &v = f.block->value_at(id);
+    if (!add_entry(v.type, f.block->get_name(id)))
+    {
+      clear();
       return false;
     }
-    else if (token == "#include")
+    if (v.type == Block::ValueType::BLOCK)
     {
-      //#include "<path_to_block>"
-      token = next_token(data, cur_pos);
-      if (token != "\"")
-      {
-        fprintf(stderr, "line %d expected \" after #include", cur_line);
+      size_t block_word = words.size();
+      words.push_back(0);
+      if (v.bl)
+        stack.push_back({v.bl, 0, block_word, entries.size()});
+      else
+        close_block(block_word, entries.size());
+    }
+    else if (!add_value(v))
+    {
+      clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+//Only plain documents are parsed here, false is returned on #include, extends and anything that gives
+//diagnostics, the main parser loads such documents
+bool BlockTape::parse(const char *data, size_t size)
+{
+  //globals of the parser are set as for a new parse and restored after it
+  struct GlobalsGuard
+  {
+    bool comment = in_comment;
+    bool comment_assume = in_comment_assume;
+    EnumParseCache enum_cache;
+    std::vector<BlkDiagnostic> diagnostics;
+    GlobalsGuard()
+    {
+      in_comment = in_comment_assume = false;
+      std::swap(enum_cache, enum_parse_cache);
+      std::swap(diagnostics, parse_diagnostics);
+    }
+    ~GlobalsGuard()
+    {
+      in_comment = comment;
+      in_comment_assume = comment_assume;
+      std::swap(enum_cache, enum_parse_cache);
+      std::swap(diagnostics, parse_diagnostics);
+    }
+  } guard;
+
+  clear();
+  int cur_pos = 0;
+  if (size == 0 || next_token(data, cur_pos) != "{")
+    return false;
+  words.reserve(size / 8 + 1);
+  strings.reserve(size / 4);
+  words.push_back(0);
+  //block word and start of its entries for every open block
+  std::vector<std::pair<size_t, size_t>> blocks = {{0, 0}};
+  Block::Value v;
+  while (!blocks.empty())
+  {
+    std::string name = next_token(data, cur_pos);
+    if (name == "}")
+    {
+      close_block(blocks.back().first, blocks.back().second);
+      blocks.pop_back();
+      continue;
+    }
+    if (name.empty() || name == "#include")
+      return false;
+    std::string token = next_token(data, cur_pos);
+    if (token == "{")
+    {
+      if (!add_entry(Block::ValueType::BLOCK, name))
         return false;
-      }
-      std::string path = read_string(data, cur_pos);
-      if (data[cur_pos] == '\"')
+      blocks.push_back({words.size(), entries.size()});
+      words.push_back(0);
+      continue;
+    }
+    if (token != ":")
+      return false;
+    std::string type = next_token(data, cur_pos);
+    if (type == "tag")
+    {
+      if (!add_entry(Block::ValueType::EMPTY, name))
+        return false;
+      continue;
+    }
+    if (next_token(data, cur_pos) != "=")
+      return false;
+    Block::ValueType value_type = value_type_by_tag(type);
+    if (value_type == Block::ValueType::STRING)
+    {
+      //strings are copied right into the buffer
+      uint64_t ref;
+      if (next_token(data, cur_pos) != "\"")
       {
-        cur_pos++;
+        if (!add_entry(Block::ValueType::EMPTY, name))
+          return false;
+        continue;
       }
-      else
-      {
-        fprintf(stderr, "line %d expected \" at the end of a string in include path\n", cur_line);
+      std::string s = read_string(data, cur_pos);
+      if (data[cur_pos] != '\"' || !add_entry(Block::ValueType::STRING, name) || !add_string(s, ref))
         return false;
-      }
-
-      Block b_to_include;
-      bool loaded_b_to_include = load_block_from_file(path, b_to_include);
-      if (loaded_b_to_include)
+      cur_pos++;
+      words.push_back(ref);
+    }
+    else if (value_type == Block::ValueType::ARRAY)
+    {
+      if (next_token(data, cur_pos) != "{" || !add_entry(Block::ValueType::ARRAY, name))
+        return false;
+      size_t header = words.size();
+      words.push_back(0);
+      Block::ValueType elem_type = Block::ValueType::DOUBLE;
+      size_t count = 0;
+      for (std::string tok = next_token(data, cur_pos); tok != "}"; count++)
       {
-        for (int i=0;i<b_to_include.size();i++)
+        Block::ValueType t = Block::ValueType::DOUBLE;
+        uint64_t w;
+        if (tok == "\"")
         {
-          b.names.push_back(b_to_include.names[i]);
-          b.values.push_back(b_to_include.values[i]);
-          b_to_include.values[i].type = Block::ValueType::EMPTY;
+          std::string s = read_string(data, cur_pos);
+          if (data[cur_pos] != '\"' || !add_string(s, w))
+            return false;
+          cur_pos++;
+          t = Block::ValueType::STRING;
         }
+        else if (!tok.empty())
+          w = tape_double(std::stod(tok));
+        else
+          return false;
+        //arrays of different values and arrays that end with comma stay in the main parser
+        if (count > 0 && t != elem_type)
+          return false;
+        elem_type = t;
+        words.push_back(w);
+        tok = next_token(data, cur_pos);
+        if (tok == ",")
+        {
+          tok = next_token(data, cur_pos);
+          if (tok == "}")
+            return false;
+        }
+        else if (tok != "}")
+          return false;
       }
-      else
-      {
-        printf("Warning: failed to load block %s required by #include command", path.c_str());
-      }
+      words[header] = (uint64_t)elem_type << 56 | count;
     }
     else
     {
-      // next value
-      b.names.push_back(token);
-      b.values.emplace_back();
-      correct = correct && read_value(data, cur_pos, b.values.back(), b, global_parent);
+      if (read_typed_value(data, cur_pos, type, v) != ReadValueResult::DONE || !add_entry(v.type, name) ||
+          !add_value(v))
+        return false;
+      v.type = Block::ValueType::EMPTY; //only scalars are read here
     }
   }
-  return true;
+  return parse_diagnostics.empty();
+}
+
+bool BlockTape::load_text(const char *text, size_t size, const std::string &file)
+{
+  if (parse(text, size))
+    return true;
+  Block b;
+  if (load_block_from_text(std::string(text, size), b, BlkLoadOptions(), file) && from_block(b))
+    return true;
+  clear();
+  return false;
+}
+
+bool BlockTape::load(const char *text, size_t size)
+{
+  return load_text(text, size, "");
+}
+
+bool BlockTape::load_from_file(const std::string &path)
+{
+  std::string text;
+  if (!read_file(path, text))
+  {
+    clear();
+    return false;
+  }
+  return load_text(text.c_str(), text.size(), path);
+}
+
+const uint64_t *BlockTape::View::entry(int id) const
+{
+  if (!tape || id < 0)
+    return nullptr;
+  const uint64_t *w = tape->words.data();
+  size_t table = w[pos];
+  return (uint64_t)id < w[table] ? w + w[table + 1 + id] : nullptr;
+}
+int BlockTape::View::size() const
+{
+  return tape ? tape->words[tape->words[pos]] : 0;
+}
+int BlockTape::View::get_id(std::string_view name) const
+{
+  return get_next_id(name, 0);
+}
+int BlockTape::View::get_next_id(std::string_view name, int from) const
+{
+  int count = size();
+  for (int i = std::max(from, 0); i < count; i++)
+  {
+    uint64_t h = *entry(i);
+    if (((h >> 32) & TAPE_MAX_NAME) == name.size() && memcmp(tape->strings.data() + (uint32_t)h, name.data(), name.size()) == 0)
+      return i;
+  }
+  return -1;
+}
+std::string_view BlockTape::View::get_name(int id) const
+{
+  const uint64_t *e = entry(id);
+  return e ? std::string_view(tape->strings.data() + (uint32_t)*e, (*e >> 32) & TAPE_MAX_NAME) : std::string_view();
+}
+Block::ValueType BlockTape::View::get_type(int id) const
+{
+  const uint64_t *e = entry(id);
+  return e ? tape_type(*e) : Block::ValueType::EMPTY;
+}
+Block::ValueType BlockTape::View::get_type(std::string_view name) const
+{
+  return get_type(get_id(name));
+}
+bool BlockTape::View::has_tag(std::string_view name) const
+{
+  int id = get_id(name);
+  return id >= 0 && get_type(id) == Block::ValueType::EMPTY;
+}
+
+//payload of the entry if it has the given type, nullptr otherwise
+static inline const uint64_t *tape_payload(const uint64_t *e, Block::ValueType type)
+{
+  return (e && tape_type(*e) == type) ? e + 1 : nullptr;
+}
+static inline std::string_view tape_string(const std::string &strings, uint64_t ref)
+{
+  return std::string_view(strings.data() + (uint32_t)ref, ref >> 32);
+}
+
+bool BlockTape::View::get_bool(int id, bool base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::BOOL);
+  return p ? *p != 0 : base_val;
+}
+int BlockTape::View::get_int(int id, int base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::INT);
+  return p ? (int64_t)*p : base_val;
+}
+uint64_t BlockTape::View::get_uint64(int id, uint64_t base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::UINT64);
+  return p ? *p : base_val;
+}
+double BlockTape::View::get_double(int id, double base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::DOUBLE);
+  if (!p)
+    return base_val;
+  double d;
+  memcpy(&d, p, 8);
+  return d;
+}
+float2 BlockTape::View::get_vec2(int id, float2 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::VEC2);
+  return p ? float2(tape_float(p[0], 0), tape_float(p[0], 1)) : base_val;
+}
+float3 BlockTape::View::get_vec3(int id, float3 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::VEC3);
+  return p ? float3(tape_float(p[0], 0), tape_float(p[0], 1), tape_float(p[1], 0)) : base_val;
+}
+float4 BlockTape::View::get_vec4(int id, float4 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::VEC4);
+  return p ? float4(tape_float(p[0], 0), tape_float(p[0], 1), tape_float(p[1], 0), tape_float(p[1], 1)) : base_val;
+}
+int2 BlockTape::View::get_ivec2(int id, int2 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::IVEC2);
+  return p ? int2(tape_int(p[0], 0), tape_int(p[0], 1)) : base_val;
+}
+int3 BlockTape::View::get_ivec3(int id, int3 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::IVEC3);
+  return p ? int3(tape_int(p[0], 0), tape_int(p[0], 1), tape_int(p[1], 0)) : base_val;
+}
+int4 BlockTape::View::get_ivec4(int id, int4 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::IVEC4);
+  return p ? int4(tape_int(p[0], 0), tape_int(p[0], 1), tape_int(p[1], 0), tape_int(p[1], 1)) : base_val;
+}
+float4x4 BlockTape::View::get_mat4(int id, float4x4 base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::MAT4);
+  if (!p)
+    return base_val;
+  float4x4 m;
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++)
+      m(i, j) = tape_float(p[2 * i + j / 2], j % 2);
+  return m;
+}
+unsigned BlockTape::View::get_enum(int id, unsigned base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::ENUM);
+  return p ? enum_info(*p >> 32).value((uint32_t)*p) : base_val;
+}
+std::string_view BlockTape::View::get_enum_name(int id) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::ENUM);
+  return p ? enum_info(*p >> 32).value_name((uint32_t)*p) : std::string_view();
+}
+std::string_view BlockTape::View::get_string(int id, std::string_view base_val) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::STRING);
+  return p ? tape_string(tape->strings, *p) : base_val;
+}
+BlockTape::View BlockTape::View::get_block(int id) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::BLOCK);
+  return p ? View(tape, p - tape->words.data()) : View();
+}
+BlockView::Span<double> BlockTape::View::get_arr(int id) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::ARRAY);
+  BlockView::Span<double> span;
+  if (p && tape_type(*p) == Block::ValueType::DOUBLE)
+  {
+    span.ptr = reinterpret_cast<const double *>(p + 1);
+    span.count = *p & TAPE_COUNT_MASK;
+  }
+  return span;
+}
+size_t BlockTape::View::get_arr_size(int id) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::ARRAY);
+  return p ? *p & TAPE_COUNT_MASK : 0;
+}
+std::string_view BlockTape::View::get_arr_string(int id, size_t index) const
+{
+  const uint64_t *p = tape_payload(entry(id), Block::ValueType::ARRAY);
+  if (!p || tape_type(*p) != Block::ValueType::STRING || index >= (*p & TAPE_COUNT_MASK))
+    return std::string_view();
+  return tape_string(tape->strings, p[1 + index]);
+}
+bool BlockTape::View::get_bool(std::string_view name, bool base_val) const
+{
+  return get_bool(get_id(name), base_val);
+}
+int BlockTape::View::get_int(std::string_view name, int base_val) const
+{
+  return get_int(get_id(name), base_val);
+}
+uint64_t BlockTape::View::get_uint64(std::string_view name, uint64_t base_val) const
+{
+  return get_uint64(get_id(name), base_val);
+}
+double BlockTape::View::get_double(std::string_view name, double base_val) const
+{
+  return get_double(get_id(name), base_val);
+}
+float2 BlockTape::View::get_vec2(std::string_view name, float2 base_val) const
+{
+  return get_vec2(get_id(name), base_val);
+}
+float3 BlockTape::View::get_vec3(std::string_view name, float3 base_val) const
+{
+  return get_vec3(get_id(name), base_val);
+}
+float4 BlockTape::View::get_vec4(std::string_view name, float4 base_val) const
+{
+  return get_vec4(get_id(name), base_val);
+}
+int2 BlockTape::View::get_ivec2(std::string_view name, int2 base_val) const
+{
+  return get_ivec2(get_id(name), base_val);
+}
+int3 BlockTape::View::get_ivec3(std::string_view name, int3 base_val) const
+{
+  return get_ivec3(get_id(name), base_val);
+}
+int4 BlockTape::View::get_ivec4(std::string_view name, int4 base_val) const
+{
+  return get_ivec4(get_id(name), base_val);
+}
+float4x4 BlockTape::View::get_mat4(std::string_view name, float4x4 base_val) const
+{
+  return get_mat4(get_id(name), base_val);
+}
+unsigned BlockTape::View::get_enum(std::string_view name, unsigned base_val) const
+{
+  return get_enum(get_id(name), base_val);
+}
+std::string_view BlockTape::View::get_string(std::string_view name, std::string_view base_val) const
+{
+  return get_string(get_id(name), base_val);
+}
+BlockTape::View BlockTape::View::get_block(std::string_view name) const
+{
+  return get_block(get_id(name));
+}
+BlockView::Span<double> BlockTape::View::get_arr(std::string_view name) const
+{
+  return get_arr(get_id(name));
+}
+
+
+MappedBlockFile::~MappedBlockFile()
+{
+  close();
+}
+
+bool MappedBlockFile::open(const std::string &path, bool verify)
+{
+  close();
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER file_size;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size))
+  {
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    fprintf(stderr, "unable to open file %s\n", path.c_str());
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void *ptr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  if (!ptr)
+  {
+    if (mapping)
+      CloseHandle(mapping);
+    CloseHandle(file);
+    fprintf(stderr, "unable to map file %s\n", path.c_str());
+    return false;
+  }
+  file_handle = file;
+  mapping_handle = mapping;
+  size = file_size.QuadPart;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+      ::close(fd);
+    fprintf(stderr, "unable to open file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  void *ptr = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  ::close(fd);
+  if (ptr == MAP_FAILED)
+  {
+    fprintf(stderr, "unable to map file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  size = st.st_size;
+#endif
+  data = (const char *)ptr;
+  view = get_block_view(data, size, verify);
+  if (!view.valid())
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void MappedBlockFile::close()
+{
+  if (!data)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+  CloseHandle(mapping_handle);
+  CloseHandle(file_handle);
+  mapping_handle = nullptr;
+  file_handle = nullptr;
+#else
+  munmap((void *)data, size);
+#endif
+  data = nullptr;
+  size = 0;
+  view = BlockView();
+}
+
+void Block::Value::clear()
+{
+  switch (type)
+  {
+  case Block::ValueType::BLOCK:
+    delete bl;
+    bl = nullptr;
+    break;
+  case Block::ValueType::ARRAY:
+    delete a;
+    a = nullptr;
+    break;
+  case Block::ValueType::STRING:
+    delete s;
+    s = nullptr;
+    break;
+  default:
+    break;
+  }
+
+  type = Block::ValueType::EMPTY;
+}
+//flatten removes the dependent from the list of its base
+static void flatten_lazy_dependents(Block &b)
+{
+  while (!b.lazy_dependents.empty())
+    b.lazy_dependents.back()->flatten(false);
+}
+
+static void remove_lazy_dependent(Block &b)
+{
+  std::vector<Block *> &dependents = b.lazy->base->lazy_dependents;
+  auto it = std::find(dependents.begin(), dependents.end(), &b);
+  if (it != dependents.end())
+  {
+    *it = dependents.back();
+    dependents.pop_back();
+  }
+}
+
+void Block::clear()
+{
+  flatten_lazy_dependents(*this);
+  for (int i = 0; i < values.size(); i++)
+  {
+    values[i].clear();
+  }
+  values.clear();
+  names.clear();
+  if (lazy)
+  {
+    remove_lazy_dependent(*this);
+    for (Value &v : lazy->shadows)
+      v.clear();
+    lazy.reset();
+  }
+  name_index.reset();
+  sorted_ids.clear();
+  frozen = false;
 }
 
-bool load_block_from_string(const std::string &str, Block &b)
+//one level of extend_lazy, sub-blocks that should be extended too are added to the stack
+static void extend_lazy_block(Block &b, const Block *base, std::vector<std::pair<Block *, const Block *>> &stack)
 {
-  b = Block();
-  if (str.empty())
-    return false;
-  cur_line = 0;
-  int cur_pos = 0;
-  const char *data = str.c_str();
-  std::string token = next_token(data, cur_pos);
-  if (token == "{")
+  if (b.lazy)
+    b.flatten(false);
+  bool has_duplicates = false;
+  for (int i = 0; i < b.names.size() && !has_duplicates; i++)
+    has_duplicates = b.get_next_id(b.names[i], i + 1) >= 0;
+  //frozen base can be shared between threads, so it cannot keep the list of its lazy dependents
+  if (!base || has_duplicates || base->frozen)
   {
-    return load_block(data, cur_pos, b, b);
+    //repeated overrides of one value are applied one after another, it is easier to do it right away
+    Block det;
+    det.names = std::move(b.names);
+    det.values = std::move(b.values);
+    b.names.clear();
+    b.values.clear();
+    if (base)
+      b.copy(base);
+    b.add_detalization(det);
+    return;
   }
-  else
+
+  b.lazy.reset(new Block::LazyBase());
+  Block::LazyBase &lazy = *b.lazy;
+  lazy.base = base;
+  lazy.base_ids.resize(base->size(), -1);
+  base->lazy_dependents.push_back(&b);
+  for (int i = 0; i < b.names.size(); i++)
   {
-    return false;
+    int base_id = base->get_id(b.names[i]);
+    if (base_id < 0)
+      lazy.own_ids.push_back(i);
+    else if (base->get_type(base_id) == b.values[i].type)
+    {
+      //sub-blocks are merged with the corresponding base sub-blocks
+      if (b.values[i].type == Block::ValueType::BLOCK)
+      {
+        const Block *base_block = base->value_at(base_id).bl;
+        if (!b.values[i].bl || !base_block)
+          continue;
+        stack.push_back({b.values[i].bl, base_block});
+      }
+      lazy.base_ids[base_id] = i;
+    }
+    //values with different type than in base are ignored
   }
-  return true;
-}
-
-bool load_block_from_file(std::string path, Block &b)
-{
-  b = Block();
-  std::fstream f(path);
-  std::stringstream iss;
-  if (f.fail())
+  //returned blocks can be changed, so get_block cannot return blocks of base
+  for (int i = 0; i < lazy.base_ids.size(); i++)
   {
-    fprintf(stderr, "unable to load file %s", path.c_str());
-    return false;
+    const Block::Value &bv = base->value_at(i);
+    if (lazy.base_ids[i] >= 0 || bv.type != Block::ValueType::BLOCK || !bv.bl)
+      continue;
+    if (lazy.shadows.empty())
+      lazy.shadows.resize(lazy.base_ids.size());
+    lazy.shadows[i].type = Block::ValueType::BLOCK;
+    lazy.shadows[i].bl = new Block();
+    stack.push_back({lazy.shadows[i].bl, bv.bl});
   }
-  iss << f.rdbuf();
-  std::string entireFile = iss.str();
-  load_block_from_string(entireFile, b);
-  return true;
 }
 
-int Block::size() const
+void Block::extend_lazy(const Block *base)
 {
-  return names.size();
+  flatten_lazy_dependents(*this);
+  //pairs of (block, its base), sub-blocks are extended without recursion
+  std::vector<std::pair<Block *, const Block *>> stack = {{this, base}};
+  while (!stack.empty())
+  {
+    auto [b, b_base] = stack.back();
+    stack.pop_back();
+    extend_lazy_block(*b, b_base, stack);
+  }
 }
 
-int Block::get_id(const std::string &name) const
-{
-  return get_next_id(name, 0);
-}
-int Block::get_next_id(const std::string &name, int pos) const
+void Block::flatten(bool recursive)
 {
-  for (int i = pos; i < names.size(); i++)
+  if (lazy)
   {
-    if (names[i] == name)
-      return i;
+    flatten_lazy_dependents(*this);
+    int base_size = lazy->base_ids.size();
+    std::vector<std::string> flat_names;
+    std::vector<Value> flat_values;
+    flat_names.reserve(size());
+    flat_values.reserve(size());
+    for (int i = 0; i < base_size; i++)
+    {
+      flat_names.push_back(lazy->base->get_name(i));
+      int own_id = lazy->base_ids[i];
+      Value *own = own_id >= 0 ? &values[own_id] : nullptr;
+      if (!own && !lazy->shadows.empty() && lazy->shadows[i].type == ValueType::BLOCK)
+        own = &lazy->shadows[i];
+      if (own)
+      {
+        flat_values.push_back(*own); //shallow copy, ownership is moved
+        own->type = ValueType::EMPTY;
+      }
+      else
+      {
+        flat_values.emplace_back();
+        flat_values.back().copy(lazy->base->value_at(i));
+      }
+    }
+    for (int own_id : lazy->own_ids)
+    {
+      flat_names.push_back(names[own_id]);
+      flat_values.push_back(values[own_id]);
+      values[own_id].type = ValueType::EMPTY;
+    }
+    clear(); //ignored values and unused shadows
+    names = std::move(flat_names);
+    values = std::move(flat_values);
+  }
+  if (recursive)
+  {
+    std::vector<Block *> stack = {this};
+    while (!stack.empty())
+    {
+      Block *cur = stack.back();
+      stack.pop_back();
+      if (cur != this)
+        cur->flatten(false);
+      for (Value &v : cur->values)
+        if (v.type == ValueType::BLOCK && v.bl)
+          stack.push_back(v.bl);
+    }
   }
-  return -1;
 }
-Block::ValueType Block::get_type(int id) const
+void Block::make_mutable()
 {
-  return (id >= 0 && id < size()) ? values[id].type : Block::ValueType::EMPTY;
+  flatten_lazy_dependents(*this);
+  flatten(false);
 }
-Block::ValueType Block::get_type(const std::string &name) const
+bool Block::has_tag(const std::string &name) const
 {
-  return get_type(get_id(name));
+  int id = get_id(name);
+  return id >= 0 && (get_type(id) == Block::ValueType::EMPTY);
 }
 
-int Block::get_bool(int id, bool base_val) const
-{
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::BOOL) ? values[id].b : base_val;
-}
-int Block::get_int(int id, int base_val) const
-{
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::INT) ? values[id].i : base_val;
-}
-uint64_t Block::get_uint64(int id, uint64_t base_val) const
-{
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::UINT64) ? values[id].u : base_val;
-}
-double Block::get_double(int id, double base_val) const
+void Block::add_bool(const std::string name, bool base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::DOUBLE) ? values[id].d : base_val;
+  add<bool>(name, base_val);
 }
-float2 Block::get_vec2(int id, float2 base_val) const
+void Block::add_int(const std::string name, int base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::VEC2) ? values[id].v2 : base_val;
+  add<int>(name, base_val);
 }
-float3 Block::get_vec3(int id, float3 base_val) const
+void Block::add_uint64(const std::string name, uint64_t base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::VEC3) ? values[id].v3 : base_val;
+  add<uint64_t>(name, base_val);
 }
-float4 Block::get_vec4(int id, float4 base_val) const
+void Block::add_double(const std::string name, double base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::VEC4) ? values[id].v4 : base_val;
+  add<double>(name, base_val);
 }
-int2 Block::get_ivec2(int id, int2 base_val) const
+void Block::add_vec2(const std::string name, float2 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::IVEC2) ? values[id].iv2 : base_val;
+  add<float2>(name, base_val);
 }
-int3 Block::get_ivec3(int id, int3 base_val) const
+void Block::add_vec3(const std::string name, float3 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::IVEC3) ? values[id].iv3 : base_val;
+  add<float3>(name, base_val);
 }
-int4 Block::get_ivec4(int id, int4 base_val) const
+void Block::add_vec4(const std::string name, float4 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::IVEC4) ? values[id].iv4 : base_val;
+  add<float4>(name, base_val);
 }
-float4x4 Block::get_mat4(int id, float4x4 base_val) const
+void Block::add_ivec2(const std::string name, int2 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::MAT4) ? values[id].m4 : base_val;
+  add<int2>(name, base_val);
 }
-unsigned Block::get_enum(int id, unsigned base_val) const
+void Block::add_ivec3(const std::string name, int3 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::ENUM) ? get_enum_info()[values[id].ev.type_id].values[values[id].ev.val_id] : base_val;
+  add<int3>(name, base_val);
 }
-std::string Block::get_string(int id, std::string base_val) const
+void Block::add_ivec4(const std::string name, int4 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::STRING && values[id].s) ? *(values[id].s) : base_val;
+  add<int4>(name, base_val);
 }
-Block *Block::get_block(int id, Block *base_val) const
+void Block::add_mat4(const std::string name, float4x4 base_val)
 {
-  return (id >= 0 && id < size() && values[id].type == Block::ValueType::BLOCK) ? values[id].bl : base_val;
+  add<float4x4>(name, base_val);
 }
-bool Block::get_arr(int id, std::vector<double> &_values, bool replace) const
+void Block::add_enum(const std::string name, const std::string &type_name, unsigned base_val)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
+  int type_id = find_enum_type(type_name);
+  if (type_id < 0)
   {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
+    fprintf(stderr, "[add_enum::ERROR] enum %s is not registered\n", type_name.c_str());
+    return;
   }
-  return false;
-}
-bool Block::get_arr(int id, std::vector<float> &_values, bool replace) const
-{
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
+  int val_id = enum_info(type_id).find_value(base_val);
+  if (val_id < 0)
   {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
+    fprintf(stderr, "[add_enum::ERROR] enum %s has no value %u\n", type_name.c_str(), base_val);
+    return;
   }
-  return false;
+  Block::Value val;
+  val.type = Block::ValueType::ENUM;
+  val.ev.type_id = type_id;
+  val.ev.val_id = val_id;
+  add_value(name, val);
 }
-bool Block::get_arr(int id, std::vector<int> &_values, bool replace) const
+void Block::add_string(const std::string name, std::string base_val)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
-  {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
-  }
-  return false;
+  add<std::string>(name, base_val);
 }
-bool Block::get_arr(int id, std::vector<unsigned> &_values, bool replace) const
+void Block::add_block(const std::string name, Block *bl)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
-  {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
-  }
-  return false;
+  Block::Value val;
+  val.type = Block::ValueType::BLOCK;
+
+  val.bl = new Block();
+  if (bl != nullptr)
+    val.bl->copy(bl);
+  add_value(name, val);
 }
-bool Block::get_arr(int id, std::vector<short> &_values, bool replace) const
+
+void Block::set_bool(const std::string name, bool base_val)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
-  {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
-  }
-  return false;
+  set<bool>(name, base_val);
 }
-bool Block::get_arr(int id, std::vector<unsigned short> &_values, bool replace) const
+void Block::set_int(const std::string name, int base_val)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == DOUBLE))
-  {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      _values.push_back(v.d);
-    }
-    return true;
-  }
-  return false;
+  set<int>(name, base_val);
 }
-bool Block::get_arr(int id, std::vector<std::string> &_values, bool replace) const
+void Block::set_uint64(const std::string name, uint64_t base_val)
 {
-  if (id >= 0 && id < size() && values[id].type == Block::ValueType::ARRAY && values[id].a &&
-      (values[id].a->type == STRING))
-  {
-    if (replace)
-      _values.clear();
-    for (Block::Value &v : values[id].a->values)
-    {
-      if (v.s)
-        _values.push_back(*(v.s));
-      else
-        _values.push_back("");
-    }
-    return true;
-  }
-  return false;
+  set<uint64_t>(name, base_val);
 }
-
-int Block::get_bool(const std::string name, bool base_val) const
+void Block::set_double(const std::string name, double base_val)
 {
-  return get_bool(get_id(name), base_val);
+  set<double>(name, base_val);
 }
-int Block::get_int(const std::string name, int base_val) const
+void Block::set_vec2(const std::string name, float2 base_val)
 {
-  return get_int(get_id(name), base_val);
+  set<float2>(name, base_val);
 }
-uint64_t Block::get_uint64(const std::string name, uint64_t base_val) const
+void Block::set_vec3(const std::string name, float3 base_val)
 {
-  return get_uint64(get_id(name), base_val);
+  set<float3>(name, base_val);
 }
-double Block::get_double(const std::string name, double base_val) const
+void Block::set_vec4(const std::string name, float4 base_val)
 {
-  return get_double(get_id(name), base_val);
+  set<float4>(name, base_val);
 }
-float2 Block::get_vec2(const std::string name, float2 base_val) const
+void Block::set_ivec2(const std::string name, int2 base_val)
 {
-  return get_vec2(get_id(name), base_val);
+  set<int2>(name, base_val);
 }
-float3 Block::get_vec3(const std::string name, float3 base_val) const
+void Block::set_ivec3(const std::string name, int3 base_val)
 {
-  return get_vec3(get_id(name), base_val);
+  set<int3>(name, base_val);
 }
-float4 Block::get_vec4(const std::string name, float4 base_val) const
+void Block::set_ivec4(const std::string name, int4 base_val)
 {
-  return get_vec4(get_id(name), base_val);
+  set<int4>(name, base_val);
 }
-int2 Block::get_ivec2(const std::string name, int2 base_val) const
+void Block::set_mat4(const std::string name, float4x4 base_val)
 {
-  return get_ivec2(get_id(name), base_val);
+  set<float4x4>(name, base_val);
 }
-int3 Block::get_ivec3(const std::string name, int3 base_val) const
+void Block::set_enum(const std::string name, const std::string &type_name, unsigned base_val)
 {
-  return get_ivec3(get_id(name), base_val);
+  int type_id = find_enum_type(type_name);
+  if (type_id < 0)
+  {
+    fprintf(stderr, "[add_enum::ERROR] enum %s is not registered\n", type_name.c_str());
+    return;
+  }
+  int val_id = enum_info(type_id).find_value(base_val);
+  if (val_id < 0)
+  {
+    fprintf(stderr, "[add_enum::ERROR] enum %s has no value %u\n", type_name.c_str(), base_val);
+    return;
+  }
+  Block::Value val;
+  val.type = Block::ValueType::ENUM;
+  val.ev.type_id = type_id;
+  val.ev.val_id = val_id;
+  set_value(name, val);
 }
-int4 Block::get_ivec4(const std::string name, int4 base_val) const
+void Block::set_string(const std::string name, std::string base_val)
 {
-  return get_ivec4(get_id(name), base_val);
+  set<std::string>(name, base_val);
 }
-float4x4 Block::get_mat4(const std::string name, float4x4 base_val) const
+void Block::set_block(const std::string name, Block *bl)
 {
-  return get_mat4(get_id(name), base_val);
+  Block::Value val;
+  val.type = Block::ValueType::BLOCK;
+  val.bl = new Block();
+  val.bl->copy(bl);
+  take_value(name, val, true);
 }
-unsigned Block::get_enum(const std::string name, unsigned base_val) const
+std::string Block::get_name(int id) const
 {
-  return get_enum(get_id(name), base_val);
+  if (lazy)
+  {
+    int base_size = lazy->base_ids.size();
+    if (id >= 0 && id < base_size)
+      return lazy->base->get_name(id);
+    return (id >= base_size && id < size()) ? names[lazy->own_ids[id - base_size]] : "";
+  }
+  return (id >= 0 && id < names.size()) ? names[id] : "";
 }
-std::string Block::get_string(const std::string name, std::string base_val) const
+void Block::add_value(const std::string &name, const Block::Value &value)
 {
-  return get_string(get_id(name), base_val);
+  if (frozen)
+  {
+    fprintf(stderr, "[Block::ERROR] frozen block cannot be changed, value %s is not added\n", name.c_str());
+    return;
+  }
+  make_mutable();
+  values.push_back(value);
+  names.push_back(name);
 }
-Block *Block::get_block(std::string name, Block *base_val) const
+void Block::take_value(const std::string &name, Block::Value &value, bool replace)
 {
-  return get_block(get_id(name), base_val);
+  if (frozen)
+  {
+    fprintf(stderr, "[Block::ERROR] frozen block cannot be changed, value %s is not added\n", name.c_str());
+    value.clear();
+    return;
+  }
+  make_mutable();
+  int id = replace ? get_id(name) : -1;
+  if (id >= 0)
+  {
+    values[id].clear();
+    new (&values[id]) Block::Value(value);
+  }
+  else
+  {
+    values.push_back(value);
+    names.push_back(name);
+  }
+  value.type = Block::ValueType::EMPTY;
 }
-bool Block::get_arr(const std::string name, std::vector<double> &_values, bool replace) const
+BlockBuilder::BlockBuilder(size_t reserve_size, bool _unique_names) : unique_names(_unique_names)
 {
-  return get_arr(get_id(name), _values, replace);
+  reserve(reserve_size);
 }
-bool Block::get_arr(const std::string name, std::vector<float> &_values, bool replace) const
+
+void BlockBuilder::reserve(size_t size)
 {
-  return get_arr(get_id(name), _values, replace);
+  block.names.reserve(size);
+  block.values.reserve(size);
+  if (unique_names && size * 2 > slots.size())
+    rehash(size);
 }
-bool Block::get_arr(const std::string name, std::vector<int> &_values, bool replace) const
+
+//table is kept at most half full
+void BlockBuilder::rehash(size_t size)
 {
-  return get_arr(get_id(name), _values, replace);
+  size_t capacity = 16;
+  while (capacity < size * 2)
+    capacity *= 2;
+  slots.assign(capacity, -1);
+  size_t mask = capacity - 1;
+  for (int id = 0; id < block.names.size(); id++)
+  {
+    size_t pos = hash_string(block.names[id]) & mask;
+    while (slots[pos] >= 0)
+      pos = (pos + 1) & mask;
+    slots[pos] = id;
+  }
 }
-bool Block::get_arr(const std::string name, std::vector<unsigned> &_values, bool replace) const
+
+BlockBuilder &BlockBuilder::add_tag(std::string name)
 {
-  return get_arr(get_id(name), _values, replace);
+  Block::Value v;
+  return add_value(std::move(name), v);
 }
-bool Block::get_arr(const std::string name, std::vector<short> &_values, bool replace) const
+
+BlockBuilder &BlockBuilder::add_block(std::string name, Block &&b)
 {
-  return get_arr(get_id(name), _values, replace);
+  Block::Value v;
+  v.type = Block::ValueType::BLOCK;
+  v.bl = new Block(std::move(b));
+  return add_value(std::move(name), v);
 }
-bool Block::get_arr(const std::string name, std::vector<unsigned short> &_values, bool replace) const
+
+BlockBuilder &BlockBuilder::add_value(std::string name, Block::Value &value)
 {
-  return get_arr(get_id(name), _values, replace);
+  if (unique_names)
+  {
+    if ((block.names.size() + 1) * 2 > slots.size())
+      rehash(std::max<size_t>(block.names.size() + 1, slots.size()));
+    size_t mask = slots.size() - 1;
+    size_t pos = hash_string(name) & mask;
+    for (; slots[pos] >= 0; pos = (pos + 1) & mask)
+    {
+      if (block.names[slots[pos]] == name)
+      {
+        Block::Value &old = block.values[slots[pos]];
+        old.clear();
+        new (&old) Block::Value(value);
+        value.type = Block::ValueType::EMPTY;
+        return *this;
+      }
+    }
+    slots[pos] = block.values.size();
+  }
+  block.values.push_back(value);
+  block.names.push_back(std::move(name));
+  value.type = Block::ValueType::EMPTY;
+  return *this;
 }
-bool Block::get_arr(const std::string name, std::vector<std::string> &_values, bool replace) const
+
+Block BlockBuilder::finish()
 {
-  return get_arr(get_id(name), _values, replace);
+  Block res(std::move(block));
+  block.names.clear();
+  block.values.clear();
+  slots.clear();
+  return res;
 }
-Block *Block::get_block_rec(std::string name, Block *base_val) const
+
+void Block::set_value(const std::string &name, const Block::Value &value)
 {
-  auto it = name.find_first_of('.');
-  if (it == std::string::npos)
-    return get_block(name, base_val);
-  Block *child = get_block(name.substr(0, it));
-  if (child)
-    return child->get_block_rec(name.substr(it + 1), base_val);
+  if (frozen)
+  {
+    fprintf(stderr, "[Block::ERROR] frozen block cannot be changed, value %s is not set\n", name.c_str());
+    return;
+  }
+  make_mutable();
+  int id = get_id(name);
+  if (id >= 0)
+  {
+    values[id].copy(value);
+  }
   else
-    return base_val;
+    add_value(name, value);
 }
 
-std::string double_to_string(double val)
+//small blocks are faster to search linearly
+static constexpr int MIN_HASHED_MERGE_SIZE = 16;
+
+//name by id without copying it, names of lazy blocks not overridden in them are stored in their bases
+static const std::string &name_at(const Block &b, int id)
 {
-  //buffer size is the same as in gcc-12 implementation of to_string
-  char buffer[std::numeric_limits<double>::max_exponent10 + 20];
-  snprintf(buffer, sizeof(buffer), "%g", val);
-  return std::string(buffer);
+  const Block *cur = &b;
+  while (cur->lazy && id < (int)cur->lazy->base_ids.size())
+    cur = cur->lazy->base;
+  if (cur->lazy)
+    return cur->names[cur->lazy->own_ids[id - cur->lazy->base_ids.size()]];
+  return cur->names[id];
 }
 
-void save_value(std::string &str, Block::Value &v);
-void save_block(std::string &str, Block &b)
+void Block::add_detalization(Block &det)
 {
-  str += "{\n";
-  for (int i = 0; i < b.size(); i++)
+  //pairs of (block, its detalization), sub-blocks are merged without recursion. Pairs are processed
+  //in the order they are added, so details of one block are applied in the same order as by recursion
+  std::vector<std::pair<Block *, const Block *>> pairs = {{this, &det}};
+  for (size_t pair_id = 0; pair_id < pairs.size(); pair_id++)
   {
-    str += b.names[i];
-    save_value(str, b.values[i]);
-    str += "\n";
+    Block &b = *pairs[pair_id].first;
+    const Block &d = *pairs[pair_id].second;
+    if (b.frozen)
+    {
+      fprintf(stderr, "[Block::ERROR] frozen block cannot be changed\n");
+      continue;
+    }
+    b.make_mutable();
+    bool hashed = b.size() >= MIN_HASHED_MERGE_SIZE && d.size() >= MIN_HASHED_MERGE_SIZE;
+    std::unordered_map<std::string_view, int> ids;
+    if (hashed)
+    {
+      //names are not reallocated, so views stay valid
+      b.names.reserve(b.size() + d.size());
+      ids.reserve(b.size() + d.size());
+      for (int i = 0; i < b.size(); i++)
+        ids.emplace(b.names[i], i);
+    }
+    for (int i = 0; i < d.size(); i++)
+    {
+      const std::string &name = name_at(d, i);
+      int id = -1;
+      if (hashed)
+      {
+        auto it = ids.find(name);
+        id = it == ids.end() ? -1 : it->second;
+      }
+      else
+        id = b.get_id(name);
+      const Value &dv = d.value_at(i);
+      if (id < 0) //add this value to the block
+      {
+        b.names.push_back(name);
+        b.values.emplace_back();
+        b.values.back().copy(dv);
+        if (hashed)
+          ids.emplace(b.names.back(), b.size() - 1);
+      }
+      else if (b.values[id].type == dv.type)
+      {
+        if (dv.type == ValueType::BLOCK)
+        {
+          if (b.values[id].bl && dv.bl)
+            pairs.push_back({b.values[id].bl, dv.bl});
+        }
+        else
+          b.values[id].copy(dv);
+      }
+    }
   }
-  str += "}";
 }
-void save_arr(std::string &str, Block::DataArray &a)
+
+//result block with its layers, merged later
+struct MergeTask
 {
-  str += "{ ";
-  if (a.type == Block::ValueType::DOUBLE)
+  Block *result;
+  std::vector<const Block *> layers;
+};
+
+static void merge_block_layers(Block &result, const Block *const *layers, size_t count, std::vector<MergeTask> &tasks)
+{
+  result.clear();
+  size_t max_size = 0;
+  for (size_t l = 0; l < count; l++)
+    max_size += layers[l] ? layers[l]->size() : 0;
+  result.names.reserve(max_size);
+
+  //values are only copied when all layers are processed, so overridden values are not copied at all
+  struct Source
   {
-    for (int i = 0; i < a.values.size(); i++)
+    const Block::Value *value = nullptr;
+    std::vector<const Block *> blocks; //sub-blocks to merge
+  };
+  std::vector<Source> sources;
+  std::unordered_map<std::string_view, int> ids;
+  ids.reserve(max_size);
+  for (size_t l = 0; l < count; l++)
+  {
+    const Block *layer = layers[l];
+    if (!layer)
+      continue;
+    bool first_layer = l == 0;
+    for (int i = 0; i < layer->size(); i++)
     {
-      str += double_to_string(a.values[i].d);
-      if (i < a.values.size() - 1)
-        str += ", ";
+      const Block::Value &v = layer->value_at(i);
+      std::string name = layer->get_name(i);
+      auto it = first_layer ? ids.end() : ids.find(name);
+      if (it == ids.end())
+      {
+        result.names.push_back(std::move(name));
+        ids.emplace(result.names.back(), (int)sources.size());
+        sources.emplace_back();
+        sources.back().value = &v;
+        if (v.type == Block::ValueType::BLOCK)
+          sources.back().blocks.push_back(v.bl);
+      }
+      else
+      {
+        Source &src = sources[it->second];
+        if (src.value->type != v.type)
+          continue;
+        if (v.type != Block::ValueType::BLOCK)
+          src.value = &v;
+        else if (v.bl)
+          src.blocks.push_back(v.bl);
+      }
     }
   }
-  else if (a.type == Block::ValueType::STRING)
+
+  result.values.resize(sources.size());
+  for (int i = 0; i < sources.size(); i++)
   {
-    for (int i = 0; i < a.values.size(); i++)
+    Block::Value &v = result.values[i];
+    if (sources[i].value->type == Block::ValueType::BLOCK)
     {
-      if (a.values[i].s)
-        str += "\"" + save_string(*(a.values[i].s)) + "\"";
-      else
-        str += "\"\"";
-      if (i < a.values.size() - 1)
-        str += ", ";
+      v.type = Block::ValueType::BLOCK;
+      v.bl = new Block();
+      tasks.push_back({v.bl, std::move(sources[i].blocks)});
     }
+    else
+      v.copy(*(sources[i].value));
   }
-  str += " }";
 }
-void save_value(std::string &str, Block::Value &v)
+
+void merge_layers(Block &result, const Block *const *layers, size_t count)
 {
-  if (v.type == Block::ValueType::EMPTY)
+  //sub-blocks are merged without recursion
+  std::vector<MergeTask> tasks;
+  merge_block_layers(result, layers, count, tasks);
+  while (!tasks.empty())
   {
-    str += ":tag";
+    MergeTask task = std::move(tasks.back());
+    tasks.pop_back();
+    merge_block_layers(*task.result, task.layers.data(), task.layers.size(), tasks);
   }
-  else if (v.type == Block::ValueType::BOOL)
+}
+
+void Block::copy(const Block *b)
+{
+  if (b == this)
+    return;
+  if (frozen)
   {
-    str += ":b = ";
-    str += v.b ? "true" : "false";
+    fprintf(stderr, "[Block::ERROR] frozen block cannot be changed\n");
+    return;
   }
-  else if (v.type == Block::ValueType::INT)
+  flatten_lazy_dependents(*this);
+  name_index.reset();
+  sorted_ids.clear();
+  //pairs of (destination, source) blocks, nested blocks are copied without recursion
+  std::vector<std::pair<Block *, const Block *>> stack = {{this, b}};
+  while (!stack.empty())
   {
-    str += ":i = ";
-    str += std::to_string(v.i);
+    Block *dst = stack.back().first;
+    const Block *src = stack.back().second;
+    stack.pop_back();
+    if (dst->lazy)
+      dst->clear();
+    if (src->lazy)
+    {
+      dst->names.resize(src->size());
+      for (int i = 0; i < src->size(); i++)
+        dst->names[i] = src->get_name(i);
+    }
+    else
+      dst->names = src->names;
+    for (int i = src->size(); i < dst->values.size(); i++)
+      dst->values[i].clear();
+    dst->values.resize(src->size());
+    for (int i = 0; i < src->size(); i++)
+    {
+      const Value &sv = src->value_at(i);
+      Value &dv = dst->values[i];
+      if (sv.type == ValueType::BLOCK)
+      {
+        dv.clear();
+        dv.type = ValueType::BLOCK;
+        dv.bl = new Block();
+        if (sv.bl)
+          stack.push_back({dv.bl, sv.bl});
+      }
+      else
+        dv.copy(sv);
+    }
   }
-  else if (v.type == Block::ValueType::UINT64)
+}
+
+static bool blocks_equal(const Block &a, const Block &b);
+
+//exact equality, floating point values are compared by value
+static bool values_equal(const Block::Value &a, const Block::Value &b)
+{
+  if (a.type != b.type)
+    return false;
+  switch (a.type)
   {
-    str += ":u64 = ";
-    str += std::to_string(v.u);
-  }
-  else if (v.type == Block::ValueType::DOUBLE)
+  case Block::ValueType::EMPTY:
+    return true;
+  case Block::ValueType::BOOL:
+    return a.b == b.b;
+  case Block::ValueType::INT:
+    return a.i == b.i;
+  case Block::ValueType::UINT64:
+    return a.u == b.u;
+  case Block::ValueType::DOUBLE:
+    return a.d == b.d;
+  case Block::ValueType::VEC2:
+    return a.v2.x == b.v2.x && a.v2.y == b.v2.y;
+  case Block::ValueType::VEC3:
+    return a.v3.x == b.v3.x && a.v3.y == b.v3.y && a.v3.z == b.v3.z;
+  case Block::ValueType::VEC4:
+    return a.v4.x == b.v4.x && a.v4.y == b.v4.y && a.v4.z == b.v4.z && a.v4.w == b.v4.w;
+  case Block::ValueType::IVEC2:
+    return a.iv2.x == b.iv2.x && a.iv2.y == b.iv2.y;
+  case Block::ValueType::IVEC3:
+    return a.iv3.x == b.iv3.x && a.iv3.y == b.iv3.y && a.iv3.z == b.iv3.z;
+  case Block::ValueType::IVEC4:
+    return a.iv4.x == b.iv4.x && a.iv4.y == b.iv4.y && a.iv4.z == b.iv4.z && a.iv4.w == b.iv4.w;
+  case Block::ValueType::MAT4:
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+        if (a.m4(i, j) != b.m4(i, j))
+          return false;
+    return true;
+  case Block::ValueType::ENUM:
+    return a.ev.type_id == b.ev.type_id && a.ev.val_id == b.ev.val_id;
+  case Block::ValueType::STRING:
+    return (a.s ? *(a.s) : std::string()) == (b.s ? *(b.s) : std::string());
+  case Block::ValueType::BLOCK:
+    if (a.bl == b.bl)
+      return true;
+    if (!a.bl || !b.bl)
+      return (a.bl ? a.bl->size() : 0) == 0 && (b.bl ? b.bl->size() : 0) == 0;
+    return *(a.bl) == *(b.bl);
+  case Block::ValueType::ARRAY:
   {
-    str += ":r = ";
-    str += double_to_string(v.d);
+    //element type of empty arrays is ignored, so null array is equal to any empty one
+    size_t a_size = a.a ? a.a->values.size() : 0;
+    size_t b_size = b.a ? b.a->values.size() : 0;
+    if (a_size != b_size || (a_size > 0 && a.a->type != b.a->type))
+      return false;
+    for (size_t i = 0; i < a_size; i++)
+      if (!values_equal(a.a->values[i], b.a->values[i]))
+        return false;
+    return true;
   }
-  else if (v.type == Block::ValueType::VEC2)
+  default:
+    return false;
+  }
+}
+
+static bool blocks_equal(const Block &a, const Block &b)
+{
+  //pairs of blocks to compare, nested blocks are compared without recursion
+  std::vector<std::pair<const Block *, const Block *>> stack = {{&a, &b}};
+  while (!stack.empty())
   {
-    str += ":p2 = ";
-    str += double_to_string(v.v2.x) + ", " + double_to_string(v.v2.y);
+    const Block &x = *stack.back().first;
+    const Block &y = *stack.back().second;
+    stack.pop_back();
+    if (&x == &y)
+      continue;
+    if (x.size() != y.size() || (x.frozen && y.frozen && x.cached_hash != y.cached_hash))
+      return false;
+    for (int i = 0; i < x.size(); i++)
+    {
+      if (x.get_name(i) != y.get_name(i))
+        return false;
+      const Block::Value &xv = x.value_at(i);
+      const Block::Value &yv = y.value_at(i);
+      if (xv.type == Block::ValueType::BLOCK && yv.type == Block::ValueType::BLOCK && xv.bl && yv.bl)
+        stack.push_back({xv.bl, yv.bl});
+      else if (!values_equal(xv, yv))
+        return false;
+    }
   }
-  else if (v.type == Block::ValueType::VEC3)
+  return true;
+}
+
+static void append_path(std::string &path, const std::string &name, int occurrence)
+{
+  if (!path.empty())
+    path += '.';
+  //separators in names are escaped, so any name can be a part of a path
+  for (char c : name)
   {
-    str += ":p3 = ";
-    str += double_to_string(v.v3.x) + ", " + double_to_string(v.v3.y) + ", " + double_to_string(v.v3.z);
+    if (c == '.' || c == '[' || c == '\\')
+      path += '\\';
+    path += c;
   }
-  else if (v.type == Block::ValueType::VEC4)
+  if (occurrence > 0)
+    path += "[" + std::to_string(occurrence) + "]";
+}
+
+static void add_patch_op(Block &patch, const char *op_name, const std::string &path, int index, const Block::Value *value)
+{
+  Block *op = new Block();
+  op->add_string("path", path);
+  if (index >= 0)
+    op->add_int("index", index);
+  if (value)
   {
-    str += ":p4 = ";
-    str += double_to_string(v.v4.x) + ", " + double_to_string(v.v4.y) + ", " + double_to_string(v.v4.z) +
-           ", " + double_to_string(v.v4.w);
+    op->names.push_back("value");
+    op->values.emplace_back();
+    op->values.back().copy(*value);
   }
-  else if (v.type == Block::ValueType::IVEC2)
+  patch.names.push_back(op_name);
+  patch.values.emplace_back();
+  patch.values.back().type = Block::ValueType::BLOCK;
+  patch.values.back().bl = op;
+}
+
+struct BlockDiff
+{
+  const Block *from;
+  const Block *to;
+  std::string name; //name and occurrence of the block in its parent
+  int occurrence = 0;
+  std::vector<int> to_from_ids; //matching value in from for every value in to, -1 for new values
+  std::vector<int> to_occurrence;
+  int next = 0; //next value in to to compare
+};
+
+//path of the last block on the stack. Blocks on the stack do not keep their paths, as in a deep tree
+//that would be quadratic, the path is only made for ops
+static std::string diff_path(const std::vector<BlockDiff> &stack)
+{
+  std::string path;
+  for (size_t i = 1; i < stack.size(); i++)
+    append_path(path, stack[i].name, stack[i].occurrence);
+  return path;
+}
+
+//matches values of the last block on the stack and adds remove ops, returns false if the whole block is replaced
+static bool begin_block_diff(std::vector<BlockDiff> &stack, Block &patch)
+{
+  BlockDiff &diff = stack.back();
+  const Block &from = *diff.from;
+  const Block &to = *diff.to;
+  //values are matched by name and occurrence number of this name
+  std::unordered_map<std::string, std::vector<int>> from_ids;
+  std::vector<int> from_occurrence(from.size());
+  for (int i = 0; i < from.size(); i++)
   {
-    str += ":i2 = ";
-    str += std::to_string(v.iv2.x) + ", " + std::to_string(v.iv2.y);
+    std::vector<int> &ids = from_ids[from.get_name(i)];
+    from_occurrence[i] = ids.size();
+    ids.push_back(i);
   }
-  else if (v.type == Block::ValueType::IVEC3)
+  std::unordered_map<std::string, int> to_counts;
+  std::vector<int> to_from_ids(to.size());
+  std::vector<int> to_occurrence(to.size());
+  bool same_order = true;
+  int prev_from_id = -1;
+  for (int i = 0; i < to.size(); i++)
   {
-    str += ":i3 = ";
-    str += std::to_string(v.iv3.x) + ", " + std::to_string(v.iv3.y) + ", " + std::to_string(v.iv3.z);
+    std::string name = to.get_name(i);
+    int occurrence = to_counts[name]++;
+    auto it = from_ids.find(name);
+    int from_id = (it != from_ids.end() && occurrence < it->second.size()) ? it->second[occurrence] : -1;
+    to_from_ids[i] = from_id;
+    to_occurrence[i] = occurrence;
+    if (from_id >= 0)
+    {
+      same_order = same_order && from_id > prev_from_id;
+      prev_from_id = from_id;
+    }
   }
-  else if (v.type == Block::ValueType::IVEC4)
+  if (!same_order)
   {
-    str += ":i4 = ";
-    str += std::to_string(v.iv4.x) + ", " + std::to_string(v.iv4.y) + ", " + std::to_string(v.iv4.z) +
-           ", " + std::to_string(v.iv4.w);
+    //values were reordered, it is easier to replace the whole block
+    Block::Value v;
+    v.type = Block::ValueType::BLOCK;
+    v.bl = const_cast<Block *>(&to);
+    add_patch_op(patch, "set", diff_path(stack), -1, &v);
+    return false;
   }
-  else if (v.type == Block::ValueType::MAT4)
+
+  for (int i = from.size() - 1; i >= 0; i--)
   {
-    str += ":m4 = ";
-    for (int i = 0; i < 4; i++)
+    std::string name = from.get_name(i);
+    auto it = to_counts.find(name);
+    if (it == to_counts.end() || from_occurrence[i] >= it->second)
     {
-      for (int j = 0; j < 4; j++)
-      {
-        str += double_to_string(v.m4(i, j));
-        if (i < 3 || j < 3)
-          str += ", ";
-        if (j == 3)
-          str += "  ";
-      }
+      std::string value_path = diff_path(stack);
+      append_path(value_path, name, from_occurrence[i]);
+      add_patch_op(patch, "remove", value_path, -1, nullptr);
     }
   }
-  else if (v.type == Block::ValueType::ENUM)
+  diff.to_from_ids = std::move(to_from_ids);
+  diff.to_occurrence = std::move(to_occurrence);
+  return true;
+}
+
+static void add_new_values(const std::vector<BlockDiff> &stack, Block &patch)
+{
+  const BlockDiff &diff = stack.back();
+  const Block &to = *diff.to;
+  for (int i = 0; i < to.size(); i++)
   {
-    str += ":e_" + std::string(get_enum_info()[v.ev.type_id].name) + " = ";
-    str += get_enum_info()[v.ev.type_id].names[v.ev.val_id];
+    if (diff.to_from_ids[i] >= 0)
+      continue;
+    std::string value_path = diff_path(stack);
+    append_path(value_path, to.get_name(i), 0);
+    add_patch_op(patch, "add", value_path, i, &to.value_at(i));
   }
-  else if (v.type == Block::ValueType::STRING && v.s)
+}
+
+Block diff_blocks(const Block &from, const Block &to)
+{
+  Block patch;
+  //changed sub-blocks are compared without recursion, but ops are added in the same order as by
+  //depth-first walk: removes of a block, changes of its values and sub-blocks, then new values
+  std::vector<BlockDiff> stack(1);
+  stack[0].from = &from;
+  stack[0].to = &to;
+  if (!begin_block_diff(stack, patch))
+    return patch;
+  while (!stack.empty())
   {
-    str += ":s = \"" + save_string(*(v.s)) + "\"";
+    BlockDiff &diff = stack.back();
+    const Block &to_block = *diff.to;
+    if (diff.next == to_block.size())
+    {
+      add_new_values(stack, patch);
+      stack.pop_back();
+      continue;
+    }
+    int i = diff.next++;
+    if (diff.to_from_ids[i] < 0)
+      continue;
+    const Block::Value &from_v = diff.from->value_at(diff.to_from_ids[i]);
+    const Block::Value &to_v = to_block.value_at(i);
+    int occurrence = diff.to_occurrence[i];
+    if (from_v.type == Block::ValueType::BLOCK && to_v.type == Block::ValueType::BLOCK && from_v.bl && to_v.bl)
+    {
+      //equal sub-blocks give no ops, they are compared before walking only if their hashes are known,
+      //otherwise every level of a deep tree would compare the whole rest of it
+      bool frozen = from_v.bl->is_frozen() && to_v.bl->is_frozen();
+      if (from_v.bl == to_v.bl || (frozen && *(from_v.bl) == *(to_v.bl)))
+        continue;
+      BlockDiff sub_diff;
+      sub_diff.from = from_v.bl;
+      sub_diff.to = to_v.bl;
+      sub_diff.name = to_block.get_name(i);
+      sub_diff.occurrence = occurrence;
+      stack.push_back(std::move(sub_diff));
+      if (!begin_block_diff(stack, patch))
+        stack.pop_back();
+    }
+    else if (!values_equal(from_v, to_v))
+    {
+      std::string value_path = diff_path(stack);
+      append_path(value_path, to_block.get_name(i), occurrence);
+      add_patch_op(patch, "set", value_path, -1, &to_v);
+    }
   }
-  else if (v.type == Block::ValueType::ARRAY && v.a)
+  return patch;
+}
+
+//reads segment name[k] of path starting at pos into name and k, characters escaped with '\' are parts
+//of the name. pos is moved past the segment and the dot after it, last is set if there is no dot
+static bool parse_path_segment(const std::string &path, size_t &pos, std::string &name, int &occurrence, bool &last)
+{
+  name.clear();
+  occurrence = 0;
+  while (pos < path.size() && path[pos] != '.' && path[pos] != '[')
   {
-    str += ":arr = ";
-    save_arr(str, *(v.a));
+    if (path[pos] == '\\' && ++pos == path.size())
+      return false;
+    name += path[pos++];
   }
-  else if (v.type == Block::ValueType::BLOCK && v.bl)
+  if (pos < path.size() && path[pos] == '[')
   {
-    str += " ";
-    save_block(str, *(v.bl));
+    char *end = nullptr;
+    long k = strtol(path.c_str() + pos + 1, &end, 10);
+    if (k < 0 || !end || *end != ']')
+      return false;
+    occurrence = k;
+    pos = end - path.c_str() + 1;
   }
+  last = pos == path.size();
+  if (!last && path[pos++] != '.')
+    return false;
+  return !name.empty();
 }
 
-void save_block_to_string(std::string &str, Block &b)
+static int find_occurrence(const Block &b, const std::string &name, int occurrence)
 {
-  save_block(str, b);
+  int id = b.get_id(name);
+  for (int i = 0; i < occurrence && id >= 0; i++)
+    id = b.get_next_id(name, id + 1);
+  return id;
 }
 
-void save_block_to_file(std::string path, Block &b)
+//block changed by a patch. Operations change a linked list of its entries, and the block is rebuilt
+//once when all operations are checked, so k operations on a block of n values do not shift it k times
+//and a failed patch leaves it as is
+struct PatchedBlock
 {
-  std::string input;
+  struct Entry
+  {
+    int orig_id = -1;      //id of the value in the block, -1 for added values
+    bool replaced = false; //orig_id value is replaced with value
+    std::string name;      //only for added values
+    Block::Value value;    //own value of added or replaced entry
+    int64_t key = 0;       //entries go in increasing order of keys
+    int prev = -1;
+    int next = -1;
+  };
+  static constexpr int64_t KEY_STEP = 1 << 20;
 
-  save_block(input, b);
+  Block *block;
+  std::deque<Entry> entries; //addresses are stable, ids below keep views of names
+  std::unordered_map<std::string_view, std::vector<int>> ids; //entries with this name in order
+  int head = -1;
+  int tail = -1;
+  int count = 0;
+  //last added entry and its position, values added in increasing order of positions are found without
+  //walking the list from the start
+  int cursor = -1;
+  int cursor_pos = 0;
 
-  std::ofstream out(path);
-  out << input;
-  out.close();
-}
+  PatchedBlock(Block *b) : block(b)
+  {
+    for (int i = 0; i < b->size(); i++)
+    {
+      Entry &e = entries.emplace_back();
+      e.orig_id = i;
+      e.key = (i + 1) * KEY_STEP;
+      link(i, tail, -1);
+      ids[name_at(*b, i)].push_back(i);
+    }
+  }
+  PatchedBlock(const PatchedBlock &) = delete;
+  ~PatchedBlock()
+  {
+    for (Entry &e : entries)
+      e.value.clear();
+  }
 
-void Block::Value::clear()
-{
-  if (type == Block::ValueType::BLOCK && bl)
+  const std::string &name(int id) const { return entries[id].orig_id >= 0 ? name_at(*block, entries[id].orig_id) : entries[id].name; }
+  const Block::Value &value(int id) const
   {
-    bl->clear();
-    delete bl;
-    bl = nullptr;
+    const Entry &e = entries[id];
+    return e.orig_id >= 0 && !e.replaced ? block->value_at(e.orig_id) : e.value;
   }
-  else if (type == Block::ValueType::ARRAY && a)
+
+  int find(const std::string &name, int occurrence) const
   {
-    delete a;
-    a = nullptr;
+    auto it = ids.find(name);
+    return it != ids.end() && occurrence < it->second.size() ? it->second[occurrence] : -1;
   }
-  else if (type == Block::ValueType::STRING && s)
+
+  void link(int id, int prev, int next)
   {
-    delete s;
-    s = nullptr;
+    entries[id].prev = prev;
+    entries[id].next = next;
+    (prev >= 0 ? entries[prev].next : head) = id;
+    (next >= 0 ? entries[next].prev : tail) = id;
+    count++;
   }
 
-  type = Block::ValueType::EMPTY;
-}
-void Block::clear()
-{
-  for (int i = 0; i < size(); i++)
+  //own values are not deleted right away, sub-blocks in them can be patched blocks too
+  void drop_value(int id, std::vector<Block::Value> &garbage)
   {
-    values[i].clear();
+    Entry &e = entries[id];
+    if (e.orig_id < 0 || e.replaced)
+      garbage.push_back(e.value);
+    e.value.type = Block::ValueType::EMPTY;
   }
-  values.clear();
-  names.clear();
-}
-bool Block::has_tag(const std::string &name) const
-{
-  int id = get_id(name);
-  return id >= 0 && (get_type(id) == Block::ValueType::EMPTY);
-}
 
-void Block::add_bool(const std::string name, bool base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::BOOL;
-  val.b = base_val;
-  add_value(name, val);
-}
-void Block::add_int(const std::string name, int base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::INT;
-  val.i = base_val;
-  add_value(name, val);
-}
-void Block::add_uint64(const std::string name, uint64_t base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::UINT64;
-  val.u = base_val;
-  add_value(name, val);
-}
-void Block::add_double(const std::string name, double base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::DOUBLE;
-  val.d = base_val;
-  add_value(name, val);
-}
-void Block::add_vec2(const std::string name, float2 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::VEC2;
-  val.v2 = base_val;
-  add_value(name, val);
-}
-void Block::add_vec3(const std::string name, float3 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::VEC3;
-  val.v3 = base_val;
-  add_value(name, val);
-}
-void Block::add_vec4(const std::string name, float4 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::VEC4;
-  val.v4 = base_val;
-  add_value(name, val);
-}
-void Block::add_ivec2(const std::string name, int2 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::IVEC2;
-  val.iv2 = base_val;
-  add_value(name, val);
-}
-void Block::add_ivec3(const std::string name, int3 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::IVEC3;
-  val.iv3 = base_val;
-  add_value(name, val);
-}
-void Block::add_ivec4(const std::string name, int4 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::IVEC4;
-  val.iv4 = base_val;
-  add_value(name, val);
-}
-void Block::add_mat4(const std::string name, float4x4 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::MAT4;
-  val.m4 = base_val;
-  add_value(name, val);
-}
-void Block::add_enum(const std::string name, const std::string &type_name, unsigned base_val)
+  void remove(int id, std::vector<Block::Value> &garbage)
+  {
+    Entry &e = entries[id];
+    std::vector<int> &same = ids[name(id)];
+    same.erase(std::find(same.begin(), same.end(), id));
+    (e.prev >= 0 ? entries[e.prev].next : head) = e.next;
+    (e.next >= 0 ? entries[e.next].prev : tail) = e.prev;
+    count--;
+    cursor = -1;
+    drop_value(id, garbage);
+  }
+
+  void set(int id, const Block::Value &v, std::vector<Block::Value> &garbage)
+  {
+    drop_value(id, garbage);
+    entries[id].replaced = entries[id].orig_id >= 0;
+    entries[id].value.copy(v);
+  }
+
+  void insert(int index, const std::string &value_name, const Block::Value &v)
+  {
+    int next = head;
+    int pos = 0;
+    if (cursor >= 0 && cursor_pos <= index)
+    {
+      next = cursor;
+      pos = cursor_pos;
+    }
+    for (; pos < index; pos++)
+      next = entries[next].next;
+    int prev = next >= 0 ? entries[next].prev : tail;
+    if (!key_between(prev, next))
+    {
+      int64_t key = 0;
+      for (int id = head; id >= 0; id = entries[id].next)
+        entries[id].key = (key += KEY_STEP);
+    }
+    int id = entries.size();
+    Entry &e = entries.emplace_back();
+    e.key = key_between(prev, next);
+    e.name = value_name;
+    e.value.copy(v);
+    link(id, prev, next);
+    std::vector<int> &same = ids[e.name];
+    auto it = std::lower_bound(same.begin(), same.end(), e.key, [&](int other, int64_t key) { return entries[other].key < key; });
+    same.insert(it, id);
+    cursor = id;
+    cursor_pos = index;
+  }
+
+  //key for entry between prev and next, 0 if there is no free key
+  int64_t key_between(int prev, int next) const
+  {
+    int64_t from = prev >= 0 ? entries[prev].key : 0;
+    int64_t to = next >= 0 ? entries[next].key : from + 2 * KEY_STEP;
+    return to - from >= 2 ? from + (to - from) / 2 : 0;
+  }
+
+  //block should be mutable, its values are moved shallowly and values that are not used go to garbage
+  void rebuild(std::vector<Block::Value> &garbage)
+  {
+    std::vector<std::string> names;
+    std::vector<Block::Value> values;
+    std::vector<bool> kept(block->values.size(), false);
+    names.reserve(count);
+    values.reserve(count);
+    for (int id = head; id >= 0; id = entries[id].next)
+    {
+      Entry &e = entries[id];
+      names.push_back(e.orig_id >= 0 ? std::move(block->names[e.orig_id]) : std::move(e.name));
+      if (e.orig_id >= 0 && !e.replaced)
+      {
+        values.push_back(block->values[e.orig_id]);
+        kept[e.orig_id] = true;
+      }
+      else
+      {
+        values.push_back(e.value);
+        e.value.type = Block::ValueType::EMPTY;
+      }
+    }
+    for (size_t i = 0; i < kept.size(); i++)
+      if (!kept[i])
+        garbage.push_back(block->values[i]);
+    block->names = std::move(names);
+    block->values = std::move(values);
+  }
+};
+
+bool apply_patch(Block &b, const Block &patch)
 {
-  auto info_it = get_enum_info_by_name().find(type_name);
-  if (info_it == get_enum_info_by_name().end())
+  std::unordered_map<Block *, std::unique_ptr<PatchedBlock>> patched;
+  std::vector<PatchedBlock *> patched_order;
+  std::vector<Block::Value> garbage;
+  std::unique_ptr<Block> new_root; //root replaced with set, nothing is changed before the whole patch is checked
+  Block *root = &b;
+
+  //value of block by name and occurrence, with changes made by previous operations
+  auto find_value = [&](Block *parent, const std::string &name, int occurrence) -> const Block::Value * {
+    auto it = patched.find(parent);
+    if (it != patched.end())
+    {
+      int id = it->second->find(name, occurrence);
+      return id >= 0 ? &it->second->value(id) : nullptr;
+    }
+    int id = find_occurrence(*parent, name, occurrence);
+    return id >= 0 ? &parent->value_at(id) : nullptr;
+  };
+
+  bool ok = true;
+  for (int op_id = 0; op_id < patch.size() && ok; op_id++)
   {
-    fprintf(stderr, "[add_enum::ERROR] enum %s is not registered\n", type_name.c_str());
-    return;
+    ok = false;
+    std::string op_name = patch.get_name(op_id);
+    const Block *op = patch.value_at(op_id).type == Block::ValueType::BLOCK ? patch.value_at(op_id).bl : nullptr;
+    if (!op || (op_name != "set" && op_name != "remove" && op_name != "add"))
+    {
+      fprintf(stderr, "[apply_patch::ERROR] unknown operation %s\n", op_name.c_str());
+      break;
+    }
+    std::string path = op->get_string("path");
+    int value_id = op->get_id("value");
+    if (op_name != "remove" && value_id < 0)
+    {
+      fprintf(stderr, "[apply_patch::ERROR] no value in %s operation for %s\n", op_name.c_str(), path.c_str());
+      break;
+    }
+    if (path.empty() && op_name == "set")
+    {
+      const Block::Value &v = op->value_at(value_id);
+      if (v.type != Block::ValueType::BLOCK)
+      {
+        fprintf(stderr, "[apply_patch::ERROR] root can only be replaced with a block\n");
+        break;
+      }
+      if (b.is_frozen())
+      {
+        fprintf(stderr, "[apply_patch::ERROR] frozen block cannot be changed\n");
+        break;
+      }
+      //changes made before are dropped with the old root
+      patched.clear();
+      patched_order.clear();
+      new_root.reset(new Block());
+      if (v.bl)
+        new_root->copy(v.bl);
+      root = new_root.get();
+      ok = true;
+      continue;
+    }
+
+    //find the block where the operation is applied
+    Block *parent = root;
+    std::string name;
+    int occurrence = 0;
+    size_t pos = 0;
+    bool last = false;
+    bool found = true;
+    while (found)
+    {
+      found = parse_path_segment(path, pos, name, occurrence, last);
+      if (!found || last)
+        break;
+      const Block::Value *v = find_value(parent, name, occurrence);
+      parent = v && v->type == Block::ValueType::BLOCK ? v->bl : nullptr;
+      found = parent != nullptr;
+    }
+    if (found && parent->is_frozen())
+    {
+      fprintf(stderr, "[apply_patch::ERROR] frozen block %s cannot be changed\n", path.c_str());
+      break;
+    }
+    PatchedBlock *patched_block = nullptr;
+    if (found)
+    {
+      std::unique_ptr<PatchedBlock> &p = patched[parent];
+      if (!p)
+      {
+        p.reset(new PatchedBlock(parent));
+        patched_order.push_back(p.get());
+      }
+      patched_block = p.get();
+    }
+    int id = found && op_name != "add" ? patched_block->find(name, occurrence) : -1;
+    if (!found || (op_name != "add" && id < 0))
+    {
+      fprintf(stderr, "[apply_patch::ERROR] path %s not found\n", path.c_str());
+      break;
+    }
+
+    if (op_name == "remove")
+      patched_block->remove(id, garbage);
+    else if (op_name == "set")
+      patched_block->set(id, op->value_at(value_id), garbage);
+    else
+    {
+      int index = std::clamp(op->get_int("index", patched_block->count), 0, patched_block->count);
+      patched_block->insert(index, name, op->value_at(value_id));
+    }
+    ok = true;
   }
-  auto val_it = get_enum_info()[info_it->second].id_by_val.find(base_val);
-  if (val_it == get_enum_info()[info_it->second].id_by_val.end())
+
+  if (ok)
   {
-    fprintf(stderr, "[add_enum::ERROR] enum %s has no value %u\n", type_name.c_str(), base_val);
-    return;
+    //lazy blocks are flattened before any of them is rebuilt, it does not change ids of their values
+    for (PatchedBlock *pb : patched_order)
+      pb->block->make_mutable();
+    for (PatchedBlock *pb : patched_order)
+      pb->rebuild(garbage);
+    if (new_root)
+      b = std::move(*new_root);
   }
-  Block::Value val;
-  val.type = Block::ValueType::ENUM;
-  val.ev.type_id = info_it->second;
-  val.ev.val_id = val_it->second;
-  add_value(name, val);
+  patched.clear();
+  for (Block::Value &v : garbage)
+    v.clear();
+  return ok;
 }
-void Block::add_string(const std::string name, std::string base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::STRING;
-  val.s = new std::string(base_val);
-  add_value(name, val);
-}
-void Block::add_block(const std::string name, Block *bl)
-{
-  Block::Value val;
-  val.type = Block::ValueType::BLOCK;
 
-  val.bl = new Block();
-  if (bl != nullptr)
-    val.bl->copy(bl);
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<double> &_values)
+//streaming 128-bit hash of canonical value encoding, all numbers are little-endian
+class BlkHasher
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (double &d : _values)
+public:
+  void put_bytes(const void *data, size_t size)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    const unsigned char *p = (const unsigned char *)data;
+    total += size;
+    for (size_t i = 0; i < size; i++)
+    {
+      word |= (uint64_t)p[i] << (8 * word_bytes);
+      if (++word_bytes == 8)
+        mix_word();
+    }
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<float> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (float &d : _values)
+  void put_u8(unsigned char v)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    put_bytes(&v, 1);
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<int> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (int &d : _values)
+  void put_u64(uint64_t v)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+      bytes[i] = (v >> (8 * i)) & 0xFF;
+    put_bytes(bytes, 8);
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<unsigned> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (unsigned &d : _values)
+  void put_f32(float v)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    if (v == 0)
+      v = 0; //-0 is equal to 0, so it should have the same hash
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    put_u64(bits);
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<short> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (short &d : _values)
+  void put_f64(double v)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    if (v == 0)
+      v = 0;
+    uint64_t bits;
+    memcpy(&bits, &v, 8);
+    put_u64(bits);
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<unsigned short> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (unsigned short &d : _values)
+  void put_string(const std::string &s)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    put_u64(s.size());
+    put_bytes(s.data(), s.size());
   }
-  add_value(name, val);
-}
-void Block::add_arr(const std::string name, std::vector<std::string> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::STRING;
-  for (std::string &str : _values)
+  void put_hash(const BlkHash &h)
   {
-    Block::Value av;
-    av.type = Block::ValueType::STRING;
-    av.s = new std::string(str);
-    val.a->values.push_back(av);
+    put_u64(h.lo);
+    put_u64(h.hi);
+  }
+  BlkHash finish()
+  {
+    while (word_bytes != 0)
+      put_bytes("", 1);
+    BlkHash h;
+    h.lo = fmix(lo ^ total);
+    h.hi = fmix(hi ^ h.lo);
+    h.lo ^= h.hi >> 1;
+    return h;
   }
-  add_value(name, val);
-}
 
-void Block::set_bool(const std::string name, bool base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::BOOL;
-  val.b = base_val;
-  set_value(name, val);
-}
-void Block::set_int(const std::string name, int base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::INT;
-  val.i = base_val;
-  set_value(name, val);
-}
-void Block::set_uint64(const std::string name, uint64_t base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::UINT64;
-  val.u = base_val;
-  set_value(name, val);
-}
-void Block::set_double(const std::string name, double base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::DOUBLE;
-  val.d = base_val;
-  set_value(name, val);
-}
-void Block::set_vec2(const std::string name, float2 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::VEC2;
-  val.v2 = base_val;
-  set_value(name, val);
-}
-void Block::set_vec3(const std::string name, float3 base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::VEC3;
-  val.v3 = base_val;
-  set_value(name, val);
-}
-void Block::set_vec4(const std::string name, float4 base_val)
+private:
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+  static uint64_t fmix(uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+  }
+  void mix_word()
+  {
+    lo = rotl(lo ^ (word * 0x87C37B91114253D5ull), 31) * 0x4CF5AD432745937Full;
+    hi = rotl(hi ^ (word * 0x9E3779B97F4A7C15ull), 33) * 0xC2B2AE3D27D4EB4Full + lo;
+    word = 0;
+    word_bytes = 0;
+  }
+
+  uint64_t lo = 0x6A09E667F3BCC908ull;
+  uint64_t hi = 0xBB67AE8584CAA73Bull;
+  uint64_t word = 0;
+  int word_bytes = 0;
+  uint64_t total = 0;
+};
+
+//hashes of not frozen sub-blocks are taken in order from sub_hashes
+static void hash_value(BlkHasher &hasher, const Block::Value &v, const BlkHash *&sub_hashes)
 {
-  Block::Value val;
-  val.type = Block::ValueType::VEC4;
-  val.v4 = base_val;
-  set_value(name, val);
+  hasher.put_u8(v.type);
+  switch (v.type)
+  {
+  case Block::ValueType::EMPTY:
+    break;
+  case Block::ValueType::BOOL:
+    hasher.put_u64(v.b ? 1 : 0);
+    break;
+  case Block::ValueType::INT:
+    hasher.put_u64((uint64_t)(int64_t)v.i);
+    break;
+  case Block::ValueType::UINT64:
+    hasher.put_u64(v.u);
+    break;
+  case Block::ValueType::DOUBLE:
+    hasher.put_f64(v.d);
+    break;
+  case Block::ValueType::VEC2:
+    hasher.put_f32(v.v2.x);
+    hasher.put_f32(v.v2.y);
+    break;
+  case Block::ValueType::VEC3:
+    hasher.put_f32(v.v3.x);
+    hasher.put_f32(v.v3.y);
+    hasher.put_f32(v.v3.z);
+    break;
+  case Block::ValueType::VEC4:
+    hasher.put_f32(v.v4.x);
+    hasher.put_f32(v.v4.y);
+    hasher.put_f32(v.v4.z);
+    hasher.put_f32(v.v4.w);
+    break;
+  case Block::ValueType::IVEC2:
+    hasher.put_u64((uint64_t)(int64_t)v.iv2.x);
+    hasher.put_u64((uint64_t)(int64_t)v.iv2.y);
+    break;
+  case Block::ValueType::IVEC3:
+    hasher.put_u64((uint64_t)(int64_t)v.iv3.x);
+    hasher.put_u64((uint64_t)(int64_t)v.iv3.y);
+    hasher.put_u64((uint64_t)(int64_t)v.iv3.z);
+    break;
+  case Block::ValueType::IVEC4:
+    hasher.put_u64((uint64_t)(int64_t)v.iv4.x);
+    hasher.put_u64((uint64_t)(int64_t)v.iv4.y);
+    hasher.put_u64((uint64_t)(int64_t)v.iv4.z);
+    hasher.put_u64((uint64_t)(int64_t)v.iv4.w);
+    break;
+  case Block::ValueType::MAT4:
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+        hasher.put_f32(v.m4(i, j));
+    break;
+  case Block::ValueType::ENUM:
+    //ids depend on registration order, names do not
+    hasher.put_string(enum_info(v.ev.type_id).name);
+    hasher.put_string(enum_info(v.ev.type_id).value_name(v.ev.val_id));
+    break;
+  case Block::ValueType::STRING:
+    hasher.put_string(v.s ? *(v.s) : std::string());
+    break;
+  case Block::ValueType::BLOCK:
+    if (v.bl)
+      hasher.put_hash(v.bl->frozen ? v.bl->cached_hash : *(sub_hashes++));
+    else
+    {
+      BlkHasher empty_block;
+      empty_block.put_u64(0);
+      hasher.put_hash(empty_block.finish());
+    }
+    break;
+  case Block::ValueType::ARRAY:
+  {
+    //empty arrays are equal whatever their element type is, so they are hashed the same way
+    size_t count = v.a ? v.a->values.size() : 0;
+    Block::ValueType type = count > 0 ? v.a->type : Block::ValueType::DOUBLE;
+    hasher.put_u8(type);
+    hasher.put_u64(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      if (type == Block::ValueType::STRING)
+        hasher.put_string(v.a->values[i].s ? *(v.a->values[i].s) : std::string());
+      else
+        hasher.put_f64(v.a->values[i].d);
+    }
+  }
+  break;
+  default:
+    break;
+  }
 }
-void Block::set_ivec2(const std::string name, int2 base_val)
+
+static BlkHash hash_block(const Block &b, const BlkHash *sub_hashes)
 {
-  Block::Value val;
-  val.type = Block::ValueType::IVEC2;
-  val.iv2 = base_val;
-  set_value(name, val);
+  BlkHasher hasher;
+  hasher.put_u64(b.size());
+  for (int i = 0; i < b.size(); i++)
+  {
+    hasher.put_string(b.get_name(i));
+    hash_value(hasher, b.value_at(i), sub_hashes);
+  }
+  return hasher.finish();
 }
-void Block::set_ivec3(const std::string name, int3 base_val)
+
+BlkHash Block::Value::get_hash() const
 {
-  Block::Value val;
-  val.type = Block::ValueType::IVEC3;
-  val.iv3 = base_val;
-  set_value(name, val);
+  BlkHash block_hash;
+  if (type == ValueType::BLOCK && bl && !bl->frozen)
+    block_hash = bl->get_hash();
+  const BlkHash *sub_hashes = &block_hash;
+  BlkHasher hasher;
+  hash_value(hasher, *this, sub_hashes);
+  return hasher.finish();
 }
-void Block::set_ivec4(const std::string name, int4 base_val)
+
+BlkHash Block::get_hash() const
 {
-  Block::Value val;
-  val.type = Block::ValueType::IVEC4;
-  val.iv4 = base_val;
-  set_value(name, val);
+  //frozen blocks do not change, so their hashes are computed once. Other blocks can be changed through
+  //any of their sub-blocks without knowing about it, and their hashes are computed on every call
+  if (frozen)
+    return cached_hash;
+  //sub-blocks are hashed before their parents without recursion. Blocks are listed parents first,
+  //sub-blocks of one block go in a row starting from first_sub
+  std::vector<const Block *> blocks = {this};
+  std::vector<size_t> first_sub;
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    first_sub.push_back(blocks.size());
+    const Block &b = *blocks[i];
+    for (int j = 0; j < b.size(); j++)
+    {
+      const Value &v = b.value_at(j);
+      if (v.type == ValueType::BLOCK && v.bl && !v.bl->frozen)
+        blocks.push_back(v.bl);
+    }
+  }
+  std::vector<BlkHash> hashes(blocks.size());
+  for (size_t i = blocks.size(); i-- > 0;)
+    hashes[i] = hash_block(*blocks[i], hashes.data() + first_sub[i]);
+  return hashes[0];
 }
-void Block::set_mat4(const std::string name, float4x4 base_val)
+
+bool Block::operator==(const Block &b) const
 {
-  Block::Value val;
-  val.type = Block::ValueType::MAT4;
-  val.m4 = base_val;
-  set_value(name, val);
+  if (this == &b)
+    return true;
+  if (size() != b.size())
+    return false;
+  //hashes of frozen blocks are known, other blocks are compared right away. Hashes can collide,
+  //so equal hashes are checked
+  if (frozen && b.frozen && cached_hash != b.cached_hash)
+    return false;
+  return blocks_equal(*this, b);
 }
-void Block::set_enum(const std::string name, const std::string &type_name, unsigned base_val)
+
+//smaller blocks are searched linearly
+static constexpr int MIN_INDEXED_BLOCK_SIZE = 8;
+
+static void freeze_block(Block &root)
 {
-  auto info_it = get_enum_info_by_name().find(type_name);
-  if (info_it == get_enum_info_by_name().end())
+  //blocks go after their parents and are frozen in reverse order, so hashes of sub-blocks are ready
+  std::vector<Block *> blocks = {&root};
+  for (size_t i = 0; i < blocks.size(); i++)
   {
-    fprintf(stderr, "[add_enum::ERROR] enum %s is not registered\n", type_name.c_str());
-    return;
+    Block &b = *blocks[i];
+    for (Block::Value &v : b.values)
+    {
+      if (v.type == Block::ValueType::BLOCK && v.bl)
+        blocks.push_back(v.bl);
+      else if (v.type == Block::ValueType::ARRAY && v.a)
+        v.a->values.shrink_to_fit();
+    }
+    b.names.shrink_to_fit();
+    b.values.shrink_to_fit(); //values are copied shallowly
+    if (b.size() >= MIN_INDEXED_BLOCK_SIZE)
+    {
+      b.name_index.reset(new std::unordered_map<std::string_view, int>());
+      b.name_index->reserve(b.size());
+      for (int j = 0; j < b.size(); j++)
+        b.name_index->emplace(b.names[j], j);
+    }
   }
-  auto val_it = get_enum_info()[info_it->second].id_by_val.find(base_val);
-  if (val_it == get_enum_info()[info_it->second].id_by_val.end())
+  for (size_t i = blocks.size(); i-- > 0;)
   {
-    fprintf(stderr, "[add_enum::ERROR] enum %s has no value %u\n", type_name.c_str(), base_val);
-    return;
+    blocks[i]->cached_hash = blocks[i]->get_hash();
+    blocks[i]->frozen = true;
   }
-  Block::Value val;
-  val.type = Block::ValueType::ENUM;
-  val.ev.type_id = info_it->second;
-  val.ev.val_id = val_it->second;
-  set_value(name, val);
-}
-void Block::set_string(const std::string name, std::string base_val)
-{
-  Block::Value val;
-  val.type = Block::ValueType::STRING;
-  val.s = new std::string(base_val);
-  set_value(name, val);
-}
-void Block::set_block(const std::string name, Block *bl)
-{
-  Block::Value val;
-  val.type = Block::ValueType::BLOCK;
-  val.bl = new Block();
-  val.bl->copy(bl);
-  set_value(name, val);
 }
-void Block::set_arr(const std::string name, const std::vector<double> &_values)
+
+std::shared_ptr<const Block> Block::freeze() const
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const double &d : _values)
-  {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
-  }
-  set_value(name, val);
+  std::shared_ptr<Block> res = std::make_shared<Block>();
+  res->copy(this);
+  freeze_block(*res);
+  return res;
 }
-void Block::set_arr(const std::string name, const std::vector<float> &_values)
+
+void Block::compact()
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const float &d : _values)
+  flatten(true);
+  //blocks go after their parents
+  std::vector<Block *> blocks = {this};
+  for (size_t i = 0; i < blocks.size(); i++)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    Block &b = *blocks[i];
+    flatten_lazy_dependents(b); //frozen blocks are not bases of lazy blocks
+    for (Block::Value &v : b.values)
+    {
+      if (v.type == Block::ValueType::BLOCK && v.bl)
+        blocks.push_back(v.bl);
+      else if (v.type == Block::ValueType::ARRAY && v.a)
+        v.a->values.shrink_to_fit();
+    }
+    b.names.shrink_to_fit();
+    b.values.shrink_to_fit(); //values are copied shallowly
+    b.name_index.reset();
+    b.sorted_ids.clear();
+    if (b.size() >= MIN_INDEXED_BLOCK_SIZE)
+    {
+      b.sorted_ids.resize(b.size());
+      for (int i = 0; i < b.size(); i++)
+        b.sorted_ids[i] = i;
+      //stable, so the first of duplicate names goes first
+      std::stable_sort(b.sorted_ids.begin(), b.sorted_ids.end(),
+                       [&b](int a, int c) { return b.names[a] < b.names[c]; });
+    }
   }
-  set_value(name, val);
-}
-void Block::set_arr(const std::string name, const std::vector<int> &_values)
-{
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const int &d : _values)
+  //frozen block returns cached hash, so hashes are computed from children to parents before freezing
+  for (size_t i = blocks.size(); i-- > 0;)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    blocks[i]->cached_hash = blocks[i]->get_hash();
+    blocks[i]->frozen = true;
   }
-  set_value(name, val);
 }
-void Block::set_arr(const std::string name, const std::vector<unsigned> &_values)
+
+Block::Layout Block::layout() const
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const unsigned &d : _values)
-  {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
-  }
-  set_value(name, val);
+  if (lazy)
+    return Layout::LAZY;
+  if (!sorted_ids.empty())
+    return Layout::SORTED;
+  return name_index ? Layout::HASHED : Layout::LINEAR;
 }
-void Block::set_arr(const std::string name, const std::vector<short> &_values)
+
+static unsigned reader_slot_id()
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const short &d : _values)
-  {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
-  }
-  set_value(name, val);
+  static std::atomic<unsigned> next_slot(0);
+  thread_local unsigned slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+  return slot;
 }
-void Block::set_arr(const std::string name, const std::vector<unsigned short> &_values)
+
+BlkConfigHandle::BlkConfigHandle(std::shared_ptr<const Block> block)
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::DOUBLE;
-  for (const unsigned short &d : _values)
+  for (ReaderSlot &slot : slots)
   {
-    Block::Value av;
-    av.type = Block::ValueType::DOUBLE;
-    av.d = d;
-    val.a->values.push_back(av);
+    slot.count[0].store(0);
+    slot.count[1].store(0);
   }
-  set_value(name, val);
+  epoch.store(0);
+  current.store(new std::shared_ptr<const Block>(std::move(block)));
 }
-void Block::set_arr(const std::string name, const std::vector<std::string> &_values)
+
+BlkConfigHandle::~BlkConfigHandle()
 {
-  Block::Value val;
-  val.type = Block::ValueType::ARRAY;
-  val.a = new Block::DataArray();
-  val.a->type = Block::ValueType::STRING;
-  for (const std::string &str : _values)
-  {
-    Block::Value av;
-    av.type = Block::ValueType::STRING;
-    av.s = new std::string(str);
-    val.a->values.push_back(av);
-  }
-  set_value(name, val);
+  delete current.load();
 }
-std::string Block::get_name(int id) const
+
+BlkConfigHandle::ReadGuard::ReadGuard(ReadGuard &&g)
 {
-  return (id >= 0 && id < names.size()) ? names[id] : "";
+  counter = g.counter;
+  block = g.block;
+  g.counter = nullptr;
+  g.block = nullptr;
 }
-void Block::add_value(const std::string &name, const Block::Value &value)
+
+BlkConfigHandle::ReadGuard::~ReadGuard()
 {
-  values.push_back(value);
-  names.push_back(name);
+  if (counter)
+    counter->fetch_sub(1);
 }
-void Block::set_value(const std::string &name, const Block::Value &value)
+
+BlkConfigHandle::ReadGuard BlkConfigHandle::read() const
 {
-  int id = get_id(name);
-  if (id >= 0)
+  ReaderSlot &slot = slots[reader_slot_id() % READER_SLOTS];
+  ReadGuard guard;
+  while (true)
   {
-    values[id].copy(value);
+    uint64_t e = epoch.load();
+    slot.count[e & 1].fetch_add(1);
+    //if epoch was switched before the counter was incremented, publish() may not wait for this reader
+    if (epoch.load() == e)
+    {
+      guard.counter = &slot.count[e & 1];
+      break;
+    }
+    slot.count[e & 1].fetch_sub(1);
   }
-  else
-    add_value(name, value);
+  guard.block = current.load()->get();
+  return guard;
 }
 
-void Block::add_detalization(Block &det)
+std::shared_ptr<const Block> BlkConfigHandle::snapshot() const
 {
-  for (int i = 0; i < det.size(); i++)
+  ReaderSlot &slot = slots[reader_slot_id() % READER_SLOTS];
+  while (true)
   {
-    int id = get_id(det.get_name(i));
-    if (id < 0) //add this value to the block 
-    {
-      names.push_back(det.get_name(i));
-      values.emplace_back();
-      values.back().copy(det.values[i]);
-    }
-    else if (values[id].type == det.get_type(i))
+    uint64_t e = epoch.load();
+    slot.count[e & 1].fetch_add(1);
+    if (epoch.load() == e)
     {
-      if (values[id].type == ValueType::BLOCK)
-      {
-        if (values[id].bl && det.values[i].bl)
-          values[id].bl->add_detalization(*(det.values[i].bl));
-      }
-      else
-        values[id].copy(det.values[i]);
-      // fprintf(stderr, "detalization added %s %d %d",det.get_name(i).c_str(),values[id].bl, det.values[i].bl);
+      std::shared_ptr<const Block> res = *(current.load());
+      slot.count[e & 1].fetch_sub(1);
+      return res;
     }
+    slot.count[e & 1].fetch_sub(1);
   }
 }
 
-void Block::copy(const Block *b)
+void BlkConfigHandle::publish(std::shared_ptr<const Block> block)
 {
-  names = b->names;
-  values.resize(b->values.size());
-  for (int i = 0; i < b->names.size(); i++)
-    values[i].copy(b->values[i]);
+  std::lock_guard<std::mutex> lock(publish_mutex);
+  std::shared_ptr<const Block> *old = current.exchange(new std::shared_ptr<const Block>(std::move(block)));
+  uint64_t e = epoch.fetch_add(1);
+  //new readers see the new snapshot, wait for those who could get the old one
+  while (true)
+  {
+    uint64_t readers = 0;
+    for (const ReaderSlot &slot : slots)
+      readers += slot.count[e & 1].load();
+    if (readers == 0)
+      break;
+    std::this_thread::yield();
+  }
+  delete old;
+}
+
+//lazy blocks that use "from" as base are moved to "to" together with its content
+static void move_lazy_links(Block &to, Block &from)
+{
+  to.lazy_dependents = std::move(from.lazy_dependents);
+  from.lazy_dependents.clear();
+  for (Block *dependent : to.lazy_dependents)
+    dependent->lazy->base = &to;
+  if (to.lazy)
+    std::replace(to.lazy->base->lazy_dependents.begin(), to.lazy->base->lazy_dependents.end(), &from, &to);
+}
+
+Block::Block(Block &&b)
+{
+  names = std::move(b.names);
+  values = std::move(b.values);
+  lazy = std::move(b.lazy);
+  move_lazy_links(*this, b);
+  name_index = std::move(b.name_index);
+  sorted_ids = std::move(b.sorted_ids);
+  frozen = b.frozen;
+  cached_hash = b.cached_hash;
+  b.frozen = false;
 }
 
 Block::~Block()
 {
-  clear();
+  //Children are deleted here with explicit stack, their destructors find nothing to do
+  if (values.empty() && !lazy && lazy_dependents.empty())
+    return;
+  std::vector<Block *> blocks = {this};
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    Block *cur = blocks[i];
+    for (Value &v : cur->values)
+      if (v.type == ValueType::BLOCK && v.bl)
+        blocks.push_back(v.bl);
+    if (cur->lazy)
+      for (Value &v : cur->lazy->shadows)
+        if (v.type == ValueType::BLOCK && v.bl)
+          blocks.push_back(v.bl);
+  }
+  //lazy blocks of the tree stop depending on their bases, and lazy blocks outside of the tree
+  //copy everything they need from it while it is still intact
+  for (Block *cur : blocks)
+    if (cur->lazy)
+      remove_lazy_dependent(*cur);
+  for (Block *cur : blocks)
+    flatten_lazy_dependents(*cur);
+  for (Block *cur : blocks)
+  {
+    for (Value &v : cur->values)
+      if (v.type != ValueType::BLOCK)
+        v.clear();
+    cur->values.clear();
+    cur->lazy.reset(); //shadows have only blocks
+    if (cur != this)
+      delete cur;
+  }
 }
 Block &Block::operator=(Block &b)
 {
+  if (&b == this)
+    return *this;
   clear();
   copy(&b);
   return *this;
@@ -1895,5 +6654,12 @@ Block &Block::operator=(Block &&b)
   clear();
   names = std::move(b.names);
   values = std::move(b.values);
+  lazy = std::move(b.lazy);
+  move_lazy_links(*this, b);
+  name_index = std::move(b.name_index);
+  sorted_ids = std::move(b.sorted_ids);
+  frozen = b.frozen;
+  cached_hash = b.cached_hash;
+  b.frozen = false;
   return *this;
 }
\ No newline at end of file
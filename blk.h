@@ -1,6 +1,25 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <type_traits>
+#include <list>
+#include <unordered_map>
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#define BLK_HAS_SPAN 1
+#include <span>
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define BLK_HAS_COROUTINES 1
+#include <coroutine>
+#endif
 #include "LiteMath/LiteMath.h"
 
 using LiteMath::float2;
@@ -15,6 +34,15 @@ using LiteMath::uint2;
 using LiteMath::uint3;
 using LiteMath::uint4;
 
+//128-bit content hash, lo can be used as 64-bit hash
+struct BlkHash
+{
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  bool operator==(const BlkHash &h) const { return lo == h.lo && hi == h.hi; }
+  bool operator!=(const BlkHash &h) const { return !(*this == h); }
+};
+
 struct Block;
 struct Block
 {
@@ -74,79 +102,110 @@ struct Block
     Value(const Value &v)
     {
       type = v.type;
-      if (type == ValueType::INT)
+      switch (type)
+      {
+      case ValueType::BOOL:
+        b = v.b;
+        break;
+      case ValueType::INT:
         i = v.i;
-      if (type == ValueType::UINT64)
+        break;
+      case ValueType::UINT64:
         u = v.u;
-      else if (type == ValueType::BOOL)
-        b = v.b;
-      else if (type == ValueType::DOUBLE)
+        break;
+      case ValueType::DOUBLE:
         d = v.d;
-      else if (type == ValueType::VEC2)
+        break;
+      case ValueType::VEC2:
         v2 = v.v2;
-      else if (type == ValueType::VEC3)
+        break;
+      case ValueType::VEC3:
         v3 = v.v3;
-      else if (type == ValueType::VEC4)
+        break;
+      case ValueType::VEC4:
         v4 = v.v4;
-      else if (type == ValueType::IVEC2)
+        break;
+      case ValueType::IVEC2:
         iv2 = v.iv2;
-      else if (type == ValueType::IVEC3)
+        break;
+      case ValueType::IVEC3:
         iv3 = v.iv3;
-      else if (type == ValueType::IVEC4)
+        break;
+      case ValueType::IVEC4:
         iv4 = v.iv4;
-      else if (type == ValueType::MAT4)
+        break;
+      case ValueType::MAT4:
         m4 = v.m4;
-      else if (type == ValueType::ENUM)
+        break;
+      case ValueType::ENUM:
         ev = v.ev;
-      else if (type == ValueType::STRING)
+        break;
+      case ValueType::STRING:
         s = v.s;
-      else if (type == ValueType::BLOCK)
+        break;
+      case ValueType::BLOCK:
         bl = v.bl;
-      else if (type == ValueType::ARRAY)
+        break;
+      case ValueType::ARRAY:
         a = v.a;
+        break;
+      default:
+        break;
+      }
     }
     void copy(const Value &v)
     {
       clear();
       type = v.type;
-      if (type == ValueType::INT)
+      switch (type)
+      {
+      case ValueType::BOOL:
+        b = v.b;
+        break;
+      case ValueType::INT:
         i = v.i;
-      if (type == ValueType::UINT64)
+        break;
+      case ValueType::UINT64:
         u = v.u;
-      else if (type == ValueType::BOOL)
-        b = v.b;
-      else if (type == ValueType::DOUBLE)
+        break;
+      case ValueType::DOUBLE:
         d = v.d;
-      else if (type == ValueType::VEC2)
+        break;
+      case ValueType::VEC2:
         v2 = v.v2;
-      else if (type == ValueType::VEC3)
+        break;
+      case ValueType::VEC3:
         v3 = v.v3;
-      else if (type == ValueType::VEC4)
+        break;
+      case ValueType::VEC4:
         v4 = v.v4;
-      else if (type == ValueType::IVEC2)
+        break;
+      case ValueType::IVEC2:
         iv2 = v.iv2;
-      else if (type == ValueType::IVEC3)
+        break;
+      case ValueType::IVEC3:
         iv3 = v.iv3;
-      else if (type == ValueType::IVEC4)
+        break;
+      case ValueType::IVEC4:
         iv4 = v.iv4;
-      else if (type == ValueType::MAT4)
+        break;
+      case ValueType::MAT4:
         m4 = v.m4;
-      else if (type == ValueType::ENUM)
+        break;
+      case ValueType::ENUM:
         ev = v.ev;
-      else if (type == ValueType::STRING)
-      {
+        break;
+      case ValueType::STRING:
         s = new std::string();
         if (v.s)
           *s = *v.s;
-      }
-      else if (type == ValueType::BLOCK)
-      {
+        break;
+      case ValueType::BLOCK:
         bl = new Block();
         if (v.bl)
           bl->copy(v.bl);
-      }
-      else if (type == ValueType::ARRAY)
-      {
+        break;
+      case ValueType::ARRAY:
         a = new DataArray();
         if (v.a)
         {
@@ -155,6 +214,9 @@ struct Block
           for (int j=0;j<a->values.size();j++)
             a->values[j].copy(v.a->values[j]);
         }
+        break;
+      default:
+        break;
       }
     }
     inline Value& operator=(const Value& rhs)
@@ -166,6 +228,7 @@ struct Block
     {
     }
     void clear();
+    BlkHash get_hash() const;
   };
 
   struct DataArray
@@ -179,8 +242,11 @@ struct Block
     std::vector<Value> values;
   };
 
+  Block() = default;
+  Block(Block &&b);
   int size() const;
   void clear();
+  //deep copy of b, frozen block is not changed
   void copy(const Block *b);
   ~Block();
   Block &operator=(Block &b);
@@ -192,6 +258,29 @@ struct Block
   ValueType get_type(int id) const;
   ValueType get_type(const std::string &name) const;
 
+  //Maps C++ type to value type, specializations are after Block. Other types can be added the same way,
+  //get is called only for values of TYPE
+  template<typename T>
+  struct ValueTraits;
+
+  template<typename T>
+  T get(int id, T base_val = T()) const;
+  template<typename T>
+  T get(const std::string &name, T base_val = T()) const;
+  template<typename T>
+  void add(const std::string &name, const T &val);
+  template<typename T>
+  void set(const std::string &name, const T &val);
+  //arrays of numbers (stored as doubles) or strings
+  template<typename T>
+  bool get_arr(int id, std::vector<T> &values, bool replace = false) const;
+  template<typename T>
+  bool get_arr(const std::string &name, std::vector<T> &values, bool replace = false) const;
+  template<typename T>
+  void add_arr(const std::string &name, const std::vector<T> &values);
+  template<typename T>
+  void set_arr(const std::string &name, const std::vector<T> &values);
+
   int get_bool(int id, bool base_val = false) const;
   int get_int(int id, int base_val = 0) const;
   uint64_t get_uint64(int id, uint64_t base_val = 0) const;
@@ -206,13 +295,6 @@ struct Block
   unsigned get_enum(int id, unsigned base_val = 0) const;
   std::string get_string(int id, std::string base_val = "") const;
   Block *get_block(int id, Block *base_val = nullptr) const;
-  bool get_arr(int id, std::vector<double> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<float> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<int> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<unsigned> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<short> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<unsigned short> &values, bool replace = false) const;
-  bool get_arr(int id, std::vector<std::string> &values, bool replace = false) const;
 
   int get_bool(const std::string name, bool base_val = false) const;
   int get_int(const std::string name, int base_val = 0) const;
@@ -229,13 +311,6 @@ struct Block
   std::string get_string(const std::string name, std::string base_val = "") const;
   Block *get_block(std::string name, Block *base_val = nullptr) const;
   Block *get_block_rec(std::string name, Block *base_val = nullptr) const; // can find blocks in sub-blocks, e.g "Block1.Block2.Block3"
-  bool get_arr(const std::string name, std::vector<double> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<float> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<int> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<unsigned> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<short> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<unsigned short> &values, bool replace = false) const;
-  bool get_arr(const std::string name, std::vector<std::string> &values, bool replace = false) const;
 
   void add_bool(const std::string name, bool base_val = false);
   void add_int(const std::string name, int base_val = 0);
@@ -251,13 +326,6 @@ struct Block
   void add_enum(const std::string name, const std::string &type_name, unsigned base_val = 0);
   void add_string(const std::string name, std::string base_val = "");
   void add_block(const std::string name, Block *bl = nullptr);
-  void add_arr(const std::string name, std::vector<double> &values);
-  void add_arr(const std::string name, std::vector<float> &values);
-  void add_arr(const std::string name, std::vector<int> &values);
-  void add_arr(const std::string name, std::vector<unsigned> &values);
-  void add_arr(const std::string name, std::vector<short> &values);
-  void add_arr(const std::string name, std::vector<unsigned short> &values);
-  void add_arr(const std::string name, std::vector<std::string> &values);
 
   void set_bool(const std::string name, bool base_val = false);
   void set_int(const std::string name, int base_val = 0);
@@ -273,29 +341,850 @@ struct Block
   void set_enum(const std::string name, const std::string &type_name, unsigned base_val = 0);
   void set_string(const std::string name, std::string base_val = "");
   void set_block(const std::string name, Block *bl);
-  void set_arr(const std::string name, const std::vector<double> &values);
-  void set_arr(const std::string name, const std::vector<float> &values);
-  void set_arr(const std::string name, const std::vector<int> &values);
-  void set_arr(const std::string name, const std::vector<unsigned> &values);
-  void set_arr(const std::string name, const std::vector<short> &values);
-  void set_arr(const std::string name, const std::vector<unsigned short> &values);
-  void set_arr(const std::string name, const std::vector<std::string> &values);
 
   void add_value(const std::string &name, const Value &value);
   void set_value(const std::string &name, const Value &value);
+  //value is moved into the block without copying its string, block or array and is left empty
+  void take_value(const std::string &name, Value &value, bool replace);
 
   void add_detalization(Block &det);
 
+  //Lazy extends (see BlkLoadOptions::lazy_extends). Own entries of such block are only overrides,
+  //all other entries are taken from the base block. Block is flattened (base entries are copied into it)
+  //before it is changed, and before its base is changed or deleted by Block methods
+  struct LazyBase
+  {
+    const Block *base = nullptr;
+    std::vector<int> base_ids; //own entry that overrides base entry or -1, for every base entry
+    std::vector<int> own_ids;  //own entries that are not present in base, they go after base entries
+    std::vector<Value> shadows; //lazy blocks for base sub-blocks that are not overridden, get_block returns them
+  };
+  //makes own entries details of base block, the same as copy(base) + add_detalization(own entries).
+  //The block is registered in base, so it should not be called for the same base from different threads.
+  //Frozen base is never changed, its entries are copied instead
+  void extend_lazy(const Block *base);
+  //copies all entries from base blocks, so the block no longer depends on them
+  void flatten(bool recursive = true);
+  //flattens the block and lazy blocks that use it as base, call it before changing names or values directly
+  void make_mutable();
+  bool is_lazy() const { return lazy != nullptr; }
+  //value by id, for lazy blocks can be a value of the base block
+  const Value &value_at(int id) const;
+
+  //Content hash, the same on all platforms. Enums are hashed by names, sub-blocks by their hashes.
+  //It is cached only in frozen blocks (see freeze and compact), so it is cheap for a frozen subtree
+  //and costs a walk over the block otherwise
+  BlkHash get_hash() const;
+  bool operator==(const Block &b) const;
+  bool operator!=(const Block &b) const { return !(*this == b); }
+
+  //Immutable flattened copy with precomputed hashes and name index for bigger blocks. All const methods
+  //of frozen blocks can be called from many threads at once, changes are refused
+  std::shared_ptr<const Block> freeze() const;
+  bool is_frozen() const { return frozen; }
+  //Freezes the block in place. Entries keep their order and ids, but ids of bigger blocks are also sorted
+  //by name, so get_id does binary search without hash table. Applied to sub-blocks too, clear() undoes it
+  void compact();
+
+  //how get_id finds entries
+  enum class Layout
+  {
+    LINEAR, //names are compared one by one
+    LAZY,   //lazy block, names are searched in base and then in own entries
+    HASHED, //frozen block with hash index of names
+    SORTED  //compacted block, binary search in ids sorted by name
+  };
+  Layout layout() const;
+
   std::vector<std::string> names;
   std::vector<Value> values;
+  std::unique_ptr<LazyBase> lazy;
+  mutable std::vector<Block *> lazy_dependents; //lazy blocks that use this block as base
+  BlkHash cached_hash; //frozen only
+  bool frozen = false;
+  std::unique_ptr<std::unordered_map<std::string_view, int>> name_index; //first id for every name, frozen only
+  std::vector<int> sorted_ids; //ids ordered by name and then by id, compacted only
+
+  //array value that owns copies of values
+  template<typename T>
+  static Value array_value(const std::vector<T> &values);
+};
+
+#define BLK_VALUE_TRAITS(T, VALUE_TYPE, FIELD)                   \
+  template<>                                                     \
+  struct Block::ValueTraits<T>                                   \
+  {                                                              \
+    static constexpr ValueType TYPE = VALUE_TYPE;                \
+    static T get(const Value &v) { return v.FIELD; }             \
+    static void set(Value &v, const T &val) { v.FIELD = val; }   \
+  };
+BLK_VALUE_TRAITS(bool, BOOL, b)
+BLK_VALUE_TRAITS(int, INT, i)
+BLK_VALUE_TRAITS(uint64_t, UINT64, u)
+BLK_VALUE_TRAITS(double, DOUBLE, d)
+BLK_VALUE_TRAITS(float2, VEC2, v2)
+BLK_VALUE_TRAITS(float3, VEC3, v3)
+BLK_VALUE_TRAITS(float4, VEC4, v4)
+BLK_VALUE_TRAITS(int2, IVEC2, iv2)
+BLK_VALUE_TRAITS(int3, IVEC3, iv3)
+BLK_VALUE_TRAITS(int4, IVEC4, iv4)
+BLK_VALUE_TRAITS(float4x4, MAT4, m4)
+#undef BLK_VALUE_TRAITS
+
+template<>
+struct Block::ValueTraits<std::string>
+{
+  static constexpr ValueType TYPE = STRING;
+  static std::string get(const Value &v) { return v.s ? *v.s : std::string(); }
+  static void set(Value &v, const std::string &val) { v.s = new std::string(val); }
+};
+
+template<typename T>
+T Block::get(int id, T base_val) const
+{
+  if (id < 0 || id >= size())
+    return base_val;
+  const Value &v = value_at(id);
+  return v.type == ValueTraits<T>::TYPE ? ValueTraits<T>::get(v) : base_val;
+}
+
+template<typename T>
+T Block::get(const std::string &name, T base_val) const
+{
+  return get<T>(get_id(name), base_val);
+}
+
+template<typename T>
+void Block::add(const std::string &name, const T &val)
+{
+  Value v;
+  v.type = ValueTraits<T>::TYPE;
+  ValueTraits<T>::set(v, val);
+  take_value(name, v, false);
+}
+
+template<typename T>
+void Block::set(const std::string &name, const T &val)
+{
+  Value v;
+  v.type = ValueTraits<T>::TYPE;
+  ValueTraits<T>::set(v, val);
+  take_value(name, v, true);
+}
+
+template<typename T>
+bool Block::get_arr(int id, std::vector<T> &values, bool replace) const
+{
+  static_assert(std::is_arithmetic_v<T> || std::is_same_v<T, std::string>, "arrays hold only numbers or strings");
+  constexpr ValueType elem_type = std::is_same_v<T, std::string> ? STRING : DOUBLE;
+  if (id < 0 || id >= size())
+    return false;
+  const Value &v = value_at(id);
+  if (v.type != ARRAY || !v.a || v.a->type != elem_type)
+    return false;
+  if (replace)
+    values.clear();
+  values.reserve(values.size() + v.a->values.size());
+  for (const Value &av : v.a->values)
+  {
+    if constexpr (std::is_same_v<T, std::string>)
+      values.push_back(av.s ? *av.s : std::string());
+    else
+      values.push_back(static_cast<T>(av.d));
+  }
+  return true;
+}
+
+template<typename T>
+bool Block::get_arr(const std::string &name, std::vector<T> &values, bool replace) const
+{
+  return get_arr(get_id(name), values, replace);
+}
+
+template<typename T>
+Block::Value Block::array_value(const std::vector<T> &values)
+{
+  static_assert(std::is_arithmetic_v<T> || std::is_same_v<T, std::string>, "arrays hold only numbers or strings");
+  Value v;
+  v.type = ARRAY;
+  v.a = new DataArray();
+  v.a->type = std::is_same_v<T, std::string> ? STRING : DOUBLE;
+  v.a->values.resize(values.size());
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    Value &av = v.a->values[i];
+    av.type = v.a->type;
+    if constexpr (std::is_same_v<T, std::string>)
+      av.s = new std::string(values[i]);
+    else
+      av.d = values[i];
+  }
+  return v;
+}
+
+template<typename T>
+void Block::add_arr(const std::string &name, const std::vector<T> &values)
+{
+  Value v = array_value(values);
+  take_value(name, v, false);
+}
+
+template<typename T>
+void Block::set_arr(const std::string &name, const std::vector<T> &values)
+{
+  Value v = array_value(values);
+  take_value(name, v, true);
+}
+
+//Fast construction of big blocks. Values are appended in place, child blocks are moved in and nothing is
+//copied. Duplicate names are kept as Block::add_* does, with unique_names a value with existing name
+//replaces the old one instead, duplicates are found with a hash index of names
+class BlockBuilder
+{
+public:
+  explicit BlockBuilder(size_t reserve_size = 0, bool unique_names = false);
+  BlockBuilder(const BlockBuilder &) = delete;
+  BlockBuilder &operator=(const BlockBuilder &) = delete;
+
+  void reserve(size_t size);
+  size_t size() const { return block.values.size(); }
+
+  template<typename T>
+  BlockBuilder &add(std::string name, const T &val)
+  {
+    Block::Value v;
+    v.type = Block::ValueTraits<T>::TYPE;
+    Block::ValueTraits<T>::set(v, val);
+    return add_value(std::move(name), v);
+  }
+  template<typename T>
+  BlockBuilder &add_arr(std::string name, const std::vector<T> &values)
+  {
+    Block::Value v = Block::array_value(values);
+    return add_value(std::move(name), v);
+  }
+  BlockBuilder &add_tag(std::string name);
+  BlockBuilder &add_block(std::string name, Block &&b);
+  //value is moved into the block and left empty
+  BlockBuilder &add_value(std::string name, Block::Value &value);
+
+  //builder is empty after it and can be reused
+  Block finish();
+
+private:
+  void rehash(size_t size);
+
+  Block block;
+  bool unique_names;
+  std::vector<int> slots; //ids of values by name hash, only with unique_names
+};
+
+struct BlkSaveOptions
+{
+  bool hex_floats = false; //write floating point values as hex-floats (e.g. 0x1.8p+1) instead of shortest decimal form
+  bool minified = false;   //no optional whitespace and shortest type tags
+  bool sync = false;       //save_block_to_file: fsync the file before returning
+  bool atomic = false;     //save_block_to_file: write to <path>.tmp and rename it over <path> when everything is written
+  unsigned threads = 1;    //threads for parallel save of big sub-blocks, 0 - all hardware threads. Output is the same
+  size_t parallel_threshold = 16 * 1024; //smallest sub-block (in values) serialized as a separate task
+};
+
+//Streaming serializer. Text is written into a fixed-size buffer that is flushed to
+//a file descriptor, FILE* or user callback every time it fills up, so the whole
+//document is never kept in memory. Errors are sticky: after the first failed write
+//everything else is dropped and failed() returns true.
+//It can also write into a caller-provided buffer (ENOSPC error if it is too small)
+//or, if this buffer is nullptr, only count bytes.
+class BlockWriter
+{
+public:
+  //should write all size bytes and return true on success
+  using WriteCallback = std::function<bool(const char *data, size_t size)>;
+  static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+  static constexpr size_t MAX_RESERVE = 64;
+
+  BlockWriter(int fd, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  BlockWriter(FILE *file, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  BlockWriter(WriteCallback callback, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  BlockWriter(char *buffer, size_t capacity);
+  BlockWriter(const BlockWriter &) = delete;
+  BlockWriter &operator=(const BlockWriter &) = delete;
+  ~BlockWriter(); //flushes the remaining data, call flush() explicitly to check the result
+
+  bool write_block(const Block &b, const BlkSaveOptions &options = BlkSaveOptions()); //serializes and flushes b
+  bool flush();
+  bool sync(); //flush and fsync the underlying file (no-op for callbacks and buffers)
+  bool failed() const { return error_code != 0; }
+  int error() const { return error_code; } //errno of the first failed write, EIO for failed callbacks
+  size_t bytes_written() const { return flushed + pos; } //including the ones that did not fit into buffer
+
+  inline void write(const char *data, size_t size)
+  {
+    if (size <= capacity - pos)
+    {
+      memcpy(buf + pos, data, size);
+      pos += size;
+    }
+    else
+      write_slow(data, size);
+  }
+  inline void write(const char *str) { write(str, strlen(str)); }
+  inline void write(const std::string &str) { write(str.data(), str.size()); }
+  inline void put(char c)
+  {
+    if (pos == capacity)
+      flush_buffer();
+    buf[pos++] = c;
+  }
+  //returns place for at least size <= MAX_RESERVE bytes, commit(end) marks [place, end) as written
+  inline char *reserve(size_t size)
+  {
+    if (size <= capacity - pos)
+      return buf + pos;
+    return reserve_slow(size);
+  }
+  inline void commit(char *end)
+  {
+    if (in_scratch)
+      commit_scratch(end);
+    else
+      pos = end - buf;
+  }
+
+private:
+  enum class Sink
+  {
+    DESCRIPTOR,
+    STREAM,
+    FUNCTION,
+    MEMORY,
+    COUNTER
+  };
+  void write_slow(const char *data, size_t size);
+  void flush_buffer();
+  bool write_to_sink(const char *data, size_t size);
+  char *reserve_slow(size_t size);
+  void commit_scratch(char *end);
+
+  Sink sink;
+  int fd = -1;
+  FILE *file = nullptr;
+  WriteCallback callback;
+  std::vector<char> own_buffer;
+  char *buf = nullptr;
+  size_t capacity = 0;
+  size_t pos = 0;
+  size_t flushed = 0;
+  int error_code = 0;
+  bool in_scratch = false;
+  char scratch[MAX_RESERVE];
+};
+
+//Merges layers into result in one pass over each layer. The first layer is copied as is (with all
+//duplicate names), each next one is applied with the same rules as add_detalization: a value overrides
+//the first value with the same name if their types match and is ignored if they don't, sub-blocks are
+//merged recursively and values with new names are added to the end. Result should not be one of the layers
+extern void merge_layers(Block &result, const Block *const *layers, size_t count);
+#ifdef BLK_HAS_SPAN
+inline Block merge_layers(std::span<const Block *const> layers)
+{
+  Block result;
+  merge_layers(result, layers.data(), layers.size());
+  return result;
+}
+#endif
+
+//Publishes frozen snapshots to reader threads in RCU style. Readers take no locks, they only increment
+//a counter of the current epoch while they hold ReadGuard. publish() replaces the snapshot, switches
+//the epoch and waits until readers of the previous epoch are finished, then releases the old snapshot.
+//ReadGuard should be held for short time, snapshot() can be used to keep the block for longer
+class BlkConfigHandle
+{
+public:
+  class ReadGuard
+  {
+  public:
+    ReadGuard(ReadGuard &&g);
+    ReadGuard(const ReadGuard &) = delete;
+    ~ReadGuard();
+    const Block *get() const { return block; }
+    const Block *operator->() const { return block; }
+    const Block &operator*() const { return *block; }
+    explicit operator bool() const { return block != nullptr; }
+
+  private:
+    friend class BlkConfigHandle;
+    ReadGuard() = default;
+    std::atomic<uint64_t> *counter = nullptr;
+    const Block *block = nullptr;
+  };
+
+  BlkConfigHandle(std::shared_ptr<const Block> block = nullptr);
+  ~BlkConfigHandle();
+  ReadGuard read() const;
+  std::shared_ptr<const Block> snapshot() const;
+  void publish(std::shared_ptr<const Block> block);
+
+private:
+  static constexpr unsigned READER_SLOTS = 16;
+  struct alignas(64) ReaderSlot
+  {
+    std::atomic<uint64_t> count[2];
+  };
+  mutable ReaderSlot slots[READER_SLOTS];
+  std::atomic<uint64_t> epoch;
+  std::atomic<std::shared_ptr<const Block> *> current;
+  std::mutex publish_mutex;
+};
+
+//Patch that turns block from into block to. Patch is a block with operations, so it can be saved as text
+//or binary and applied on another side with apply_patch. Operations are applied in order:
+//  remove { path:s = "a.b[1].c" }                   removes value
+//  set { path:s = "a.b[1].c" value... }             replaces value (root block if path is empty)
+//  add { path:s = "a.b[1].c" index:i = 3 value... } inserts value c at index 3 of block a.b[1]
+//Path is a list of names separated with '.', name[k] is the k-th value with this name (name is name[0]).
+//Characters '.', '[' and '\' in names are escaped with '\'
+extern Block diff_blocks(const Block &from, const Block &to);
+//all operations are checked before b is changed, so b is left as is if any of them fails.
+//Frozen blocks cannot be patched
+extern bool apply_patch(Block &b, const Block &patch);
+
+class BlkIncludeCache;
+class BlkIncludeGraph;
+//Problem found while parsing, line and column start from 1 and are counted only when parsing ends
+struct BlkDiagnostic
+{
+  enum class Severity
+  {
+    WARNING,
+    ERROR
+  };
+  Severity severity = Severity::ERROR;
+  std::string file; //empty if text was not loaded from file
+  size_t offset = 0; //in bytes from the start of the text
+  int line = 0;
+  int column = 0;
+  std::string message;
+
+  //file:line:column: error: message
+  std::string to_string() const;
+};
+
+struct BlkLoadOptions
+{
+  BlkIncludeCache *include_cache = nullptr; //parsed #include files are taken from this cache if it is set
+  BlkIncludeGraph *include_graph = nullptr; //loaded files and #include dependencies between them are recorded here
+  bool lazy_extends = false; //blocks with extends refer to their parent instead of copying it, see Block::extend_lazy
+  unsigned threads = 0;      //load_blocks_from_files: threads that read and parse files, 0 - all hardware threads
+  unsigned max_depth = 0;    //loading fails if blocks are nested deeper, 0 - no limit
+  const std::atomic<bool> *cancel = nullptr; //parsing stops and fails when it is set
+  //called with parsed and total bytes of the root file about every PROGRESS_STEP bytes and when parsing ends
+  std::function<void(size_t parsed, size_t total)> progress;
+  static constexpr size_t PROGRESS_STEP = 64 * 1024;
+  //Diagnostics of every parsed file are added here, if it is not set they are written to stderr when parsing ends.
+  //Loads running at once can share it, they append under a lock. load_blocks_from_files adds them in the order
+  //of paths. Read it only after the loads are finished
+  std::vector<BlkDiagnostic> *diagnostics = nullptr;
+};
+
+//Dependency graph of loaded files, all paths are canonical. Files are only recorded when they are
+//parsed, so it should be filled together with include cache from the start. Not thread-safe.
+//extends can only reference blocks from the same file, so it adds no dependencies between files
+class BlkIncludeGraph
+{
+public:
+  struct File
+  {
+    std::vector<std::string> includes;
+    std::vector<std::string> included_by;
+  };
+  const std::unordered_map<std::string, File> &get_files() const { return files; }
+  bool has_file(const std::string &path) const { return files.find(path) != files.end(); }
+  //the file and all files that include it directly or indirectly
+  std::vector<std::string> get_affected_files(const std::string &path) const;
+  void clear();
+
+  //used by loader
+  void begin_file(const std::string &path);
+  void add_include(const std::string &path);
+  void end_file();
+
+private:
+  std::unordered_map<std::string, File> files;
+  std::vector<std::string> loading_stack;
+};
+
+//Cache of parsed files for #include. Entries are keyed by canonical path and reused while the
+//file modification time and size (or content hash, if check_content is set) stay the same.
+//Least recently used entries are evicted when there are more than max_entries or their
+//total file size is more than max_bytes. Thread-safe.
+class BlkIncludeCache
+{
+public:
+  struct Stats
+  {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  BlkIncludeCache(size_t max_entries = 256, size_t max_bytes = 64 * 1024 * 1024, bool check_content = false);
+  //parsed block from the file, loads it on miss, nullptr if file cannot be loaded.
+  //Nested includes are loaded with the same options
+  std::shared_ptr<const Block> get(const std::string &path, const BlkLoadOptions &options = BlkLoadOptions());
+  void invalidate(const std::string &path);
+  void clear();
+  Stats stats() const;
+
+private:
+  struct Entry
+  {
+    std::string path;
+    int64_t mtime = 0;
+    uint64_t size = 0;
+    uint64_t content_hash = 0;
+    std::shared_ptr<const Block> block;
+  };
+  void evict();
+
+  size_t max_entries;
+  size_t max_bytes;
+  bool check_content;
+  mutable std::mutex mutex;
+  std::list<Entry> lru; //most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+  Stats counters;
+};
+
+//Resumable text parser, gives the same Block as load_block_from_string. step() parses until the time or
+//byte budget runs out and continues from the same place on the next call, the block is complete when it
+//returns DONE. Files from #include are loaded completely inside one step
+class BlkParser
+{
+public:
+  enum class Status
+  {
+    IN_PROGRESS,
+    DONE,
+    FAILED
+  };
+  struct State;
+
+  BlkParser(std::string text, Block &b, const BlkLoadOptions &options = BlkLoadOptions());
+  //text is not copied, it should live until parsing is finished and text[size] should be 0
+  BlkParser(const char *text, size_t size, Block &b, const BlkLoadOptions &options = BlkLoadOptions());
+  ~BlkParser();
+  //zero budget means no limit
+  Status step(unsigned budget_us, size_t budget_bytes = 0);
+  Status status() const;
+  size_t parsed_bytes() const;
+  size_t total_bytes() const;
+  //used only in diagnostics
+  void set_file_name(const std::string &file);
+  //problems found so far, lines and columns are set when parsing ends
+  const std::vector<BlkDiagnostic> &diagnostics() const;
+
+private:
+  std::unique_ptr<State> state;
+};
+
+extern bool load_block_from_string(const std::string &str, Block &b, const BlkLoadOptions &options = BlkLoadOptions());
+extern bool load_block_from_file(std::string path, Block &b, const BlkLoadOptions &options = BlkLoadOptions());
+//Loads many files in parallel (see BlkLoadOptions::threads), out[i] is loaded from paths[i].
+//Returns true for every file that was read and parsed. If include_graph is set, files are loaded one by one
+extern std::vector<bool> load_blocks_from_files(const std::vector<std::string> &paths, std::vector<Block> &out,
+                                                const BlkLoadOptions &options = BlkLoadOptions());
+
+//runs task on some thread
+using BlkExecutor = std::function<void(std::function<void()> task)>;
+
+//Handle of the load started by load_block_async, copies refer to the same load.
+//With C++20 it can be co_await-ed, the coroutine is resumed on the loading thread
+class BlkAsyncLoad
+{
+public:
+  enum class Status
+  {
+    PENDING,
+    LOADED,
+    FAILED,
+    CANCELLED
+  };
+  struct State;
+
+  BlkAsyncLoad(std::shared_ptr<State> state) : state(std::move(state)) {}
+  Status status() const;
+  bool ready() const { return status() != Status::PENDING; }
+  //loading stops at the next value, the result will be nullptr
+  void cancel();
+  void wait() const;
+  bool wait_for(unsigned timeout_ms) const;
+  //waits for the load, nullptr if it failed or was cancelled
+  std::shared_ptr<Block> get() const;
+  std::shared_future<std::shared_ptr<Block>> get_future() const;
+  //callback is called once on the loading thread, or right away if the load is already finished
+  void then(std::function<void()> callback);
+
+#ifdef BLK_HAS_COROUTINES
+  bool await_ready() const { return ready(); }
+  bool await_suspend(std::coroutine_handle<> handle) { return on_finish([handle]() { handle.resume(); }); }
+  std::shared_ptr<Block> await_resume() const { return get(); }
+#endif
+
+private:
+  //false if the load is already finished, callback is not called then
+  bool on_finish(std::function<void()> callback);
+  std::shared_ptr<State> state;
+};
+
+//Loads file on the executor (internal thread pool if it is not set). #include and extends are handled as in
+//load_block_from_file. options.cancel is replaced by the flag of the returned handle, options.progress is
+//called on the loading thread. Include cache can be shared between loads, include graph can't
+extern BlkAsyncLoad load_block_async(const std::string &path, const BlkLoadOptions &options = BlkLoadOptions(),
+                                     BlkExecutor executor = nullptr);
+
+//Keeps a block loaded from file up to date. When some of the files it was loaded from change, only these
+//files and files that include them are parsed again, the rest is taken from include cache. The loaded tree
+//is patched in place, so blocks and values with unchanged structure stay at the same addresses.
+//File changes are tracked with inotify on Linux and by modification time elsewhere. Files with errors
+//(including failed #include) are not applied, the tree keeps its content until they are fixed
+class BlkHotReloader
+{
+public:
+  BlkHotReloader();
+  ~BlkHotReloader();
+  bool load(const std::string &path);
+  Block &root() { return root_block; }
+  const BlkIncludeGraph &get_include_graph() const { return include_graph; }
+  //reloads changed files, waits for changes up to timeout_ms. Returns true if the tree was updated
+  bool update(int timeout_ms = 0);
+  //reloads given files and everything that depends on them
+  bool reload(const std::vector<std::string> &changed_files);
+  //descriptor to wait on in an event loop, -1 if changes are tracked by polling
+  int get_notify_fd() const { return notify_fd; }
+
+private:
+  void watch_files();
+  std::vector<std::string> changed_files_by_mtime();
+
+  std::string root_path;
+  Block root_block;
+  BlkIncludeCache include_cache;
+  BlkIncludeGraph include_graph;
+  int notify_fd = -1;
+  std::unordered_map<int, std::string> watched_dirs; //watch descriptor -> directory
+  std::unordered_map<std::string, int64_t> mtimes;
+};
+extern void save_block_to_string(std::string &str, Block &b, const BlkSaveOptions &options = BlkSaveOptions());
+extern bool save_block_to_file(std::string path, Block &b, const BlkSaveOptions &options = BlkSaveOptions());
+//exact size of the text save_block_to_string would produce
+extern size_t measure_block(Block &b, const BlkSaveOptions &options = BlkSaveOptions());
+//writes text into caller buffer without '\0' at the end. If it does not fit, returns false and sets size
+//to the required capacity
+extern bool save_block_to_buffer(char *buffer, size_t capacity, size_t &size, Block &b,
+                                 const BlkSaveOptions &options = BlkSaveOptions());
+
+//compact binary format with string table, see blk.cpp for the layout
+extern void save_block_to_binary(std::vector<char> &data, Block &b);
+extern bool save_block_to_binary_file(std::string path, Block &b, const BlkSaveOptions &options = BlkSaveOptions());
+extern bool load_block_from_binary(const char *data, size_t size, Block &b);
+extern bool load_block_from_binary(const std::vector<char> &data, Block &b);
+extern bool load_block_from_binary_file(std::string path, Block &b);
+
+//Read-only view of a block stored in the blk view format (see save_block_to_view).
+//The format is offset-based and aligned, so getters read values directly from the
+//data (e.g. an mmap-ed file) without parsing or allocating anything.
+//The view is valid as long as the underlying data is.
+class BlockView
+{
+public:
+  template <typename T>
+  struct Span
+  {
+    const T *ptr = nullptr;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+  };
+
+  BlockView() = default;
+  BlockView(const char *base, const char *node) : base(base), node(node) {}
+  bool valid() const { return node != nullptr; }
+
+  int size() const;
+  bool has_tag(std::string_view name) const;
+  int get_id(std::string_view name) const;
+  int get_next_id(std::string_view name, int pos) const;
+  std::string_view get_name(int id) const;
+  Block::ValueType get_type(int id) const;
+  Block::ValueType get_type(std::string_view name) const;
+
+  bool get_bool(int id, bool base_val = false) const;
+  int get_int(int id, int base_val = 0) const;
+  uint64_t get_uint64(int id, uint64_t base_val = 0) const;
+  double get_double(int id, double base_val = 0) const;
+  float2 get_vec2(int id, float2 base_val = float2(0, 0)) const;
+  float3 get_vec3(int id, float3 base_val = float3(0, 0, 0)) const;
+  float4 get_vec4(int id, float4 base_val = float4(0, 0, 0, 0)) const;
+  int2 get_ivec2(int id, int2 base_val = int2(0, 0)) const;
+  int3 get_ivec3(int id, int3 base_val = int3(0, 0, 0)) const;
+  int4 get_ivec4(int id, int4 base_val = int4(0, 0, 0, 0)) const;
+  float4x4 get_mat4(int id, float4x4 base_val = float4x4()) const;
+  unsigned get_enum(int id, unsigned base_val = 0) const;
+  std::string_view get_enum_name(int id) const; //name of the enum value, e.g. "A" for :e_MyEnum = A
+  std::string_view get_string(int id, std::string_view base_val = "") const;
+  BlockView get_block(int id) const; //invalid view if there is no block
+  Span<double> get_arr(int id) const; //empty if there is no array of numbers
+  size_t get_arr_size(int id) const;  //works for both number and string arrays
+  std::string_view get_arr_string(int id, size_t index) const;
+
+  bool get_bool(std::string_view name, bool base_val = false) const;
+  int get_int(std::string_view name, int base_val = 0) const;
+  uint64_t get_uint64(std::string_view name, uint64_t base_val = 0) const;
+  double get_double(std::string_view name, double base_val = 0) const;
+  float2 get_vec2(std::string_view name, float2 base_val = float2(0, 0)) const;
+  float3 get_vec3(std::string_view name, float3 base_val = float3(0, 0, 0)) const;
+  float4 get_vec4(std::string_view name, float4 base_val = float4(0, 0, 0, 0)) const;
+  int2 get_ivec2(std::string_view name, int2 base_val = int2(0, 0)) const;
+  int3 get_ivec3(std::string_view name, int3 base_val = int3(0, 0, 0)) const;
+  int4 get_ivec4(std::string_view name, int4 base_val = int4(0, 0, 0, 0)) const;
+  float4x4 get_mat4(std::string_view name, float4x4 base_val = float4x4()) const;
+  unsigned get_enum(std::string_view name, unsigned base_val = 0) const;
+  std::string_view get_string(std::string_view name, std::string_view base_val = "") const;
+  BlockView get_block(std::string_view name) const;
+  Span<double> get_arr(std::string_view name) const;
+
+private:
+  const char *entry(int id) const;
+  const char *base = nullptr; //start of the data, all offsets are from it
+  const char *node = nullptr;
 };
 
-extern bool load_block_from_string(const std::string &str, Block &b);
-extern bool load_block_from_file(std::string path, Block &b);
-extern void save_block_to_string(std::string &str, Block &b);
-extern void save_block_to_file(std::string path, Block &b);
+//read-only memory mapping of a file in blk view format, shared between processes through page cache
+class MappedBlockFile
+{
+public:
+  MappedBlockFile() = default;
+  MappedBlockFile(const MappedBlockFile &) = delete;
+  MappedBlockFile &operator=(const MappedBlockFile &) = delete;
+  ~MappedBlockFile();
+
+  bool open(const std::string &path, bool verify = false); //verify checks all offsets, use it for untrusted files
+  void close();
+  BlockView root() const { return view; }
+
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+  BlockView view;
+#ifdef _WIN32
+  void *file_handle = nullptr;
+  void *mapping_handle = nullptr;
+#endif
+};
+
+//fails if all different strings of the block take more than 4GB, as their offsets are 32-bit
+extern bool save_block_to_view(std::vector<char> &data, Block &b);
+extern bool save_block_to_view_file(std::string path, Block &b, const BlkSaveOptions &options = BlkSaveOptions());
+//checks the header (and all offsets if verify is set) and returns the view of the root block, invalid view on error.
+//data should be 8-byte aligned
+extern BlockView get_block_view(const char *data, size_t size, bool verify = false);
+
+//Read-only document in one array of 64-bit words (tape) and one buffer of names and strings.
+//Every block on the tape is its entries followed by a table of their offsets, so values are found by id
+//without walking the tape and a whole sub-block is skipped at once. Plain documents are parsed straight
+//into the tape, documents with #include, extends or any diagnostics are loaded as Block and converted
+class BlockTape
+{
+public:
+  //getters are the same as in BlockView, the view is valid while the tape is not changed
+  class View
+  {
+  public:
+    View() = default;
+    View(const BlockTape *tape, size_t pos) : tape(tape), pos(pos) {}
+    bool valid() const { return tape != nullptr; }
+
+    int size() const;
+    bool has_tag(std::string_view name) const;
+    int get_id(std::string_view name) const;
+    int get_next_id(std::string_view name, int pos) const;
+    std::string_view get_name(int id) const;
+    Block::ValueType get_type(int id) const;
+    Block::ValueType get_type(std::string_view name) const;
+
+    bool get_bool(int id, bool base_val = false) const;
+    int get_int(int id, int base_val = 0) const;
+    uint64_t get_uint64(int id, uint64_t base_val = 0) const;
+    double get_double(int id, double base_val = 0) const;
+    float2 get_vec2(int id, float2 base_val = float2(0, 0)) const;
+    float3 get_vec3(int id, float3 base_val = float3(0, 0, 0)) const;
+    float4 get_vec4(int id, float4 base_val = float4(0, 0, 0, 0)) const;
+    int2 get_ivec2(int id, int2 base_val = int2(0, 0)) const;
+    int3 get_ivec3(int id, int3 base_val = int3(0, 0, 0)) const;
+    int4 get_ivec4(int id, int4 base_val = int4(0, 0, 0, 0)) const;
+    float4x4 get_mat4(int id, float4x4 base_val = float4x4()) const;
+    unsigned get_enum(int id, unsigned base_val = 0) const;
+    std::string_view get_enum_name(int id) const;
+    std::string_view get_string(int id, std::string_view base_val = "") const;
+    View get_block(int id) const; //invalid view if there is no block
+    BlockView::Span<double> get_arr(int id) const; //empty if there is no array of numbers
+    size_t get_arr_size(int id) const;  //works for both number and string arrays
+    std::string_view get_arr_string(int id, size_t index) const;
+
+    bool get_bool(std::string_view name, bool base_val = false) const;
+    int get_int(std::string_view name, int base_val = 0) const;
+    uint64_t get_uint64(std::string_view name, uint64_t base_val = 0) const;
+    double get_double(std::string_view name, double base_val = 0) const;
+    float2 get_vec2(std::string_view name, float2 base_val = float2(0, 0)) const;
+    float3 get_vec3(std::string_view name, float3 base_val = float3(0, 0, 0)) const;
+    float4 get_vec4(std::string_view name, float4 base_val = float4(0, 0, 0, 0)) const;
+    int2 get_ivec2(std::string_view name, int2 base_val = int2(0, 0)) const;
+    int3 get_ivec3(std::string_view name, int3 base_val = int3(0, 0, 0)) const;
+    int4 get_ivec4(std::string_view name, int4 base_val = int4(0, 0, 0, 0)) const;
+    float4x4 get_mat4(std::string_view name, float4x4 base_val = float4x4()) const;
+    unsigned get_enum(std::string_view name, unsigned base_val = 0) const;
+    std::string_view get_string(std::string_view name, std::string_view base_val = "") const;
+    View get_block(std::string_view name) const;
+    BlockView::Span<double> get_arr(std::string_view name) const;
+
+  private:
+    const uint64_t *entry(int id) const; //header word of the entry, nullptr if there is no such entry
+    const BlockTape *tape = nullptr;
+    size_t pos = 0; //word with the position of the block table
+  };
+
+  //text[size] should be 0. On failure the tape is empty and root() is invalid
+  bool load(const char *text, size_t size);
+  bool load(const std::string &text) { return load(text.c_str(), text.size()); }
+  bool load_from_file(const std::string &path);
+  bool from_block(const Block &b);
+  void clear();
+  View root() const { return words.empty() ? View() : View(this, 0); }
+  size_t tape_size() const { return words.size(); } //in words
+  size_t strings_size() const { return strings.size(); }
+
+private:
+  bool load_text(const char *text, size_t size, const std::string &file);
+  bool parse(const char *text, size_t size);
+  bool add_string(std::string_view s, uint64_t &ref);
+  bool add_entry(Block::ValueType type, std::string_view name);
+  bool add_value(const Block::Value &v);
+  void close_block(size_t block_word, size_t entries_start);
+
+  std::vector<uint64_t> words;
+  std::string strings;
+  std::vector<uint64_t> entries; //offsets of entries of open blocks
+};
 extern std::string base_blk_path;
 
+//enums can be registered and looked up from any thread, registered enums are never changed or moved
 extern void register_enum_info(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values);
 extern const std::vector<std::pair<std::string, unsigned>> *get_enum_info(const std::string &name);
 extern std::vector<const char *> *get_enum_names(unsigned type_id);
@@ -306,4 +1195,202 @@ public:
   BlkEnumLoader(const std::string &name, const std::vector<std::pair<std::string, unsigned>> &values);
 };
 
-#define REGISTER_ENUM(name, values) BlkEnumLoader loader_##name = BlkEnumLoader(#name, (values));
\ No newline at end of file
+#define REGISTER_ENUM(name, values) BlkEnumLoader loader_##name = BlkEnumLoader(#name, (values));
+
+struct BlkEnumValue
+{
+  const char *name;
+  unsigned value;
+};
+
+//hashes used by compile-time enum tables, lookups at runtime use the same functions
+constexpr uint64_t blk_enum_hash(const char *s, size_t len, uint64_t seed)
+{
+  uint64_t h = 0xCBF29CE484222325ull ^ (seed * 0x9E3779B97F4A7C15ull);
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 0x100000001B3ull;
+  h = (h ^ (h >> 32)) * 0xBF58476D1CE4E5B9ull;
+  return h ^ (h >> 29);
+}
+constexpr uint64_t blk_enum_hash(unsigned v, uint64_t seed)
+{
+  uint64_t h = (v + (seed << 32) + 1) * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (h >> 31)) * 0xBF58476D1CE4E5B9ull;
+  return h ^ (h >> 29);
+}
+constexpr size_t blk_enum_strlen(const char *s)
+{
+  size_t len = 0;
+  while (s[len])
+    len++;
+  return len;
+}
+constexpr size_t blk_enum_pow2(size_t n)
+{
+  size_t p = 1;
+  while (p < n)
+    p *= 2;
+  return p;
+}
+
+//perfect hash of enum names or values, key is in slots[hash(key, displacement[hash(key, 0) & bucket_mask]) & slot_mask]
+struct BlkEnumPerfectHash
+{
+  const uint32_t *displacement;
+  const int32_t *slots; //index of the value, -1 for empty slots
+  unsigned bucket_mask;
+  unsigned slot_mask;
+};
+
+//enum registered with REGISTER_ENUM_STATIC, all tables are built at compile time
+struct BlkStaticEnum
+{
+  const char *name;
+  const BlkEnumValue *values;
+  unsigned count;
+  BlkEnumPerfectHash by_name;
+  BlkEnumPerfectHash by_value;
+};
+
+//validates enum values and builds perfect hashes for them, should be used only in constant expressions
+template <size_t N>
+class BlkEnumTable
+{
+public:
+  static constexpr size_t BUCKETS = blk_enum_pow2(N);
+  static constexpr size_t SLOTS = blk_enum_pow2(2 * N);
+  static constexpr uint32_t MAX_DISPLACEMENT = 1 << 16;
+
+  BlkEnumValue values[N] = {};
+  bool valid_names = true;
+  bool unique_names = true;
+  bool unique_values = true;
+  bool hash_failed = false;
+
+  constexpr BlkEnumTable(const BlkEnumValue (&v)[N])
+  {
+    for (size_t i = 0; i < N; i++)
+    {
+      values[i] = v[i];
+      valid_names = valid_names && is_valid_name(v[i].name);
+      for (size_t j = 0; j < i; j++)
+      {
+        unique_names = unique_names && !equal(v[i].name, v[j].name);
+        unique_values = unique_values && v[i].value != v[j].value;
+      }
+    }
+    if (valid_names && unique_names && unique_values)
+      hash_failed = !build(true, name_displacement, name_slots) || !build(false, value_displacement, value_slots);
+  }
+
+  constexpr BlkStaticEnum get_info(const char *name) const
+  {
+    return {name, values, (unsigned)N,
+            {name_displacement, name_slots, (unsigned)BUCKETS - 1, (unsigned)SLOTS - 1},
+            {value_displacement, value_slots, (unsigned)BUCKETS - 1, (unsigned)SLOTS - 1}};
+  }
+
+private:
+  uint32_t name_displacement[BUCKETS] = {};
+  int32_t name_slots[SLOTS] = {};
+  uint32_t value_displacement[BUCKETS] = {};
+  int32_t value_slots[SLOTS] = {};
+
+  static constexpr bool is_valid_name(const char *s)
+  {
+    if (!s || !s[0])
+      return false;
+    for (size_t i = 0; s[i]; i++)
+    {
+      bool letter = (s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') || s[i] == '_';
+      bool digit = s[i] >= '0' && s[i] <= '9';
+      if (!letter && (!digit || i == 0))
+        return false;
+    }
+    return true;
+  }
+  static constexpr bool equal(const char *a, const char *b)
+  {
+    size_t i = 0;
+    while (a[i] && a[i] == b[i])
+      i++;
+    return a[i] == b[i];
+  }
+  constexpr uint64_t key_hash(bool by_name, size_t i, uint64_t seed) const
+  {
+    return by_name ? blk_enum_hash(values[i].name, blk_enum_strlen(values[i].name), seed) : blk_enum_hash(values[i].value, seed);
+  }
+
+  //hash and displace: the biggest buckets are placed first, every bucket gets the first
+  //displacement that moves all its keys to free slots
+  constexpr bool build(bool by_name, uint32_t *displacement, int32_t *slots) const
+  {
+    size_t bucket_of[N] = {};
+    size_t bucket_size[BUCKETS] = {};
+    size_t max_size = 0;
+    for (size_t s = 0; s < SLOTS; s++)
+      slots[s] = -1;
+    for (size_t i = 0; i < N; i++)
+    {
+      bucket_of[i] = key_hash(by_name, i, 0) & (BUCKETS - 1);
+      bucket_size[bucket_of[i]]++;
+      max_size = bucket_size[bucket_of[i]] > max_size ? bucket_size[bucket_of[i]] : max_size;
+    }
+    for (size_t size = max_size; size > 0; size--)
+    {
+      for (size_t b = 0; b < BUCKETS; b++)
+      {
+        if (bucket_size[b] != size)
+          continue;
+        bool placed = false;
+        for (uint32_t d = 1; d < MAX_DISPLACEMENT && !placed; d++)
+        {
+          size_t taken[N] = {};
+          size_t cnt = 0;
+          placed = true;
+          for (size_t i = 0; i < N && placed; i++)
+          {
+            if (bucket_of[i] != b)
+              continue;
+            size_t s = key_hash(by_name, i, d) & (SLOTS - 1);
+            placed = slots[s] < 0;
+            for (size_t k = 0; k < cnt && placed; k++)
+              placed = taken[k] != s;
+            taken[cnt++] = s;
+          }
+          if (placed)
+          {
+            displacement[b] = d;
+            for (size_t i = 0, k = 0; i < N; i++)
+              if (bucket_of[i] == b)
+                slots[taken[k++]] = i;
+          }
+        }
+        if (!placed)
+          return false;
+      }
+    }
+    return true;
+  }
+};
+
+class BlkStaticEnumLoader
+{
+public:
+  //only links the enum to the list of static enums, registry reads them on the first lookup
+  BlkStaticEnumLoader(const BlkStaticEnum &info);
+  const BlkStaticEnum *info;
+  BlkStaticEnumLoader *next = nullptr;
+};
+
+//compile-time alternative to REGISTER_ENUM, e.g. REGISTER_ENUM_STATIC(Color, {"RED", 0}, {"GREEN", 1})
+#define REGISTER_ENUM_STATIC(name, ...)                                                                    \
+  static constexpr BlkEnumValue blk_enum_values_##name[] = {__VA_ARGS__};                                  \
+  static constexpr BlkEnumTable<sizeof(blk_enum_values_##name) / sizeof(BlkEnumValue)>                     \
+      blk_enum_table_##name(blk_enum_values_##name);                                                       \
+  static_assert(blk_enum_table_##name.valid_names, "enum " #name " has invalid value name");               \
+  static_assert(blk_enum_table_##name.unique_names, "enum " #name " has repeated value name");             \
+  static_assert(blk_enum_table_##name.unique_values, "enum " #name " has repeated value");                 \
+  static_assert(!blk_enum_table_##name.hash_failed, "failed to build perfect hash for enum " #name);       \
+  static constexpr BlkStaticEnum blk_enum_##name = blk_enum_table_##name.get_info(#name);                  \
+  static BlkStaticEnumLoader blk_enum_loader_##name(blk_enum_##name);
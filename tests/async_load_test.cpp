@@ -0,0 +1,51 @@
+// async_load_test - checks that an async load of a file with a malformed value finishes as FAILED
+// usage: async_load_test [temp dir]
+//   writes a file with "a:u=abc" into <temp dir> (current directory by default), loads it with
+//   load_block_async and checks that the handle is finished, get() returns nullptr and then() callback
+//   is called. Returns 1 if any check fails
+#include "../blk.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+static bool all_ok = true;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+  all_ok = all_ok && ok;
+}
+
+int main(int argc, char **argv)
+{
+  std::string path = std::string(argc > 1 ? argv[1] : ".") + "/async_load_test.blk";
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f)
+  {
+    fprintf(stderr, "unable to write %s\n", path.c_str());
+    return 1;
+  }
+  fputs("{\n  good:i=1\n  broken{ a:u=abc }\n}\n", f);
+  fclose(f);
+
+  std::atomic<bool> callback_called(false);
+  BlkAsyncLoad load = load_block_async(path);
+  load.then([&]() { callback_called = true; });
+  check(load.wait_for(10000), "load finishes");
+  check(load.status() == BlkAsyncLoad::Status::FAILED, "status is FAILED");
+  check(load.get() == nullptr, "result is nullptr");
+  //promise is set before the callbacks run, so the callback can still be on its way
+  for (int i = 0; i < 1000 && !callback_called; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  check(callback_called, "callback is called");
+
+  //handle that finished already calls the callback right away
+  bool late_callback_called = false;
+  load.then([&]() { late_callback_called = true; });
+  check(late_callback_called, "late callback is called");
+
+  remove(path.c_str());
+  return all_ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+// blk_stress - times whole-tree operations on very deep and very wide blocks
+// usage: blk_stress [depth] [width]
+//   deep tree is a chain of <depth> nested blocks (30000 by default), wide tree is one block with
+//   <width> values (1000000 by default). Every operation must finish without recursion, so deep tree
+//   checks that nothing overflows the stack. Returns 1 if any result is wrong
+#include "../blk.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+
+static bool all_ok = true;
+
+static void run(const char *tree, const char *name, const std::function<bool()> &op)
+{
+  auto start = std::chrono::steady_clock::now();
+  bool ok = op();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("%-6s %-14s %10.2f ms%s\n", tree, name, ms, ok ? "" : "  FAILED");
+  all_ok = all_ok && ok;
+}
+
+static Block *build_deep(int depth)
+{
+  Block *root = new Block();
+  Block *b = root;
+  for (int i = 0; i < depth; i++)
+  {
+    b->add_int("level", i);
+    b->add_block("next");
+    b = b->get_block(b->size() - 1);
+  }
+  b->add_string("leaf", "deepest");
+  return root;
+}
+
+static Block *build_wide(int width)
+{
+  Block *root = new Block();
+  for (int i = 0; i < width; i++)
+  {
+    std::string name = "v" + std::to_string(i % 1000);
+    if (i % 3 == 0)
+      root->add_int(name, i);
+    else if (i % 3 == 1)
+      root->add_string(name, "value " + std::to_string(i));
+    else
+    {
+      root->add_block(name);
+      root->get_block(root->size() - 1)->add_double("d", i * 0.5);
+    }
+  }
+  return root;
+}
+
+//changes the last value of the last sub-block chain, so diff has to walk the whole tree
+static void change_last_value(Block &root)
+{
+  Block *b = &root;
+  while (b->size() > 0 && b->get_block(b->size() - 1))
+    b = b->get_block(b->size() - 1);
+  b->add_int("changed", 1);
+}
+
+static void stress(const char *tree, Block *(*build)(int), int size)
+{
+  Block *b = nullptr;
+  run(tree, "build", [&]() { b = build(size); return true; });
+  std::string text;
+  run(tree, "save text", [&]() { save_block_to_string(text, *b); return !text.empty(); });
+  Block from_text;
+  run(tree, "load text", [&]() { return load_block_from_string(text, from_text) && from_text == *b; });
+  std::vector<char> binary;
+  run(tree, "save binary", [&]() { save_block_to_binary(binary, *b); return !binary.empty(); });
+  Block from_binary;
+  run(tree, "load binary", [&]() { return load_block_from_binary(binary, from_binary) && from_binary == *b; });
+  std::vector<char> view;
+  run(tree, "save view", [&]() { return save_block_to_view(view, *b); });
+  Block copy;
+  run(tree, "copy", [&]() { copy.copy(b); return true; });
+  run(tree, "compare", [&]() { return copy == *b; });
+  run(tree, "hash", [&]() { return copy.get_hash() == b->get_hash(); });
+  std::shared_ptr<const Block> frozen;
+  run(tree, "freeze", [&]() { frozen = b->freeze(); return frozen->get_hash() == b->get_hash(); });
+  change_last_value(copy);
+  Block patch;
+  run(tree, "diff", [&]() { patch = diff_blocks(*b, copy); return patch.size() > 0; });
+  run(tree, "apply patch", [&]() { return apply_patch(from_binary, patch) && from_binary == copy; });
+  Block merged;
+  run(tree, "merge layers", [&]() {
+    const Block *layers[2] = {b, &copy};
+    merge_layers(merged, layers, 2);
+    return merged.size() >= b->size();
+  });
+  run(tree, "destroy", [&]() { delete b; return true; });
+}
+
+int main(int argc, char **argv)
+{
+  int depth = argc > 1 ? atoi(argv[1]) : 30000;
+  int width = argc > 2 ? atoi(argv[2]) : 1000000;
+  if (depth <= 0 || width <= 0)
+  {
+    fprintf(stderr, "usage: blk_stress [depth] [width]\n");
+    return 1;
+  }
+  stress("deep", build_deep, depth);
+  stress("wide", build_wide, width);
+  return all_ok ? 0 : 1;
+}
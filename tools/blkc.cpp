@@ -0,0 +1,71 @@
+// blkc - converts blk files between text and binary formats
+// usage: blkc [-t|-b] [--hex-floats] <input> <output>
+//   input format is detected by the binary magic, output is the other format by default
+//   -t / -b force text / binary output
+#include "../blk.h"
+#include <cstdio>
+#include <cstring>
+
+static bool is_binary_file(const char *path)
+{
+  char magic[4] = {0, 0, 0, 0};
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  size_t read = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  return read == sizeof(magic) && memcmp(magic, "BLKB", sizeof(magic)) == 0;
+}
+
+static void print_usage()
+{
+  fprintf(stderr, "usage: blkc [-t|-b] [--hex-floats] <input> <output>\n");
+}
+
+int main(int argc, char **argv)
+{
+  int force_binary = -1;
+  BlkSaveOptions options;
+  options.atomic = true;
+  const char *paths[2] = {nullptr, nullptr};
+  int paths_count = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-t") == 0)
+      force_binary = 0;
+    else if (strcmp(argv[i], "-b") == 0)
+      force_binary = 1;
+    else if (strcmp(argv[i], "--hex-floats") == 0)
+      options.hex_floats = true;
+    else if (paths_count < 2)
+      paths[paths_count++] = argv[i];
+    else
+    {
+      print_usage();
+      return 1;
+    }
+  }
+  if (paths_count != 2)
+  {
+    print_usage();
+    return 1;
+  }
+
+  Block b;
+  bool input_binary = is_binary_file(paths[0]);
+  bool loaded = input_binary ? load_block_from_binary_file(paths[0], b) : load_block_from_file(paths[0], b);
+  if (!loaded)
+  {
+    fprintf(stderr, "blkc: failed to load %s\n", paths[0]);
+    return 1;
+  }
+
+  bool output_binary = force_binary >= 0 ? force_binary == 1 : !input_binary;
+  bool saved = output_binary ? save_block_to_binary_file(paths[1], b, options) : save_block_to_file(paths[1], b, options);
+  if (!saved)
+  {
+    fprintf(stderr, "blkc: failed to save %s\n", paths[1]);
+    return 1;
+  }
+  return 0;
+}